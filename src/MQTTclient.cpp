@@ -9,16 +9,24 @@
 #include "log.h"
 
 #include "MQTTclient.h"
+#include "metrics.h"
+#include "journal.h"
+#include <lwip/dns.h>
+#include <lwip/sockets.h>
+#include <lwip/tcpip.h>
 
 bool enableMqtt = false;                    // Enable Mqtt, disable to reduce power consumtion, stored in NVS
+extern bool enableWifi;
 
 MQTTclient::MQTTclient() {
   client.setClient(ethClient);
+  client.setBufferSize(MQTT_BUFFER_SIZE);
+  mutex = xSemaphoreCreateMutex();
 }
 MQTTclient::~MQTTclient() {}
 
 bool MQTTclient::isConnected() {
-  return client.connected();
+  return state == MQTT_STATE_CONNECTED;
 }
 
 bool MQTTclient::isReady() {
@@ -26,7 +34,24 @@ bool MQTTclient::isReady() {
   else return false;
 }
 
+const char* MQTTclient::stateName(mqtt_state_t s) {
+  switch (s) {
+    case MQTT_STATE_IDLE:       return "idle";
+    case MQTT_STATE_BACKOFF:    return "backoff";
+    case MQTT_STATE_RESOLVING:  return "resolving";
+    case MQTT_STATE_CONNECTING: return "connecting";
+    case MQTT_STATE_CONNECTED:  return "connected";
+    default:                    return "unknown";
+  }
+}
+
 void MQTTclient::prepare(String host, uint16_t port, String topic, String user, String pass) {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (state == MQTT_STATE_CONNECTED) client.disconnect();
+  ethClient.stop();
+  closeSocket();
+  setState(MQTT_STATE_IDLE);
+
   mqttHost = host;
   mqttPort = port;
   mqttTopic = topic;
@@ -44,77 +69,342 @@ void MQTTclient::prepare(String host, uint16_t port, String topic, String user,
   LOG_INFO(F("[MQTT] Configured broker port: "));
   LOG_INFO_LN(mqttPort);
 
-  IPAddress ip;
-  if (ip.fromString(mqttHost)) { // this is a valid IP
+  // The address is resolved by the state machine, the socket is handed over to PubSubClient
+  // once it is connected, so only the port is required here.
+  if (brokerIp.fromString(mqttHost)) { // this is a valid IP
     LOG_INFO(F("[MQTT] Configured broker IP: "));
-    LOG_INFO_LN(ip.toString());
-    client.setServer(ip, mqttPort);
+    LOG_INFO_LN(brokerIp.toString());
+    client.setServer(brokerIp, mqttPort);
   } else {
     LOG_INFO(F("[MQTT] Configured broker host: "));
     LOG_INFO_LN(mqttHost);
     client.setServer(mqttHost.c_str(), mqttPort);
   }
+  failedAttempts = 0;
+  xSemaphoreGive(mutex);
 }
 
 void MQTTclient::connect() {
   if (!enableMqtt) {
     LOG_INFO_LN(F("[MQTT] disabled!"));
   } else {
-    LOG_INFO_LN(F("[MQTT] Connecting to MQTT..."));
-    client.connect(
-      mqttClientId.c_str(),
-      mqttUser.length() > 0 ? mqttUser.c_str() : NULL,
-      mqttPass.length() > 0 ? mqttPass.c_str() : NULL,
-      0,
-      0,
-      1,
-      0,
-      1
-    );
-    sleep(0.5);
-
-    switch (client.state()) {
-    case MQTT_CONNECTION_TIMEOUT:
-      LOG_INFO_LN(F("[MQTT] ... connection time out"));
-      break;
-    case MQTT_CONNECTION_LOST:
-      LOG_INFO_LN(F("[MQTT] ... connection lost"));
-      break;
-    case MQTT_CONNECT_FAILED:
-      LOG_INFO_LN(F("[MQTT] ... connection failed"));
-      break;
-    case MQTT_DISCONNECTED:
-      LOG_INFO_LN(F("[MQTT] ... disconnected"));
-      break;
-    case MQTT_CONNECTED:
-      LOG_INFO_LN(F("[MQTT] ... connected"));
-      break;
-    case MQTT_CONNECT_BAD_PROTOCOL:
-      LOG_INFO_LN(F("[MQTT] ... connection error: bad protocol"));
+    connectRequested = true;
+  }
+}
+
+void MQTTclient::disconnect() {
+  if (xSemaphoreTake(mutex, pdMS_TO_TICKS(1000)) != pdTRUE) return;
+  if (state == MQTT_STATE_CONNECTED) client.disconnect();
+  ethClient.stop();
+  closeSocket();
+  setState(MQTT_STATE_IDLE);
+  xSemaphoreGive(mutex);
+}
+
+bool MQTTclient::publish(const char* topic, const char* payload, bool retain) {
+  if (state != MQTT_STATE_CONNECTED) return false;
+  // Only wait for a running client.loop() of the background task, never for a connection attempt
+  if (xSemaphoreTake(mutex, pdMS_TO_TICKS(20)) != pdTRUE) return false;
+  bool ret = state == MQTT_STATE_CONNECTED && publishLocked(topic, payload, retain);
+  xSemaphoreGive(mutex);
+  return ret;
+}
+
+// Publish while holding the lock and count the result
+bool MQTTclient::publishLocked(const char* topic, const char* payload, bool retain) {
+  METRICS_SCOPE(metricsMqttPublish);
+  bool ret = client.publish(topic, payload, retain);
+  if (ret) metrics.publishes++;
+  else metrics.publishFailures++;
+  return ret;
+}
+
+// Expects valueBuffer to be filled, builds the topic and publishes while holding the lock
+bool MQTTclient::publishBuffers(const char* name, uint8_t index, bool retain) {
+  if (index) snprintf(topicBuffer, sizeof(topicBuffer), "%s/%s%u", mqttTopic.c_str(), name, index);
+  else snprintf(topicBuffer, sizeof(topicBuffer), "%s/%s", mqttTopic.c_str(), name);
+  return state == MQTT_STATE_CONNECTED && publishLocked(topicBuffer, valueBuffer, retain);
+}
+
+bool MQTTclient::publishInt(const char* name, uint8_t index, int32_t value, bool retain) {
+  if (state != MQTT_STATE_CONNECTED) return false;
+  if (xSemaphoreTake(mutex, pdMS_TO_TICKS(20)) != pdTRUE) return false;
+  snprintf(valueBuffer, sizeof(valueBuffer), "%d", (int)value);
+  bool ret = publishBuffers(name, index, retain);
+  xSemaphoreGive(mutex);
+  return ret;
+}
+
+bool MQTTclient::publishFloat(const char* name, uint8_t index, float value, bool retain) {
+  if (state != MQTT_STATE_CONNECTED) return false;
+  if (xSemaphoreTake(mutex, pdMS_TO_TICKS(20)) != pdTRUE) return false;
+  snprintf(valueBuffer, sizeof(valueBuffer), "%.2f", value);
+  bool ret = publishBuffers(name, index, retain);
+  xSemaphoreGive(mutex);
+  return ret;
+}
+
+void MQTTclient::setState(mqtt_state_t newState) {
+  if (state == newState) return;
+  LOG_INFO_F("[MQTT] State %s -> %s\n", stateName(state), stateName(newState));
+  if (newState == MQTT_STATE_CONNECTED) journal.add(JOURNAL_MQTT, 0, 1, mqttHost.c_str());
+  else if (state == MQTT_STATE_CONNECTED) journal.add(JOURNAL_MQTT, 0, 0, mqttHost.c_str());
+  state = newState;
+  metrics.transitions[newState]++;
+  metrics.stateSince = millis();
+}
+
+// Exponential backoff with equal jitter, so a fleet of sensors does not hammer a restarting broker at once
+void MQTTclient::scheduleRetry() {
+  uint32_t backoff = MQTT_BACKOFF_MIN_MS << (failedAttempts > 16 ? 16 : failedAttempts);
+  if (backoff > MQTT_BACKOFF_MAX_MS || backoff == 0) backoff = MQTT_BACKOFF_MAX_MS;
+  if (failedAttempts < 255) failedAttempts++;
+
+  metrics.currentBackoffMs = backoff / 2 + esp_random() % (backoff / 2 + 1);
+  backoffStart = millis();
+  LOG_INFO_F("[MQTT] Next connection attempt in %u ms\n", metrics.currentBackoffMs);
+  setState(MQTT_STATE_BACKOFF);
+}
+
+bool MQTTclient::networkAvailable() {
+  return enableWifi && WiFi.status() == WL_CONNECTED && (WiFi.getMode() & WIFI_MODE_STA);
+}
+
+// Executed inside the lwIP tcpip thread, as the raw DNS API is not thread safe
+void MQTTclient::dnsStartInTcpip(void *arg) {
+  MQTTclient * self = (MQTTclient *)arg;
+  err_t err = dns_gethostbyname(self->mqttHost.c_str(), &self->dnsResult, &MQTTclient::dnsFoundCallback, self);
+  if (err == ERR_OK) {
+    self->dnsFound = true;
+    self->dnsDone = true;
+  } else if (err != ERR_INPROGRESS) {
+    self->dnsDone = true;
+  }
+}
+
+void MQTTclient::dnsFoundCallback(const char *name, const ip_addr_t *ipaddr, void *arg) {
+  MQTTclient * self = (MQTTclient *)arg;
+  if (ipaddr) {
+    self->dnsResult = *ipaddr;
+    self->dnsFound = true;
+  }
+  self->dnsDone = true;
+}
+
+void MQTTclient::startResolve() {
+  dnsDone = false;
+  dnsFound = false;
+  if (tcpip_callback(&MQTTclient::dnsStartInTcpip, this) != ERR_OK) {
+    LOG_INFO_LN(F("[MQTT] Unable to start DNS lookup"));
+    metrics.dnsFailures++;
+    scheduleRetry();
+  } else setState(MQTT_STATE_RESOLVING);
+}
+
+bool MQTTclient::startTcpConnect() {
+  sockfd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sockfd < 0) return false;
+  lwip_fcntl(sockfd, F_SETFL, lwip_fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(mqttPort);
+  addr.sin_addr.s_addr = (uint32_t)brokerIp;
+
+  int res = lwip_connect(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+  if (res < 0 && errno != EINPROGRESS) {
+    closeSocket();
+    return false;
+  }
+  setState(MQTT_STATE_CONNECTING);
+  return true;
+}
+
+// Returns 1 if the socket is connected, 0 while pending and -1 on errors
+int MQTTclient::pollTcpConnect() {
+  fd_set wset;
+  FD_ZERO(&wset);
+  FD_SET(sockfd, &wset);
+  struct timeval tv = {0, 0};
+
+  int res = lwip_select(sockfd + 1, NULL, &wset, NULL, &tv);
+  if (res < 0) return -1;
+  if (res == 0) return 0;
+
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (lwip_getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) return -1;
+
+  // WiFiClient expects a blocking socket
+  lwip_fcntl(sockfd, F_SETFL, lwip_fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
+  return 1;
+}
+
+void MQTTclient::closeSocket() {
+  if (sockfd >= 0) lwip_close(sockfd);
+  sockfd = -1;
+}
+
+// Send CONNECT over the already established TCP connection and wait for CONNACK.
+// This is the only waiting part and it runs in the background task with a short timeout.
+bool MQTTclient::handshake() {
+  ethClient = WiFiClient(sockfd);
+  sockfd = -1;
+
+  client.setSocketTimeout(MQTT_HANDSHAKE_TIMEOUT_S);
+  client.connect(
+    mqttClientId.c_str(),
+    mqttUser.length() > 0 ? mqttUser.c_str() : NULL,
+    mqttPass.length() > 0 ? mqttPass.c_str() : NULL,
+    0,
+    0,
+    1,
+    0,
+    1
+  );
+  logClientState();
+  return client.connected();
+}
+
+void MQTTclient::loop() {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  if (!enableMqtt || mqttHost.isEmpty() || !networkAvailable()) {
+    if (state == MQTT_STATE_CONNECTED) client.disconnect();
+    if (state != MQTT_STATE_IDLE) {
+      ethClient.stop();
+      closeSocket();
+      setState(MQTT_STATE_IDLE);
+    }
+    xSemaphoreGive(mutex);
+    return;
+  }
+
+  switch (state) {
+    case MQTT_STATE_IDLE:
+      // network just became available, connect right away
+      backoffStart = millis();
+      metrics.currentBackoffMs = 0;
+      setState(MQTT_STATE_BACKOFF);
       break;
-    case MQTT_CONNECT_BAD_CLIENT_ID:
-      LOG_INFO_LN(F("[MQTT] ... connection error: bad client ID"));
+
+    case MQTT_STATE_BACKOFF:
+      if (connectRequested || millis() - backoffStart >= metrics.currentBackoffMs) {
+        connectRequested = false;
+        metrics.connectAttempts++;
+        attemptStarted = millis();
+        LOG_INFO_LN(F("[MQTT] Connecting to MQTT..."));
+        if (brokerIp.fromString(mqttHost)) {
+          if (!startTcpConnect()) {
+            metrics.tcpFailures++;
+            scheduleRetry();
+          }
+        } else startResolve();
+      }
       break;
-    case MQTT_CONNECT_UNAVAILABLE:
-      LOG_INFO_LN(F("[MQTT] ... connection error: unavailable"));
+
+    case MQTT_STATE_RESOLVING:
+      if (dnsDone && dnsFound) {
+        brokerIp = IPAddress(dnsResult.u_addr.ip4.addr);
+        if (!startTcpConnect()) {
+          metrics.tcpFailures++;
+          scheduleRetry();
+        }
+      } else if (dnsDone || millis() - attemptStarted > MQTT_CONNECT_TIMEOUT_MS) {
+        LOG_INFO_F("[MQTT] ... unable to resolve '%s'\n", mqttHost.c_str());
+        metrics.dnsFailures++;
+        scheduleRetry();
+      }
       break;
-    case MQTT_CONNECT_BAD_CREDENTIALS:
-      LOG_INFO_LN(F("[MQTT] ... connection error: bad credentials"));
+
+    case MQTT_STATE_CONNECTING: {
+      int res = pollTcpConnect();
+      if (res > 0) {
+        if (handshake()) {
+          failedAttempts = 0;
+          metrics.currentBackoffMs = 0;
+          setState(MQTT_STATE_CONNECTED);
+        } else {
+          metrics.handshakeFailures++;
+          ethClient.stop();
+          scheduleRetry();
+        }
+      } else if (res < 0 || millis() - attemptStarted > MQTT_CONNECT_TIMEOUT_MS) {
+        LOG_INFO_LN(F("[MQTT] ... connection failed"));
+        metrics.tcpFailures++;
+        closeSocket();
+        scheduleRetry();
+      }
       break;
-    case MQTT_CONNECT_UNAUTHORIZED:
-      LOG_INFO_LN(F("[MQTT] ... connection error: unauthorized"));
+    }
+
+    case MQTT_STATE_CONNECTED:
+      // client.loop() sends the keepalive and processes incoming packets
+      if (!client.loop()) {
+        metrics.connectionsLost++;
+        logClientState();
+        ethClient.stop();
+        scheduleRetry();
+      }
       break;
+
     default:
-      LOG_INFO(F("[MQTT] ... connection error: unknown code "));
-      LOG_INFO_LN(client.state());
       break;
-    }
   }
+  xSemaphoreGive(mutex);
 }
-void MQTTclient::disconnect() {
-  if (client.connected())
-  {
-    client.disconnect();
+
+void MQTTclient::backgroundTask(void *arg) {
+  MQTTclient * self = (MQTTclient *)arg;
+  for (;;) {
+    self->loop();
+    vTaskDelay(pdMS_TO_TICKS(MQTT_TASK_INTERVAL_MS));
+  }
+}
+
+void MQTTclient::startBackgroundTask() {
+  if (taskHandle != NULL) return;
+  xTaskCreate(&MQTTclient::backgroundTask, "mqtt", 4096, this, 1, &taskHandle);
+  LOG_INFO_LN(F("[MQTT] Background task started"));
+}
+
+void MQTTclient::logClientState() {
+  switch (client.state()) {
+  case MQTT_CONNECTION_TIMEOUT:
+    LOG_INFO_LN(F("[MQTT] ... connection time out"));
+    break;
+  case MQTT_CONNECTION_LOST:
+    LOG_INFO_LN(F("[MQTT] ... connection lost"));
+    break;
+  case MQTT_CONNECT_FAILED:
+    LOG_INFO_LN(F("[MQTT] ... connection failed"));
+    break;
+  case MQTT_DISCONNECTED:
+    LOG_INFO_LN(F("[MQTT] ... disconnected"));
+    break;
+  case MQTT_CONNECTED:
+    LOG_INFO_LN(F("[MQTT] ... connected"));
+    break;
+  case MQTT_CONNECT_BAD_PROTOCOL:
+    LOG_INFO_LN(F("[MQTT] ... connection error: bad protocol"));
+    break;
+  case MQTT_CONNECT_BAD_CLIENT_ID:
+    LOG_INFO_LN(F("[MQTT] ... connection error: bad client ID"));
+    break;
+  case MQTT_CONNECT_UNAVAILABLE:
+    LOG_INFO_LN(F("[MQTT] ... connection error: unavailable"));
+    break;
+  case MQTT_CONNECT_BAD_CREDENTIALS:
+    LOG_INFO_LN(F("[MQTT] ... connection error: bad credentials"));
+    break;
+  case MQTT_CONNECT_UNAUTHORIZED:
+    LOG_INFO_LN(F("[MQTT] ... connection error: unauthorized"));
+    break;
+  default:
+    LOG_INFO(F("[MQTT] ... connection error: unknown code "));
+    LOG_INFO_LN(client.state());
+    break;
   }
 }
 
@@ -4,19 +4,41 @@
  * @brief MQTT client library
  * @version 0.1
  * @date 2022-05-29
- * 
+ *
  * @copyright Copyright (c) 2022 by the author alone
  *            https://gitlab.womolin.de/martin.verges/waterlevel
- * 
+ *
  * License: CC BY-NC-SA 4.0
 **/
 
+#ifndef MQTTCLIENT_h
+#define MQTTCLIENT_h
+
 #include <Preferences.h>
 #include <WiFi.h>
 #include <PubSubClient.h>
+#include <lwip/ip_addr.h>
+
+#define MQTT_BACKOFF_MIN_MS 1000                // first retry after a failed connection attempt
+#define MQTT_BACKOFF_MAX_MS 300000              // never wait longer than 5 minutes between attempts
+#define MQTT_CONNECT_TIMEOUT_MS 5000            // give up on DNS or TCP connect after this time
+#define MQTT_HANDSHAKE_TIMEOUT_S 3              // PubSubClient socket timeout while waiting for CONNACK
+#define MQTT_TASK_INTERVAL_MS 50                // how often the background task runs the state machine
+#define MQTT_BUFFER_SIZE 1280                   // max packet size, large enough for batches of buffered readings
+#define MQTT_TOPIC_SIZE 128                     // preallocated buffer for topics built by publishInt/publishFloat
 
 extern bool enableMqtt;
 
+// States of the asynchronous connection state machine
+enum mqtt_state_t : uint8_t {
+    MQTT_STATE_IDLE = 0,                        // nothing to do (disabled or no network)
+    MQTT_STATE_BACKOFF,                         // waiting for the next connection attempt
+    MQTT_STATE_RESOLVING,                       // waiting for the DNS answer
+    MQTT_STATE_CONNECTING,                      // waiting for the TCP connection
+    MQTT_STATE_CONNECTED,                       // MQTT session established
+    MQTT_STATE_COUNT
+};
+
 class MQTTclient {
     public:
         String mqttTopic;
@@ -26,16 +48,85 @@ class MQTTclient {
         String mqttClientId;
         uint16_t mqttPort;
 
+        // Counters of the connection state machine, exposed through the API
+        struct metrics_t {
+            uint32_t transitions[MQTT_STATE_COUNT] = {0}; // how often each state was entered
+            uint32_t connectAttempts = 0;               // started connection attempts
+            uint32_t dnsFailures = 0;                   // failed or timed out name resolutions
+            uint32_t tcpFailures = 0;                   // failed or timed out TCP connects
+            uint32_t handshakeFailures = 0;             // broker refused or did not answer CONNECT
+            uint32_t connectionsLost = 0;               // established sessions that dropped
+            uint32_t publishes = 0;                     // messages handed to the broker connection
+            uint32_t publishFailures = 0;               // messages PubSubClient could not send
+            uint32_t currentBackoffMs = 0;              // delay before the next attempt
+            uint32_t stateSince = 0;                    // millis() when the current state was entered
+        } metrics;
+
 		MQTTclient();
         virtual ~MQTTclient();
 
         bool isConnected();
         bool isReady();
         void prepare(String host, uint16_t port, String topic, String user, String pass);
+
+        // Request an immediate connection attempt, does not block
         void connect();
         void disconnect();
 
+        // Run one step of the connection state machine and the MQTT keepalive
+        void loop();
+
+        // Run loop() in a low priority FreeRTOS task, away from the measurement path
+        void startBackgroundTask();
+
+        // Publish a message if a session is established, never blocks the caller
+        bool publish(const char* topic, const char* payload, bool retain = true);
+
+        // Publish a value to <mqttTopic>/<name><index> (index 0 is omitted) without heap allocations
+        bool publishInt(const char* name, uint8_t index, int32_t value, bool retain = true);
+        bool publishFloat(const char* name, uint8_t index, float value, bool retain = true);
+
+        mqtt_state_t getState() { return state; }
+        static const char* stateName(mqtt_state_t s);
+
         PubSubClient client;
     private:
         WiFiClient ethClient;
+        SemaphoreHandle_t mutex = NULL;
+        char topicBuffer[MQTT_TOPIC_SIZE];
+        char valueBuffer[24];
+
+        bool publishBuffers(const char* name, uint8_t index, bool retain);
+        bool publishLocked(const char* topic, const char* payload, bool retain);
+        TaskHandle_t taskHandle = NULL;
+
+        volatile mqtt_state_t state = MQTT_STATE_IDLE;
+        volatile bool connectRequested = false;
+        uint8_t failedAttempts = 0;
+        uint32_t backoffStart = 0;                  // millis() when the backoff began, compared as a difference to survive the wrap
+        uint32_t attemptStarted = 0;
+
+        int sockfd = -1;
+        IPAddress brokerIp;
+
+        // Written by the lwIP DNS callback in the tcpip thread
+        volatile bool dnsDone = false;
+        volatile bool dnsFound = false;
+        ip_addr_t dnsResult;
+
+        void setState(mqtt_state_t newState);
+        void scheduleRetry();
+        bool networkAvailable();
+        void startResolve();
+        bool startTcpConnect();
+        int pollTcpConnect();
+        void closeSocket();
+        bool handshake();
+        void logClientState();
+
+        static void dnsFoundCallback(const char *name, const ip_addr_t *ipaddr, void *arg);
+        static void dnsStartInTcpip(void *arg);
+        static void backgroundTask(void *arg);
 };
+
+#endif // MQTTCLIENT_h
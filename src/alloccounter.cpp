@@ -0,0 +1,50 @@
+/**
+ * @file alloccounter.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Count heap allocations of a single task to verify allocation free code paths
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "alloccounter.h"
+
+static volatile TaskHandle_t trackedTask = NULL;
+static volatile uint32_t allocations = 0;
+
+extern "C" {
+  void * __real_malloc(size_t size);
+  void * __real_calloc(size_t num, size_t size);
+  void * __real_realloc(void * ptr, size_t size);
+
+  static inline void countAllocation() {
+    if (trackedTask != NULL && xTaskGetCurrentTaskHandle() == trackedTask) allocations++;
+  }
+
+  void * __wrap_malloc(size_t size) {
+    countAllocation();
+    return __real_malloc(size);
+  }
+
+  void * __wrap_calloc(size_t num, size_t size) {
+    countAllocation();
+    return __real_calloc(num, size);
+  }
+
+  void * __wrap_realloc(void * ptr, size_t size) {
+    countAllocation();
+    return __real_realloc(ptr, size);
+  }
+}
+
+void allocCounterTrackCurrentTask() {
+  trackedTask = xTaskGetCurrentTaskHandle();
+}
+
+uint32_t allocCounterGet() {
+  return allocations;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file alloccounter.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Count heap allocations of a single task to verify allocation free code paths
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef ALLOCCOUNTER_h
+#define ALLOCCOUNTER_h
+
+#include <Arduino.h>
+
+// malloc(), calloc() and realloc() are wrapped by the linker (-Wl,--wrap=malloc ...),
+// every call from the tracked task increases the counter.
+
+// Track allocations of the calling task (usually the Arduino loop task)
+void allocCounterTrackCurrentTask();
+
+// Number of allocations of the tracked task since boot
+uint32_t allocCounterGet();
+
+#endif // ALLOCCOUNTER_h
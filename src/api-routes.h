@@ -17,11 +17,19 @@
 #include <FS.h>
 #include <LittleFS.h>
 #include "ble.h"
+#include "dac.h"
+#include "alloccounter.h"
+#include "gzipstatic.h"
+#include "jsonstream.h"
+#include "otaupdate.h"
 #include <esp_ota_ops.h>
+#include <memory>
 
 extern bool otaRunning;
 extern bool enableWifi;
 extern bool enableBle;
+extern bool bleBroadcast;
+extern uint16_t bleAdvInterval;
 extern bool enableMqtt;
 extern bool enableDac;
 
@@ -34,9 +42,447 @@ uint8_t temprature_sens_read();
 #endif
 uint8_t temprature_sens_read();
 
+#define LEVEL_FRESH_TIMEOUT_MS 10000        // answer ?fresh=1 with the last values if no new reading arrives
+#define HISTORY_BATCH 8                     // history records read from RAM or LittleFS at once
+#define HISTORY_AUTO_1M_RANGE 172800        // automatically use 1 minute rollups for up to two days
+#define JOURNAL_BATCH 4                     // journal entries read from LittleFS at once
+
+// Current values of all tanks, taken from the snapshots of the measurement path
+void serializeCurrentLevels(String &output) {
+  DynamicJsonDocument jsonDoc(1024);
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    TANKLEVEL::snapshot_t snapshot = LevelManagers[i]->getSnapshot();
+    jsonDoc[i]["id"] = i;
+    jsonDoc[i]["level"] = snapshot.level;
+    jsonDoc[i]["volume"] = snapshot.volume;
+    jsonDoc[i]["sensorPressure"] = snapshot.sensorPressure;
+    jsonDoc[i]["airPressure"] = snapshot.airPressure;
+    jsonDoc[i]["sensorRaw"] = snapshot.sensorRaw;
+    jsonDoc[i]["error"] = snapshot.error;
+    jsonDoc[i]["configured"] = snapshot.configured;
+    jsonDoc[i]["ageMs"] = (uint32_t)(LevelManagers[i]->runtime() - snapshot.time);
+  }
+  serializeJson(jsonDoc, output);
+}
+
+// Everything reported by /api/esp, captured when the request arrives
+struct espinfo_t {
+  esp_reset_reason_t rebootReason;
+  uint16_t bootCount;
+  uint8_t partitionCount;
+  const esp_partition_t * bootPartition;
+  const esp_partition_t * runningPartition;
+
+  uint32_t heapSize, freeHeap, minFreeHeap, maxAllocHeap, loopTaskAllocs, statusCycleAllocs;
+  uint32_t minLargestBlock;
+  poolstats_t logPool, webPool, jsonPool;
+  HeapSampler::sample_t heapSamples[HEAPSAMPLER_SAMPLES];
+  uint8_t heapSampleCount;
+  uint32_t psramSize, freePsram, minFreePsram, maxAllocPsram;
+
+  uint8_t chipRevision, chipCores;
+  const char * chipModel;
+  uint32_t cpuFreqMHz, cycleCount;
+  const char * sdkVersion;
+  uint64_t efuseMac;
+  float chipTemperature;
+
+  uint32_t flashChipSize, flashChipRealSize, flashChipSpeedMHz;
+  FlashMode_t flashChipMode;
+
+  uint32_t sketchSize, sketchMaxSize;
+  char sketchMD5[33];
+
+  mqtt_state_t mqttState;
+  uint32_t mqttStateSinceMs;
+  MQTTclient::metrics_t mqtt;
+  uint32_t bufferedReadings, droppedReadings;
+
+  uint32_t eventClients, eventsMaxQueued, eventsOverruns, eventsCoalesced;
+  WebSerialClass::metrics_t webserial;
+  LogRing::metrics_t log;
+  uint32_t cacheHits, cacheMisses;
+
+  LoopMonitor::report_t loop;
+
+  burststate_t burst;
+  bool burstMode;
+
+  size_t fsTotalBytes, fsUsedBytes;
+};
+
+// /api/esp serialized for the response, fills a block of the json pool
+struct espinfo_json_t {
+  size_t length;
+  uint8_t data[JSONPOOL_BLOCK_SIZE - sizeof(size_t)];
+};
+
+void captureEspInfo(espinfo_t &info) {
+  info.rebootReason = esp_reset_reason();
+  info.bootCount = journal.getBoot();
+  info.partitionCount = esp_ota_get_app_partition_count();
+  info.bootPartition = esp_ota_get_boot_partition();
+  info.runningPartition = esp_ota_get_running_partition();
+
+  info.heapSize = ESP.getHeapSize();
+  info.freeHeap = ESP.getFreeHeap();
+  info.minFreeHeap = ESP.getMinFreeHeap();
+  info.maxAllocHeap = ESP.getMaxAllocHeap();
+  info.loopTaskAllocs = allocCounterGet();
+  info.statusCycleAllocs = statusCycleAllocs;
+  info.minLargestBlock = heapSampler.getMinLargestBlock();
+  info.logPool = logPool.getStats();
+  info.webPool = webPool.getStats();
+  info.jsonPool = jsonPool.getStats();
+  info.heapSampleCount = heapSampler.getSamples(info.heapSamples, HEAPSAMPLER_SAMPLES);
+  info.psramSize = ESP.getPsramSize();
+  info.freePsram = ESP.getFreePsram();
+  info.minFreePsram = ESP.getMinFreePsram();
+  info.maxAllocPsram = ESP.getMaxAllocPsram();
+
+  info.chipRevision = ESP.getChipRevision();
+  info.chipModel = ESP.getChipModel();
+  info.chipCores = ESP.getChipCores();
+  info.cpuFreqMHz = ESP.getCpuFreqMHz();
+  info.cycleCount = ESP.getCycleCount();
+  info.sdkVersion = ESP.getSdkVersion();
+  info.efuseMac = ESP.getEfuseMac();
+  info.chipTemperature = (temprature_sens_read() - 32) / 1.8;
+
+  info.flashChipSize = ESP.getFlashChipSize();
+  info.flashChipRealSize = spi_flash_get_chip_size();
+  info.flashChipSpeedMHz = ESP.getFlashChipSpeed() / 1000000;
+  info.flashChipMode = ESP.getFlashChipMode();
+
+  info.sketchSize = ESP.getSketchSize();
+  info.sketchMaxSize = ESP.getFreeSketchSpace();
+  strlcpy(info.sketchMD5, ESP.getSketchMD5().c_str(), sizeof(info.sketchMD5));
+
+  info.mqttState = Mqtt.getState();
+  info.mqttStateSinceMs = millis() - Mqtt.metrics.stateSince;
+  info.mqtt = Mqtt.metrics;
+  info.bufferedReadings = 0;
+  info.droppedReadings = 0;
+  for (uint8_t i = 0; i < LEVELMANAGERS; i++) {
+    info.bufferedReadings += ReadingBuffers[i]->count();
+    info.droppedReadings += ReadingBuffers[i]->dropped();
+  }
+
+  info.eventClients = events.count();
+  info.eventsMaxQueued = events.maxQueued();
+  info.eventsOverruns = events.getOverruns();
+  info.eventsCoalesced = statusEventsCoalesced;
+  info.webserial = WebSerial.metrics;
+  info.log = logRing.getMetrics();
+  info.cacheHits = responseCache.hits;
+  info.cacheMisses = responseCache.misses;
+
+  loopMonitor.getReport(info.loop);
+
+  info.burst = burstState;
+  info.burstMode = burstMode;
+
+  info.fsTotalBytes = LittleFS.totalBytes();
+  info.fsUsedBytes = LittleFS.usedBytes();
+}
+
+const char * partitionTypeName(const esp_partition_t * partition) {
+  switch (partition->type) {
+    case ESP_PARTITION_TYPE_APP:  return "app";
+    case ESP_PARTITION_TYPE_DATA: return "data";
+    default: return "any";
+  }
+}
+
+void writePartition(JsonStream &json, const char * name, const esp_partition_t * partition) {
+  json.beginObject(name)
+    .add("address", partition->address)
+    .add("size", partition->size)
+    .add("label", partition->label)
+    .add("encrypted", partition->encrypted)
+    .add("type", partitionTypeName(partition))
+    .add("subtype", (int)partition->subtype)
+    .endObject();
+}
+
+void writePoolStats(JsonStream &json, const char * name, const poolstats_t &stats) {
+  json.beginObject(name)
+    .add("blockSize", stats.blockSize)
+    .add("blocks", stats.blocks)
+    .add("inUse", stats.inUse)
+    .add("peak", stats.peak)
+    .add("acquired", stats.acquired)
+    .add("exhausted", stats.exhausted)
+    .endObject();
+}
+
+void writeEspInfo(Print &output, const espinfo_t &info) {
+  JsonStream json(output);
+  json.beginObject();
+
+  json.beginObject("booting")
+    .add("rebootReason", (int)info.rebootReason)
+    .add("bootCount", info.bootCount)
+    .add("partitionCount", info.partitionCount)
+    .endObject();
+  writePartition(json, "bootPartition", info.bootPartition);
+  writePartition(json, "runningPartition", info.runningPartition);
+
+  json.beginObject("build")
+    .add("date", __DATE__)
+    .add("time", __TIME__)
+    .endObject();
+
+  json.beginObject("ram")
+    .add("heapSize", info.heapSize)
+    .add("freeHeap", info.freeHeap)
+    .add("usagePercent", (float)info.freeHeap / (float)info.heapSize * 100.f)
+    .add("minFreeHeap", info.minFreeHeap)
+    .add("maxAllocHeap", info.maxAllocHeap)
+    .add("loopTaskAllocs", info.loopTaskAllocs)
+    .add("statusCycleAllocs", info.statusCycleAllocs)
+    .add("fragmentationPercent", HeapSampler::fragmentation(info.freeHeap, info.maxAllocHeap))
+    .add("minLargestBlock", info.minLargestBlock)
+    .beginArray("samples");
+  for (uint8_t i = 0; i < info.heapSampleCount; i++) {
+    json.beginObject()
+      .add("uptimeS", info.heapSamples[i].uptimeS)
+      .add("freeHeap", info.heapSamples[i].freeHeap)
+      .add("largestBlock", info.heapSamples[i].largestBlock)
+      .endObject();
+  }
+  json.endArray().endObject();
+
+  json.beginObject("pools");
+  writePoolStats(json, "log", info.logPool);
+  writePoolStats(json, "web", info.webPool);
+  writePoolStats(json, "json", info.jsonPool);
+  json.endObject();
+
+  json.beginObject("spi")
+    .add("psramSize", info.psramSize)
+    .add("freePsram", info.freePsram)
+    .add("minFreePsram", info.minFreePsram)
+    .add("maxAllocPsram", info.maxAllocPsram)
+    .endObject();
+
+  json.beginObject("chip")
+    .add("revision", info.chipRevision)
+    .add("model", info.chipModel)
+    .add("cores", info.chipCores)
+    .add("cpuFreqMHz", info.cpuFreqMHz)
+    .add("cycleCount", info.cycleCount)
+    .add("sdkVersion", info.sdkVersion)
+    .add("efuseMac", info.efuseMac)
+    .add("temperature", info.chipTemperature)
+    .endObject();
+
+  json.beginObject("flash")
+    .add("flashChipSize", info.flashChipSize)
+    .add("flashChipRealSize", info.flashChipRealSize)
+    .add("flashChipSpeedMHz", info.flashChipSpeedMHz)
+    .add("flashChipMode", (int)info.flashChipMode)
+    .endObject();
+
+  json.beginObject("sketch")
+    .add("size", info.sketchSize)
+    .add("maxSize", info.sketchMaxSize)
+    .add("usagePercent", (float)info.sketchSize / (float)info.sketchMaxSize * 100.f)
+    .add("md5", info.sketchMD5)
+    .endObject();
+
+  json.beginObject("mqtt")
+    .add("state", MQTTclient::stateName(info.mqttState))
+    .add("stateSinceMs", info.mqttStateSinceMs)
+    .add("connectAttempts", info.mqtt.connectAttempts)
+    .add("dnsFailures", info.mqtt.dnsFailures)
+    .add("tcpFailures", info.mqtt.tcpFailures)
+    .add("handshakeFailures", info.mqtt.handshakeFailures)
+    .add("connectionsLost", info.mqtt.connectionsLost)
+    .add("backoffMs", info.mqtt.currentBackoffMs)
+    .add("bufferedReadings", info.bufferedReadings)
+    .add("droppedReadings", info.droppedReadings)
+    .beginObject("transitions");
+  for (uint8_t i = 0; i < MQTT_STATE_COUNT; i++) {
+    json.add(MQTTclient::stateName((mqtt_state_t)i), info.mqtt.transitions[i]);
+  }
+  json.endObject().endObject();
+
+  json.beginObject("streams")
+    .add("eventClients", info.eventClients)
+    .add("eventsMaxQueued", info.eventsMaxQueued)
+    .add("eventsOverruns", info.eventsOverruns)
+    .add("eventsCoalesced", info.eventsCoalesced)
+    .add("webserialBatches", info.webserial.batches)
+    .add("webserialDropped", info.webserial.dropped)
+    .add("webserialRejected", info.webserial.rejectedClients)
+    .add("logRecords", info.log.records)
+    .add("logDropped", info.log.dropped)
+    .add("logHighWater", info.log.highWater)
+    .endObject();
+
+  json.beginObject("responseCache")
+    .add("hits", info.cacheHits)
+    .add("misses", info.cacheMisses)
+    .endObject();
+
+  json.beginObject("loop")
+    .add("iterations", info.loop.iterations)
+    .add("avgUs", info.loop.iterations ? (uint32_t)(info.loop.sumUs / info.loop.iterations) : 0)
+    .add("maxUs", info.loop.maxUs)
+    .add("starved", info.loop.starved)
+    .add("resetPhase", info.loop.resetPhase)
+    .beginObject("durationMs");
+  for (uint8_t i = 0; i < LOOPMONITOR_BUCKETS; i++) {
+    char le[8];
+    if (i < LOOPMONITOR_BUCKETS - 1) snprintf(le, sizeof(le), "%u", LoopMonitor::bucketLimitsMs[i]);
+    else strlcpy(le, "inf", sizeof(le));
+    json.add(le, info.loop.buckets[i]);
+  }
+  json.endObject().beginArray("stalls");
+  for (uint8_t i = 0; i < LOOPMONITOR_STALLS && info.loop.stalls[i].durationUs; i++) {
+    json.beginObject()
+      .add("durationUs", info.loop.stalls[i].durationUs)
+      .add("uptimeS", info.loop.stalls[i].uptimeS)
+      .add("phase", info.loop.stalls[i].phase)
+      .endObject();
+  }
+  json.endArray().endObject();
+
+  json.beginArray("tasks");
+  for (uint8_t i = 0; i < info.loop.taskCount; i++) {
+    const LoopMonitor::task_t &task = info.loop.tasks[i];
+    json.beginObject()
+      .add("name", task.name)
+      .add("stackFree", task.stackFree)
+      .add("priority", task.priority)
+      .add("core", task.core)
+      .add("cpuPercent", task.cpuPercent)
+      .endObject();
+  }
+  json.endArray();
+
+  json.beginObject("power")
+    .add("burstMode", info.burstMode)
+    .add("wakeups", info.burst.wakeups)
+    .add("burstCycles", info.burst.cycles)
+    .add("failedJoins", info.burst.failedJoins)
+    .add("lastAwakeMs", info.burst.lastAwakeMs)
+    .endObject();
+
+  json.beginObject("filesystem")
+    .add("type", "LittleFS")
+    .add("totalBytes", info.fsTotalBytes)
+    .add("usedBytes", info.fsUsedBytes)
+    .add("usagePercent", (float)info.fsUsedBytes / (float)info.fsTotalBytes * 100.f)
+    .endObject();
+
+  json.endObject();
+}
+
+// Prometheus text format of the hot path histograms, counters and gauges
+void writeMetrics(Print &out) {
+  MetricsHistogram::writeAll(out);
+
+  metricsWrite(out, "waterlevel_cpu_frequency_hertz", "gauge", "CPU frequency to convert cycles to seconds", (uint64_t)getCpuFrequencyMhz() * 1000000);
+  metricsWrite(out, "waterlevel_uptime_seconds", "gauge", "Seconds since boot", (uint64_t)(esp_timer_get_time() / 1000000));
+  metricsWrite(out, "waterlevel_heap_free_bytes", "gauge", "Free heap", (uint64_t)ESP.getFreeHeap());
+  metricsWrite(out, "waterlevel_heap_min_free_bytes", "gauge", "Lowest free heap since boot", (uint64_t)ESP.getMinFreeHeap());
+  metricsWrite(out, "waterlevel_heap_largest_block_bytes", "gauge", "Largest allocatable heap block", (uint64_t)ESP.getMaxAllocHeap());
+  metricsWrite(out, "waterlevel_heap_fragmentation_percent", "gauge", "Share of the free heap outside the largest block",
+    (uint64_t)HeapSampler::fragmentation(ESP.getFreeHeap(), ESP.getMaxAllocHeap()));
+  metricsWrite(out, "waterlevel_status_cycle_allocations", "gauge", "Heap allocations of the last status update", (uint64_t)statusCycleAllocs);
+  if (WiFi.status() == WL_CONNECTED) {
+    metricsWrite(out, "waterlevel_wifi_rssi_dbm", "gauge", "Signal strength of the WiFi connection", (float)WiFi.RSSI());
+  }
+
+  metricsWrite(out, "waterlevel_mqtt_connected", "gauge", "MQTT session established", (uint64_t)Mqtt.isConnected());
+  metricsWrite(out, "waterlevel_mqtt_connect_attempts_total", "counter", "Started MQTT connection attempts", (uint64_t)Mqtt.metrics.connectAttempts);
+  metricsWrite(out, "waterlevel_mqtt_connections_lost_total", "counter", "Established MQTT sessions that dropped", (uint64_t)Mqtt.metrics.connectionsLost);
+  metricsWrite(out, "waterlevel_mqtt_publishes_total", "counter", "Published MQTT messages", (uint64_t)Mqtt.metrics.publishes);
+  metricsWrite(out, "waterlevel_mqtt_publish_failures_total", "counter", "MQTT messages that could not be sent", (uint64_t)Mqtt.metrics.publishFailures);
+
+  poolstats_t pools[] = { logPool.getStats(), webPool.getStats(), jsonPool.getStats() };
+  const char * poolNames[] = { "log", "web", "json" };
+  metricsWriteHeader(out, "waterlevel_pool_blocks_in_use", "gauge", "Blocks of a buffer pool in use");
+  for (uint8_t i = 0; i < 3; i++) out.printf("waterlevel_pool_blocks_in_use{pool=\"%s\"} %u\n", poolNames[i], pools[i].inUse);
+  metricsWriteHeader(out, "waterlevel_pool_exhausted_total", "counter", "Buffers allocated from the heap because the pool was empty");
+  for (uint8_t i = 0; i < 3; i++) out.printf("waterlevel_pool_exhausted_total{pool=\"%s\"} %u\n", poolNames[i], pools[i].exhausted);
+
+  LogRing::metrics_t log = logRing.getMetrics();
+  metricsWrite(out, "waterlevel_log_records_total", "counter", "Log records written to the log ring", (uint64_t)log.records);
+  metricsWrite(out, "waterlevel_log_dropped_total", "counter", "Log records lost because the log ring was full", (uint64_t)log.dropped);
+
+  metricsWrite(out, "waterlevel_event_clients", "gauge", "Connected event stream clients", (uint64_t)events.count());
+  metricsWrite(out, "waterlevel_response_cache_hits_total", "counter", "API responses served from the cache", (uint64_t)responseCache.hits);
+  metricsWrite(out, "waterlevel_response_cache_misses_total", "counter", "API responses built for the cache", (uint64_t)responseCache.misses);
+
+  auto loop = makePooled<LoopMonitor::report_t>(webPool);
+  loopMonitor.getReport(*loop);
+  metricsWriteHeader(out, "waterlevel_loop_duration_seconds", "histogram", "Duration of a loop() iteration");
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i < LOOPMONITOR_BUCKETS; i++) {
+    cumulative += loop->buckets[i];
+    if (i < LOOPMONITOR_BUCKETS - 1) out.printf("waterlevel_loop_duration_seconds_bucket{le=\"%.3f\"} %u\n", LoopMonitor::bucketLimitsMs[i] / 1000.f, cumulative);
+    else out.printf("waterlevel_loop_duration_seconds_bucket{le=\"+Inf\"} %u\n", cumulative);
+  }
+  out.printf("waterlevel_loop_duration_seconds_sum %.6f\n", loop->sumUs / 1000000.0);
+  out.printf("waterlevel_loop_duration_seconds_count %u\n", loop->iterations);
+  metricsWrite(out, "waterlevel_loop_starved_total", "counter", "Times other tasks kept loop() from running", (uint64_t)loop->starved);
+  metricsWriteHeader(out, "waterlevel_task_stack_free_bytes", "gauge", "Lowest free stack of a task");
+  for (uint8_t i = 0; i < loop->taskCount; i++) {
+    out.printf("waterlevel_task_stack_free_bytes{task=\"%s\"} %u\n", loop->tasks[i].name, loop->tasks[i].stackFree);
+  }
+
+  TANKLEVEL::snapshot_t snapshots[LEVELMANAGERS];
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) snapshots[i] = LevelManagers[i]->getSnapshot();
+
+  metricsWriteHeader(out, "waterlevel_tank_level_percent", "gauge", "Tank level");
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) out.printf("waterlevel_tank_level_percent{tank=\"%u\"} %u\n", i+1, snapshots[i].level);
+  metricsWriteHeader(out, "waterlevel_tank_sensor_pressure", "gauge", "Calculated median sensor reading");
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) out.printf("waterlevel_tank_sensor_pressure{tank=\"%u\"} %d\n", i+1, snapshots[i].sensorPressure);
+  metricsWriteHeader(out, "waterlevel_tank_sensor_error", "gauge", "Sensor not connected or broken");
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) out.printf("waterlevel_tank_sensor_error{tank=\"%u\"} %u\n", i+1, snapshots[i].error);
+  metricsWriteHeader(out, "waterlevel_air_pump_runs_total", "counter", "Air pump runs since boot");
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) out.printf("waterlevel_air_pump_runs_total{tank=\"%u\"} %u\n", i+1, LevelManagers[i]->getAirPumpRuns());
+}
+
+// Check the OTA password of the config, sends the 401 response if it does not match
+bool otaAuthenticate(AsyncWebServerRequest *request) {
+  String otaPassword = "";
+  if (preferences.begin(NVS_NAMESPACE, true)) {
+    otaPassword = preferences.getString("otaPassword");
+    preferences.end();
+
+    if (otaPassword.length()) {
+      if(!request->authenticate("ota", otaPassword.c_str())) {
+        request->send(401, "application/json", "{\"message\":\"Invalid OTA password provided!\"}");
+        return false;
+      }
+    } else LOG_INFO_LN(F("[OTA] No password configured, no authentication requested!"));
+  } else LOG_INFO_LN(F("[OTA] Unable to load password from NVS."));
+  return true;
+}
+
+// Response to an update with the result of the pipeline, error replaces the one reported by it
+void otaSendResult(AsyncWebServerRequest *request, int code, const char * message, const char * error = NULL) {
+  OtaPipeline::progress_t progress = otaPipeline.getProgress();
+  if (error) progress.error = error;
+  char output[256];
+  PrintWindow window((uint8_t *)output, sizeof(output) - 1, 0);
+  JsonStream json(window);
+  json.beginObject().add("message", message);
+  if (progress.error) json.add("error", progress.error);
+  if (progress.sha256[0]) json.add("sha256", (const char *)progress.sha256);
+  json.add("written", progress.written).add("bytesPerSecond", progress.bytesPerSecond).endObject();
+  output[window.length()] = '\0';
+  request->send(code, "application/json", output);
+}
+
 void APIRegisterRoutes() {
   webServer.on("/api/level/data", HTTP_POST, [&](AsyncWebServerRequest * request){}, NULL,
     [&](AsyncWebServerRequest * request, uint8_t *data, size_t len, size_t index, size_t total) {
+    METRICS_HTTP_HANDLER("POST", "/api/level/data");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -57,31 +503,29 @@ void APIRegisterRoutes() {
     
     yield();
     delay(250);
+    for (uint8_t i=0; i < LEVELMANAGERS; i++) Histories[i]->flush(true);
+    journal.flush();
     ESP.restart();
   });
 
 
   webServer.on("/api/level/data", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/level/data");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
 
-    AsyncResponseStream *response = request->beginResponseStream("application/json");
-    DynamicJsonDocument json(3072);
-    json["setupDone"] = LevelManagers[lm-1]->isConfigured();
-
-    const size_t CAPACITY = JSON_ARRAY_SIZE(101);
-    DynamicJsonDocument doc(CAPACITY);
-    JsonArray array = doc.to<JsonArray>();
-    for (int i = 0; i <= 100; i++) array.add(LevelManagers[lm-1]->getLevelData(i));
-    json["data"] = array;
-
-    serializeJson(json, *response);
-    request->send(response);
+    responseCache.send(request, CACHE_SLOT_LEVELDATA(lm-1), LevelManagers[lm-1]->getDataGeneration(), [lm](Print &output) {
+      JsonStream json(output);
+      json.beginObject().add("setupDone", LevelManagers[lm-1]->isConfigured()).beginArray("data");
+      for (int i = 0; i <= 100; i++) json.value(LevelManagers[lm-1]->getLevelData(i));
+      json.endArray().endObject();
+    });
   });
 
 
   webServer.on("/api/firmware/info", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/firmware/info");
     auto data = esp_ota_get_running_partition();
     String output;
     DynamicJsonDocument doc(256);
@@ -93,81 +537,99 @@ void APIRegisterRoutes() {
     doc["encrypted"] = data->encrypted;
     doc["firmware_version"] = AUTO_FW_VERSION;
     doc["firmware_date"] = AUTO_FW_DATE;
+    doc["sha256"] = runningFirmwareSha256();
     serializeJson(doc, output);
     request->send(200, "application/json", output);
   });
 
-    webServer.on("/api/update/upload", HTTP_POST,
+  webServer.on("/api/update/upload", HTTP_POST,
     [&](AsyncWebServerRequest *request) { },
     [&](AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
 
-    String otaPassword = "";
-    if (preferences.begin(NVS_NAMESPACE, true)) {
-      otaPassword = preferences.getString("otaPassword");
-      preferences.end();
-
-      if (otaPassword.length()) {
-        if(!request->authenticate("ota", otaPassword.c_str())) {
-          return request->send(401, "application/json", "{\"message\":\"Invalid OTA password provided!\"}");
-        }
-      } else LOG_INFO_LN(F("[OTA] No password configured, no authentication requested!"));
-    } else LOG_INFO_LN(F("[OTA] Unable to load password from NVS."));
-
     if (!index) {
-      otaRunning = true;
+      METRICS_HTTP_HANDLER("POST", "/api/update/upload");
+      // Authenticate once, later chunks only belong to the update if it was started for this request
+      if (!otaAuthenticate(request)) return;
+      if (otaPipeline.isRunning()) return request->send(409, "application/json", "{\"message\":\"Another update is running!\"}");
+
       LOG_INFO(F("[OTA] Begin firmware update with filename: "));
       LOG_INFO_LN(filename);
       // if filename includes spiffs|littlefs, update the spiffs|littlefs partition
       int cmd = (filename.indexOf("spiffs") > -1 || filename.indexOf("littlefs") > -1) ? U_SPIFFS : U_FLASH;
-      if (!Update.begin(UPDATE_SIZE_UNKNOWN, cmd)) {
-        LOG_INFO(F("[OTA] Error: "));
-        Update.printError(Serial);
-        request->send(500, "application/json", "{\"message\":\"Unable to begin firmware update!\"}");
-        otaRunning = false;
+      if (!otaPipeline.begin(cmd, request->contentLength(), request)) {
+        return otaSendResult(request, 500, "Unable to begin firmware update!");
       }
+      request->onDisconnect([request]() { otaPipeline.abort(request); });
     }
+    if (!otaPipeline.isOwner(request)) return;
 
-    if (Update.write(data, len) != len) {
-      LOG_INFO(F("[OTA] Error: "));
-      Update.printError(Serial);
-      request->send(500, "application/json", "{\"message\":\"Unable to write firmware update data!\"}");
-      otaRunning = false;
+    if (!otaPipeline.write(data, len)) {
+      otaPipeline.abort(request);
+      return otaSendResult(request, 500, "Unable to write firmware update data!");
     }
 
     if (final) {
-      if (!Update.end(true)) {
-        String output;
-        DynamicJsonDocument doc(32);
-        doc["message"] = "Update error";
-        doc["error"] = Update.errorString();
-        serializeJson(doc, output);
-        request->send(500, "application/json", output);
-
-        LOG_INFO_LN("[OTA] Error when calling calling Update.end().");
-        Update.printError(Serial);
-        otaRunning = false;
-      } else {
-        LOG_INFO_LN("[OTA] Firmware update successful.");
-        request->send(200, "application/json", "{\"message\":\"Please wait while the device reboots!\"}");
-        yield();
-        delay(250);
-
-        LOG_INFO_LN("[OTA] Update complete, rebooting now!");
-        Serial.flush();
-        ESP.restart();
+      // Optional checksum of the uploaded file, compared with the hash calculated while writing
+      String sha256 = request->hasHeader("X-Update-SHA256") ? request->header("X-Update-SHA256")
+        : (request->hasParam("sha256") ? request->getParam("sha256")->value() : String());
+      if (!otaPipeline.end(sha256.c_str())) return otaSendResult(request, 500, "Update error");
+
+      otaSendResult(request, 200, "Please wait while the device reboots!");
+      yield();
+      delay(250);
+
+      LOG_INFO_LN("[OTA] Update complete, rebooting now!");
+      // The filesystem must not be written after its partition was replaced
+      if (filename.indexOf("spiffs") < 0 && filename.indexOf("littlefs") < 0) {
+        for (uint8_t i=0; i < LEVELMANAGERS; i++) Histories[i]->flush(true);
+        journal.add(JOURNAL_UPDATE, 0, 1, "web");
+        journal.flush();
       }
+      logRing.flush();
+      ESP.restart();
     }
   });
 
-  events.onConnect([&](AsyncEventSourceClient *client){
-    if(client->lastId()){
-      LOG_INFO_F("Client reconnected! Last message ID that it got is: %u\n", client->lastId());
+  webServer.on("/api/update/delta", HTTP_POST,
+    [&](AsyncWebServerRequest *request) { },
+    [&](AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
+
+    if (!index) {
+      METRICS_HTTP_HANDLER("POST", "/api/update/delta");
+      if (!otaAuthenticate(request)) return;
+      if (!otaDelta.begin(request)) return request->send(409, "application/json", "{\"message\":\"Another update is running!\"}");
+
+      LOG_INFO(F("[OTA] Begin delta firmware update with filename: "));
+      LOG_INFO_LN(filename);
+      request->onDisconnect([request]() { otaDelta.abort(request); });
+    }
+    if (!otaDelta.isOwner(request)) return;
+
+    if (!otaDelta.write(data, len)) {
+      return otaSendResult(request, 500, "Unable to apply the firmware patch!", otaDelta.getError());
+    }
+
+    if (final) {
+      if (!otaDelta.end()) return otaSendResult(request, 500, "Update error", otaDelta.getError());
+
+      otaSendResult(request, 200, "Please wait while the device reboots!");
+      yield();
+      delay(250);
+
+      LOG_INFO_LN("[OTA] Delta update complete, rebooting now!");
+      for (uint8_t i=0; i < LEVELMANAGERS; i++) Histories[i]->flush(true);
+      journal.add(JOURNAL_UPDATE, 0, 1, "delta");
+      journal.flush();
+      logRing.flush();
+      ESP.restart();
     }
-    client->send("connected", NULL, millis(), 1000);
   });
+
+  events.onConnect(onEventsConnect);
   webServer.addHandler(&events);
 
   webServer.on("/api/rawvalue", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/rawvalue");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -182,6 +644,7 @@ void APIRegisterRoutes() {
   });
 
   webServer.on("/api/restore/pressure", HTTP_POST, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("POST", "/api/restore/pressure");
     AsyncResponseStream *response = request->beginResponseStream("application/json");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
@@ -189,23 +652,27 @@ void APIRegisterRoutes() {
 
     // FIXME: Add support for second airpump
     LOG_INFO_LN(F("[AIRPUMP] Restoring pressure in the tube"));
-    LevelManagers[lm-1]->activateAirPump();
+    LevelManagers[lm-1]->activateAirPump("Requested through the API");
 
     request->send(200, "application/json", "{\"message\":\"Restoring pressure in the tube!\"}");
     request->send(response);
   });
 
   webServer.on("/api/reset", HTTP_POST, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("POST", "/api/reset");
     AsyncResponseStream *response = request->beginResponseStream("application/json");
     request->send(200, "application/json", "{\"message\":\"Resetting the sensor!\"}");
     request->send(response);
     yield();
     delay(250);
+    for (uint8_t i=0; i < LEVELMANAGERS; i++) Histories[i]->flush(true);
+    journal.flush();
     ESP.restart();
   });
 
   webServer.on("/api/config", HTTP_POST, [&](AsyncWebServerRequest * request){}, NULL,
     [&](AsyncWebServerRequest * request, uint8_t *data, size_t len, size_t index, size_t total) {
+    METRICS_HTTP_HANDLER("POST", "/api/config");
 
     DynamicJsonDocument jsonBuffer(1024);
     deserializeJson(jsonBuffer, (const char*)data);
@@ -232,6 +699,14 @@ void APIRegisterRoutes() {
 
       preferences.putString("softAPPassword", jsonBuffer["softAPPassword"].as<String>());  
 
+      // Taken over by the restart of the BLE stack below
+      bleBroadcast = jsonBuffer["bleBroadcast"].as<boolean>();
+      preferences.putBool("bleBroadcast", bleBroadcast);
+      if (jsonBuffer.containsKey("bleAdvInterval")) {
+        bleAdvInterval = max((uint16_t)BLE_BROADCAST_MIN_INTERVAL, jsonBuffer["bleAdvInterval"].as<uint16_t>());
+        preferences.putUShort("bleAdvInterval", bleAdvInterval);
+      }
+
       if (preferences.putBool("enableBle", jsonBuffer["enableBle"].as<boolean>())) {
         if (enableBle) stopBleServer();
         enableBle = jsonBuffer["enableBle"].as<boolean>();
@@ -267,6 +742,13 @@ void APIRegisterRoutes() {
       preferences.putString("mqttTopic", jsonBuffer["mqttTopic"].as<String>());
       preferences.putString("mqttUser", jsonBuffer["mqttUser"].as<String>());
       preferences.putString("mqttPass", jsonBuffer["mqttPass"].as<String>());
+      preferences.putBool("burstMode", jsonBuffer["burstMode"].as<boolean>());
+      if (!jsonBuffer["burstMode"].as<boolean>()) {
+        // The copy of the WiFi credentials is only needed to rejoin after a burst wakeup
+        preferences.remove("burstSsid");
+        preferences.remove("burstPass");
+      }
+      preferences.putUChar("burstEvery", max((uint8_t)1, jsonBuffer["burstEvery"].as<uint8_t>()));
       if (preferences.putBool("enableMqtt", jsonBuffer["enableMqtt"].as<boolean>())) {
         if (enableMqtt) Mqtt.disconnect();
         enableMqtt = jsonBuffer["enableMqtt"].as<boolean>();
@@ -278,52 +760,108 @@ void APIRegisterRoutes() {
             jsonBuffer["mqttUser"].as<String>(),
             jsonBuffer["mqttPass"].as<String>()
           );
+          Mqtt.startBackgroundTask();
           Mqtt.connect();
         }
       }
     }
     preferences.end();
+    configGeneration++;
     
     request->send(200, "application/json", "{\"message\":\"New configuration stored in NVS, reboot required!\"}");
   });
 
   webServer.on("/api/config", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/config");
     if (request->contentType() == "application/json") {
-      String output;
-      DynamicJsonDocument doc(1024);
-
-      if (preferences.begin(NVS_NAMESPACE, true)) {
-        doc["hostname"] = hostname;
-        doc["enableWifi"] = enableWifi;
-        doc["shutDownWifiMin"] = preferences.getUShort("shutDownWifiMin", 0);
-        doc["enableSoftAp"] = WifiManager.getFallbackState();
-        doc["softAPPassword"] = preferences.getString("softAPPassword");
-        
-        doc["enableBle"] = enableBle;
-        doc["enableDac"] = enableDac;
-
-        doc["otaPassword"] = preferences.getString("otaPassword");
-        doc["autoAirPump"] = preferences.getBool("autoAirPump", true);
-        doc["airPumpOnBoot"] = preferences.getBool("airPumpOnBoot", true);
-        doc["pressureThresh"] = preferences.getUInt("pressureThresh", 10);
-
-        // MQTT
-        doc["enableMqtt"] = enableMqtt;
-        doc["mqttPort"] = preferences.getUInt("mqttPort", 1883);
-        doc["mqttHost"] = preferences.getString("mqttHost", "");
-        doc["mqttTopic"] = preferences.getString("mqttTopic", "");
-        doc["mqttUser"] = preferences.getString("mqttUser", "");
-        doc["mqttPass"] = preferences.getString("mqttPass", "");
-      }
-      preferences.end();
+      // The SoftAP fallback can also be changed by the WifiManager routes
+      uint32_t generation = configGeneration << 1 | WifiManager.getFallbackState();
+      responseCache.send(request, CACHE_SLOT_CONFIG, generation, [](Print &output) {
+        DynamicJsonDocument doc(1024);
+
+        if (preferences.begin(NVS_NAMESPACE, true)) {
+          doc["hostname"] = hostname;
+          doc["enableWifi"] = enableWifi;
+          doc["shutDownWifiMin"] = preferences.getUShort("shutDownWifiMin", 0);
+          doc["enableSoftAp"] = WifiManager.getFallbackState();
+          doc["softAPPassword"] = preferences.getString("softAPPassword");
+          
+          doc["enableBle"] = enableBle;
+          doc["bleBroadcast"] = bleBroadcast;
+          doc["bleAdvInterval"] = bleAdvInterval;
+          doc["enableDac"] = enableDac;
+
+          doc["otaPassword"] = preferences.getString("otaPassword");
+          doc["autoAirPump"] = preferences.getBool("autoAirPump", true);
+          doc["airPumpOnBoot"] = preferences.getBool("airPumpOnBoot", true);
+          doc["pressureThresh"] = preferences.getUInt("pressureThresh", 10);
+
+          // MQTT
+          doc["enableMqtt"] = enableMqtt;
+          doc["mqttPort"] = preferences.getUInt("mqttPort", 1883);
+          doc["mqttHost"] = preferences.getString("mqttHost", "");
+          doc["mqttTopic"] = preferences.getString("mqttTopic", "");
+          doc["mqttUser"] = preferences.getString("mqttUser", "");
+          doc["mqttPass"] = preferences.getString("mqttPass", "");
+          doc["burstMode"] = preferences.getBool("burstMode", false);
+          doc["burstEvery"] = preferences.getUChar("burstEvery", burstEvery);
+        }
+        preferences.end();
 
-      serializeJson(doc, output);
-      request->send(200, "application/json", output);
+        serializeJson(doc, output);
+      });
     } else request->send(415, "text/plain", "Unsupported Media Type");
   });
 
+  #if HAS_DAC_INSTALLED
+  webServer.on("/api/dac", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/dac");
+    dac_config_t config = dacGetConfig();
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    JsonStream json(*response);
+    json.beginObject().beginArray("points");
+    for (uint8_t i = 0; i < DAC_CAL_POINTS; i++) json.value(config.points[i]);
+    json.endArray().add("slew", config.slew).add("dither", config.dither).beginArray("outputs");
+    for (uint8_t ch = 0; ch < 2; ch++) json.value(dacOutput[ch] < 0 ? 0.0 : dacOutput[ch], 1);
+    json.endArray().endObject();
+    request->send(response);
+  });
+
+  webServer.on("/api/dac", HTTP_POST, [&](AsyncWebServerRequest * request){}, NULL,
+    [&](AsyncWebServerRequest * request, uint8_t *data, size_t len, size_t index, size_t total) {
+    METRICS_HTTP_HANDLER("POST", "/api/dac");
+
+    DynamicJsonDocument jsonBuffer(512);
+    deserializeJson(jsonBuffer, (const char*)data, len);
+
+    dac_config_t config = dacGetConfig();
+    JsonArray points = jsonBuffer["points"].as<JsonArray>();
+    if (!points.isNull()) {
+      if (points.size() != DAC_CAL_POINTS) return request->send(422, "application/json", "{\"message\":\"Invalid number of calibration points!\"}");
+      uint8_t i = 0;
+      for (JsonVariant v : points) {
+        uint16_t mv = v.as<uint16_t>();
+        if (mv > DAC_VCC) return request->send(422, "application/json", "{\"message\":\"Calibration point above the supply voltage!\"}");
+        config.points[i++] = mv;
+      }
+    }
+    if (jsonBuffer.containsKey("slew")) config.slew = jsonBuffer["slew"].as<uint16_t>();
+    if (jsonBuffer.containsKey("dither")) config.dither = jsonBuffer["dither"].as<boolean>();
+
+    // Spare the flash if nothing changed
+    if (dacSetConfig(config) && preferences.begin(NVS_NAMESPACE)) {
+      preferences.putBytes("dacCal", config.points, sizeof(config.points));
+      preferences.putUShort("dacSlew", config.slew);
+      preferences.putBool("dacDither", config.dither);
+      preferences.end();
+    }
+    request->send(200, "application/json", "{\"message\":\"DAC configuration updated!\"}");
+  });
+  #endif
+
   // unevenly shaped tank setup
   webServer.on("/api/setup/start", HTTP_POST, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("POST", "/api/setup/start");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -335,6 +873,7 @@ void APIRegisterRoutes() {
   });
 
   webServer.on("/api/setup/status", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/setup/status");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -349,6 +888,7 @@ void APIRegisterRoutes() {
   });
 
   webServer.on("/api/setup/end", HTTP_POST, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("POST", "/api/setup/end");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -360,6 +900,7 @@ void APIRegisterRoutes() {
   });
 
   webServer.on("/api/setup/abort", HTTP_POST, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("POST", "/api/setup/abort");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -373,6 +914,7 @@ void APIRegisterRoutes() {
   // Set the tank volume
   webServer.on("/api/setup/volume", HTTP_POST, [&](AsyncWebServerRequest * request){}, NULL,
     [&](AsyncWebServerRequest * request, uint8_t *data, size_t len, size_t index, size_t total) {
+    METRICS_HTTP_HANDLER("POST", "/api/setup/volume");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -400,6 +942,7 @@ void APIRegisterRoutes() {
   // uniformed tank setup
   webServer.on("/api/setup/values", HTTP_POST, [&](AsyncWebServerRequest * request){}, NULL,
     [&](AsyncWebServerRequest * request, uint8_t *data, size_t len, size_t index, size_t total) {
+    METRICS_HTTP_HANDLER("POST", "/api/setup/values");
     uint8_t lm = 1;
     if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
     if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
@@ -425,24 +968,235 @@ void APIRegisterRoutes() {
   });
 
   webServer.on("/api/level/current/all", HTTP_GET, [&](AsyncWebServerRequest *request) {
-    String output;
-    DynamicJsonDocument jsonDoc(1024);
+    METRICS_HTTP_HANDLER("GET", "/api/level/current/all");
+    if (!request->hasParam("fresh") || request->getParam("fresh")->value() != "1") {
+      String output;
+      serializeCurrentLevels(output);
+      return request->send(200, "application/json", output);
+    }
 
+    // Wait for the next reading of all tanks without blocking the TCP task.
+    // The chunked response is polled by AsyncTCP as long as it returns RESPONSE_TRY_AGAIN.
+    struct fresh_t {
+      uint32_t samples[LEVELMANAGERS];
+      uint64_t started;
+      String output;
+    };
+    auto fresh = makePooled<fresh_t>(webPool);
     for (uint8_t i=0; i < LEVELMANAGERS; i++) {
-        jsonDoc[i]["id"] = i;
-        jsonDoc[i]["level"] = LevelManagers[i]->getLevel();
-        jsonDoc[i]["volume"] = LevelManagers[i]->getCurrentVolume();
-        jsonDoc[i]["sensorPressure"] = LevelManagers[i]->getLastMedian();
-        jsonDoc[i]["airPressure"] = LevelManagers[i]->getAirPressure();
-        jsonDoc[i]["sensorRaw"] = LevelManagers[i]->getSensorRawMedianReading();
-        jsonDoc[i]["error"] = LevelManagers[i]->getSensorError();
-        jsonDoc[i]["configured"] = LevelManagers[i]->isConfigured();
+      fresh->samples[i] = LevelManagers[i]->getSnapshot().sample;
+      LevelManagers[i]->requestFreshReading();
     }
-    serializeJson(jsonDoc, output);
-    request->send(200, "application/json", output);
+    fresh->started = millis();
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [fresh](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      if (fresh->output.length() == 0) {
+        bool done = true;
+        for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+          if (LevelManagers[i]->getSnapshot().sample == fresh->samples[i]) done = false;
+        }
+        if (!done && millis() - fresh->started < LEVEL_FRESH_TIMEOUT_MS) return RESPONSE_TRY_AGAIN;
+        serializeCurrentLevels(fresh->output);
+      }
+      if (index >= fresh->output.length()) return 0;
+      size_t len = fresh->output.length() - index;
+      if (len > maxLen) len = maxLen;
+      memcpy(buffer, fresh->output.c_str() + index, len);
+      return len;
+    });
+    request->send(response);
+  });
+
+  webServer.on("/api/history", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/history");
+    uint8_t lm = 1;
+    if (request->hasParam("sensor")) lm = request->getParam("sensor")->value().toInt();
+    if (lm > LEVELMANAGERS || lm < 1) return request->send(400, "text/plain", "Bad request, value outside available sensors");
+
+    uint32_t to = request->hasParam("to") ? strtoul(request->getParam("to")->value().c_str(), NULL, 10) : time(nullptr);
+    uint32_t from = request->hasParam("from") ? strtoul(request->getParam("from")->value().c_str(), NULL, 10) : (to > 3600 ? to - 3600 : 0);
+    if (from > to) return request->send(400, "text/plain", "Bad request, from is after to");
+
+    // Pick the finest resolution that still covers the requested range
+    String resolution = request->hasParam("resolution") ? request->getParam("resolution")->value() : "auto";
+    history_resolution_t res;
+    if (resolution == "raw") res = HISTORY_RAW;
+    else if (resolution == "1m") res = HISTORY_1M;
+    else if (resolution == "15m") res = HISTORY_15M;
+    else if (resolution == "auto") {
+      if (to - from <= HISTORY_RAW_SIZE * History::resolutionSeconds(HISTORY_RAW)) res = HISTORY_RAW;
+      else if (to - from <= HISTORY_AUTO_1M_RANGE) res = HISTORY_1M;
+      else res = HISTORY_15M;
+    } else return request->send(400, "text/plain", "Bad request, resolution must be raw, 1m, 15m or auto");
+
+    // The binary format contains the records encoded like in the history files, see seriescodec.h
+    bool binary = request->hasParam("format") && request->getParam("format")->value() == "bin";
+
+    // Records are read in small batches while the response is sent, so memory use does not depend on the range
+    struct cursor_t {
+      uint8_t sensor;
+      history_resolution_t res;
+      uint32_t from;
+      uint32_t next;                        // time of the next record to send
+      uint32_t to;
+      history_record_t batch[HISTORY_BATCH];
+      uint8_t batchCount = 0;
+      uint8_t batchPos = 0;
+      uint8_t stage = 0;                    // 0 header, 1 records, 2 footer, 3 done
+      bool first = true;
+      bool binary;
+      series_state_t state;
+      char line[256];
+      size_t lineLen = 0;
+      size_t linePos = 0;
+    };
+    auto cursor = makePooled<cursor_t>(webPool);
+    cursor->sensor = lm;
+    cursor->res = res;
+    cursor->from = from;
+    cursor->next = from;
+    cursor->to = to;
+    cursor->binary = binary;
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse(binary ? "application/octet-stream" : "application/json", [cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t len = 0;
+      while (len < maxLen) {
+        if (cursor->linePos < cursor->lineLen) {
+          size_t n = cursor->lineLen - cursor->linePos;
+          if (n > maxLen - len) n = maxLen - len;
+          memcpy(buffer + len, cursor->line + cursor->linePos, n);
+          cursor->linePos += n;
+          len += n;
+          continue;
+        }
+        cursor->linePos = 0;
+        cursor->lineLen = 0;
+
+        if (cursor->stage == 0 && cursor->binary) {
+          // "WLH1", sensor and resolution, followed by the records until the end of the response
+          memcpy(cursor->line, "WLH1", 4);
+          cursor->line[4] = cursor->sensor;
+          cursor->line[5] = cursor->res;
+          cursor->lineLen = 6;
+          cursor->stage = 1;
+        } else if (cursor->stage == 0) {
+          cursor->lineLen = snprintf(cursor->line, sizeof(cursor->line),
+            "{\"sensor\":%u,\"resolution\":\"%s\",\"from\":%u,\"to\":%u,"
+            "\"fields\":[\"time\",\"count\",\"levelMin\",\"levelAvg\",\"levelMax\",\"pressureMin\",\"pressureAvg\",\"pressureMax\"],\"data\":[",
+            cursor->sensor, History::resolutionName(cursor->res), cursor->from, cursor->to
+          );
+          cursor->stage = 1;
+        } else if (cursor->stage == 1) {
+          if (cursor->batchPos == cursor->batchCount) {
+            cursor->batchCount = Histories[cursor->sensor-1]->read(cursor->res, cursor->next, cursor->to, cursor->batch, HISTORY_BATCH);
+            cursor->batchPos = 0;
+            if (cursor->batchCount == 0) cursor->stage = 2;
+            continue;
+          }
+          const history_record_t &rec = cursor->batch[cursor->batchPos++];
+          cursor->next = rec.time + 1;
+          if (cursor->binary) {
+            cursor->lineLen = seriesEncode(cursor->state, rec, (uint8_t *)cursor->line);
+            continue;
+          }
+          cursor->lineLen = snprintf(cursor->line, sizeof(cursor->line), "%s[%u,%u,%u,%u,%u,%d,%d,%d]", cursor->first ? "" : ",",
+            rec.time, rec.count, rec.levelMin, rec.levelAvg, rec.levelMax, rec.pressureMin, rec.pressureAvg, rec.pressureMax
+          );
+          cursor->first = false;
+        } else if (cursor->stage == 2) {
+          if (!cursor->binary) cursor->lineLen = snprintf(cursor->line, sizeof(cursor->line), "]}");
+          cursor->stage = 3;
+        } else break;
+      }
+      return len;
+    });
+    request->send(response);
+  });
+
+  webServer.on("/api/journal", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/journal");
+
+    // All entries in one response, read in small batches while it is sent
+    struct cursor_t {
+      uint32_t next = 0;                    // seq of the next entry to send
+      journal_entry_t batch[JOURNAL_BATCH];
+      uint8_t batchCount = 0;
+      uint8_t batchPos = 0;
+      uint8_t stage = 0;                    // 0 header, 1 entries, 2 footer, 3 done
+      bool first = true;
+      char line[320];
+      size_t lineLen = 0;
+      size_t linePos = 0;
+    };
+    auto cursor = makePooled<cursor_t>(webPool);
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t len = 0;
+      while (len < maxLen) {
+        if (cursor->linePos < cursor->lineLen) {
+          size_t n = cursor->lineLen - cursor->linePos;
+          if (n > maxLen - len) n = maxLen - len;
+          memcpy(buffer + len, cursor->line + cursor->linePos, n);
+          cursor->linePos += n;
+          len += n;
+          continue;
+        }
+        cursor->linePos = 0;
+        cursor->lineLen = 0;
+
+        if (cursor->stage == 0) {
+          cursor->lineLen = snprintf(cursor->line, sizeof(cursor->line), "{\"boot\":%u,\"dropped\":%u,\"entries\":[",
+            journal.getBoot(), journal.getDropped()
+          );
+          cursor->stage = 1;
+        } else if (cursor->stage == 1) {
+          if (cursor->batchPos == cursor->batchCount) {
+            cursor->batchCount = journal.read(cursor->next, cursor->batch, JOURNAL_BATCH);
+            cursor->batchPos = 0;
+            if (cursor->batchCount == 0) cursor->stage = 2;
+            continue;
+          }
+          const journal_entry_t &entry = cursor->batch[cursor->batchPos++];
+          cursor->next = entry.seq + 1;
+
+          PrintWindow window((uint8_t *)cursor->line, sizeof(cursor->line), 0);
+          if (!cursor->first) window.write(',');
+          cursor->first = false;
+          JsonStream json(window);
+          json.beginObject()
+            .add("seq", entry.seq)
+            .add("time", entry.time)
+            .add("uptimeS", entry.uptimeS)
+            .add("boot", entry.boot)
+            .add("type", Journal::typeName(entry.type))
+            .add("tank", entry.tank)
+            .add("value", entry.value);
+          if (entry.type == JOURNAL_BACKTRACE_ADDR) {
+            // Same format as the panic output, ready for the exception decoder or addr2line
+            char addresses[JOURNAL_BACKTRACE * 11 + 1] = "";
+            for (uint8_t i = 0; i < entry.value && i < JOURNAL_BACKTRACE; i++) {
+              snprintf(addresses + i * 11, sizeof(addresses) - i * 11, "%s0x%08x", i ? " " : "", entry.addresses[i]);
+            }
+            json.add("addresses", (const char *)addresses);
+          } else {
+            char text[JOURNAL_TEXT_SIZE + 1];
+            strlcpy(text, entry.text, sizeof(text));
+            json.add("text", (const char *)text);
+          }
+          json.endObject();
+          cursor->lineLen = window.length();
+        } else if (cursor->stage == 2) {
+          cursor->lineLen = snprintf(cursor->line, sizeof(cursor->line), "]}");
+          cursor->stage = 3;
+        } else break;
+      }
+      return len;
+    });
+    request->send(response);
   });
 
   webServer.on("/api/level/num", HTTP_GET, [&](AsyncWebServerRequest *request) {
+    METRICS_HTTP_HANDLER("GET", "/api/level/num");
     String output;
     DynamicJsonDocument json(256);
     json["num"] = LEVELMANAGERS;
@@ -452,6 +1206,7 @@ void APIRegisterRoutes() {
 
   webServer.on("/api/partition/switch", HTTP_POST, [&](AsyncWebServerRequest * request){}, NULL,
     [&](AsyncWebServerRequest * request, uint8_t *data, size_t len, size_t index, size_t total) {
+    METRICS_HTTP_HANDLER("POST", "/api/partition/switch");
     auto next = esp_ota_get_next_update_partition(NULL);
     auto error = esp_ota_set_boot_partition(next);
     if (error == ESP_OK) {
@@ -462,98 +1217,39 @@ void APIRegisterRoutes() {
   });
 
   webServer.on("/api/esp", HTTP_GET, [&](AsyncWebServerRequest * request) {
-    String output;
-    DynamicJsonDocument json(2048);
-
-    JsonObject booting = json.createNestedObject("booting");
-    booting["rebootReason"] = esp_reset_reason();
-    booting["partitionCount"] = esp_ota_get_app_partition_count();
-
-    auto partition = esp_ota_get_boot_partition();
-    JsonObject bootPartition = json.createNestedObject("bootPartition");
-    bootPartition["address"] = partition->address;
-    bootPartition["size"] = partition->size;
-    bootPartition["label"] = partition->label;
-    bootPartition["encrypted"] = partition->encrypted;
-    switch (partition->type) {
-      case ESP_PARTITION_TYPE_APP:  bootPartition["type"] = "app"; break;
-      case ESP_PARTITION_TYPE_DATA: bootPartition["type"] = "data"; break;
-      default: bootPartition["type"] = "any";
-    }
-    bootPartition["subtype"] = partition->subtype;
-
-    partition = esp_ota_get_running_partition();
-    JsonObject runningPartition = json.createNestedObject("runningPartition");
-    runningPartition["address"] = partition->address;
-    runningPartition["size"] = partition->size;
-    runningPartition["label"] = partition->label;
-    runningPartition["encrypted"] = partition->encrypted;
-    switch (partition->type) {
-      case ESP_PARTITION_TYPE_APP:  runningPartition["type"] = "app"; break;
-      case ESP_PARTITION_TYPE_DATA: runningPartition["type"] = "data"; break;
-      default: runningPartition["type"] = "any";
+    METRICS_HTTP_HANDLER("GET", "/api/esp");
+    // Values are taken and serialized once, the response is sent from the pooled buffer
+    auto json = makePooled<espinfo_json_t>(jsonPool);
+    {
+      auto info = makePooled<espinfo_t>(webPool);
+      captureEspInfo(*info);
+      PrintWindow window(json->data, sizeof(json->data), 0);
+      writeEspInfo(window, *info);
+      if (window.total() > sizeof(json->data)) {
+        LOG_ERROR_F("[WEB] /api/esp needs %u bytes, more than the buffer\n", window.total());
+        return request->send(500, "application/json", "{\"message\":\"Response too large\"}");
+      }
+      json->length = window.length();
     }
-    runningPartition["subtype"] = partition->subtype;
-
-    JsonObject build = json.createNestedObject("build");
-    build["date"] = __DATE__;
-    build["time"] = __TIME__;
-
-    JsonObject ram = json.createNestedObject("ram");
-    ram["heapSize"] = ESP.getHeapSize();
-    ram["freeHeap"] = ESP.getFreeHeap();
-    ram["usagePercent"] = (float)ESP.getFreeHeap() / (float)ESP.getHeapSize() * 100.f;
-    ram["minFreeHeap"] = ESP.getMinFreeHeap();
-    ram["maxAllocHeap"] = ESP.getMaxAllocHeap();
-
-    JsonObject spi = json.createNestedObject("spi");
-    spi["psramSize"] = ESP.getPsramSize();
-    spi["freePsram"] = ESP.getFreePsram();
-    spi["minFreePsram"] = ESP.getMinFreePsram();
-    spi["maxAllocPsram"] = ESP.getMaxAllocPsram();
-
-    JsonObject chip = json.createNestedObject("chip");
-    chip["revision"] = ESP.getChipRevision();
-    chip["model"] = ESP.getChipModel();
-    chip["cores"] = ESP.getChipCores();
-    chip["cpuFreqMHz"] = ESP.getCpuFreqMHz();
-    chip["cycleCount"] = ESP.getCycleCount();
-    chip["sdkVersion"] = ESP.getSdkVersion();
-    chip["efuseMac"] = ESP.getEfuseMac();
-    chip["temperature"] = (temprature_sens_read() - 32) / 1.8;
-
-    JsonObject flash = json.createNestedObject("flash");
-    flash["flashChipSize"] = ESP.getFlashChipSize();
-    flash["flashChipRealSize"] = spi_flash_get_chip_size();
-    flash["flashChipSpeedMHz"] = ESP.getFlashChipSpeed() / 1000000;
-    flash["flashChipMode"] = ESP.getFlashChipMode();
-    flash["sdkVersion"] = ESP.getFlashChipSize();
-
-    JsonObject sketch = json.createNestedObject("sketch");
-    sketch["size"] = ESP.getSketchSize();
-    sketch["maxSize"] = ESP.getFreeSketchSpace();
-    sketch["usagePercent"] = (float)ESP.getSketchSize() / (float)ESP.getFreeSketchSpace() * 100.f;
-    sketch["md5"] = ESP.getSketchMD5();
-
-    JsonObject fs = json.createNestedObject("filesystem");
-    fs["type"] = F("LittleFS");
-    fs["totalBytes"] = LittleFS.totalBytes();
-    fs["usedBytes"] = LittleFS.usedBytes();
-    fs["usagePercent"] = (float)LittleFS.usedBytes() / (float)LittleFS.totalBytes() * 100.f;
-    
-    serializeJson(json, output);
-    request->send(200, "application/json", output);
+
+    AsyncWebServerResponse *response = request->beginResponse("application/json", json->length, [json](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t n = json->length - index < maxLen ? json->length - index : maxLen;
+      memcpy(buffer, json->data + index, n);
+      return n;
+    });
+    request->send(response);
   });
 
-  File tmp = LittleFS.open("/index.html");
-  time_t cr = tmp.getLastWrite();
-  tmp.close();
-  struct tm * timeinfo = gmtime(&cr);
+  webServer.on("/api/metrics", HTTP_GET, [&](AsyncWebServerRequest * request) {
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    writeMetrics(*response);
+    request->send(response);
+  });
 
-  webServer.serveStatic("/", LittleFS, "/")
-    .setCacheControl("max-age=86400")
-    .setLastModified(timeinfo)
-    .setDefaultFile("index.html");
+  // Pre-compressed UI with ETags, also answers unknown paths with index.html
+  GzipStaticHandler * uiHandler = new GzipStaticHandler(LittleFS);
+  uiHandler->begin();
+  webServer.addHandler(uiHandler);
 
   webServer.onNotFound([&](AsyncWebServerRequest *request) {
     if (request->method() == HTTP_OPTIONS) {
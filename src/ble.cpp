@@ -13,6 +13,7 @@
 #include "log.h"
 
 #include "ble.h"
+#include "bletransfer.h"
 #include <NimBLEDevice.h>
 #include <soc/rtc.h>
 extern "C" {
@@ -24,23 +25,160 @@ extern "C" {
 }
 
 static NimBLEServer* pServer = NULL;
+static NimBLECharacteristic* pLevelCharacteristic = NULL;   // legacy, level of the first tank
+static NimBLECharacteristic* pTanksCharacteristic = NULL;   // all tanks, see ble.h
 static uint64_t advertisementStarttime = 0;
 
 extern bool enableBle;
+extern bool bleBroadcast;
+extern uint16_t bleAdvInterval;
+
+// Values of the tanks, set in the status cycle and sent in bleLoop()
+struct ble_tank_t {
+  uint8_t level;
+  uint8_t flags;
+  uint32_t volume;
+};
+static ble_tank_t tanks[BLE_MAX_TANKS];
+RTC_DATA_ATTR static uint16_t tankCounter[BLE_MAX_TANKS];  // continues after a deep sleep
+static uint8_t tankCount = 0;               // highest tank number with values
+static bool gattDirty = false;              // values changed since the last notification
+
+// Broadcast mode
+static uint8_t broadcastCurrent = 0;        // index of the advertised tank
+static bool broadcastDirty = false;         // values of the advertised tank changed
+static bool broadcasting = false;           // advertising was started
+static uint32_t broadcastStart = 0;         // millis() when advertising was started
+static uint32_t broadcastRotated = 0;       // millis() when the advertised tank changed
+static String broadcastName;
 
 void stopBleServer() {
+  // Not started on a burst wakeup
+  if (!NimBLEDevice::getInitialized()) return;
   NimBLEDevice::deinit(true);
   pServer = NULL;
+  pLevelCharacteristic = NULL;
+  pTanksCharacteristic = NULL;
+  bleTransfer.end();
+  broadcasting = false;
 }
 
 bool shouldBleStayOn()
 {
+  if (bleBroadcast) {
+    // Wait for the first values, then advertise every tank once before sleeping
+    return !broadcasting || millis() - broadcastStart < (uint32_t)bleAdvInterval * tankCount;
+  }
   return pServer != NULL && (pServer->getConnectedCount() > 0 || (rtc_time_slowclk_to_us(rtc_time_get(), esp_clk_slowclk_cal_get()) / 1000) - advertisementStarttime < 1000);
 }
 
+// Replace the advertisement data with the values of the current tank
+static void advertiseTank() {
+  const ble_tank_t &tank = tanks[broadcastCurrent];
+  uint16_t counter = tankCounter[broadcastCurrent];
+  uint8_t data[12] = {
+    BLE_COMPANY_ID & 0xFF, BLE_COMPANY_ID >> 8,
+    BLE_BROADCAST_VERSION,
+    (uint8_t)(tankCount << 4 | (broadcastCurrent + 1)),
+    tank.flags,
+    tank.level,
+    (uint8_t)tank.volume, (uint8_t)(tank.volume >> 8), (uint8_t)(tank.volume >> 16), (uint8_t)(tank.volume >> 24),
+    (uint8_t)counter, (uint8_t)(counter >> 8)
+  };
+
+  // 3 bytes flags + 14 bytes manufacturer data, the name gets the rest of the 31 bytes
+  NimBLEAdvertisementData advertisement;
+  advertisement.setFlags(BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP);
+  advertisement.setManufacturerData(std::string((const char *)data, sizeof(data)));
+  if (broadcastName.length() <= 12) advertisement.setName(broadcastName.c_str());
+  else advertisement.setShortName(broadcastName.substring(0, 12).c_str());
+  NimBLEDevice::getAdvertising()->setAdvertisementData(advertisement);
+  broadcastDirty = false;
+}
+
+// Set the characteristics and notify subscribed clients with one packet each
+static void notifyTanks() {
+  uint8_t data[2 + BLE_MAX_TANKS * BLE_TANK_RECORD_SIZE];
+  data[0] = BLE_TANKS_VERSION;
+  data[1] = tankCount;
+  uint8_t *pos = data + 2;
+  for (uint8_t i = 0; i < tankCount; i++) {
+    *pos++ = i + 1;
+    *pos++ = tanks[i].flags;
+    *pos++ = tanks[i].level;
+    for (uint8_t b = 0; b < 4; b++) *pos++ = (uint8_t)(tanks[i].volume >> (b * 8));
+  }
+  pTanksCharacteristic->setValue(data, pos - data);
+  // The app expects the level as an int
+  pLevelCharacteristic->setValue((int)tanks[0].level);
+
+  if (pServer->getConnectedCount()) {
+    LOG_DEBUG_F("[BLE] Notify %u tank(s), level of the first %u%%\n", tankCount, tanks[0].level);
+    pTanksCharacteristic->notify(true);
+    pLevelCharacteristic->notify(true);
+  }
+  gattDirty = false;
+}
+
+void updateBleTank(uint8_t ch, uint8_t level, uint32_t volume, uint8_t flags) {
+  if (ch < 1 || ch > BLE_MAX_TANKS) return;
+  ble_tank_t &tank = tanks[ch-1];
+  // The counter changes with every reading, readers of the broadcast rely on it to spot new values
+  tankCounter[ch-1]++;
+  if (ch-1 == broadcastCurrent) broadcastDirty = true;
+  if (ch > tankCount) {
+    tankCount = ch;
+    gattDirty = true;
+  }
+  if (tank.level == level && tank.volume == volume && tank.flags == flags) return;
+  tank = { level, flags, volume };
+  gattDirty = true;
+}
+
+void bleLoop() {
+  if (!bleBroadcast) {
+    bleTransfer.loop();
+    if (pServer && gattDirty && tankCount) notifyTanks();
+    return;
+  }
+  if (!tankCount) return;
+
+  if (!broadcasting) {
+    // Start with the first values, an empty advertisement would be of no use
+    broadcastCurrent = 0;
+    advertiseTank();
+    NimBLEDevice::startAdvertising();
+    broadcasting = true;
+    broadcastStart = broadcastRotated = millis();
+    LOG_INFO_F("[BLE] Broadcasting %u tank(s)\n", tankCount);
+    return;
+  }
+  if (tankCount > 1 && millis() - broadcastRotated >= bleAdvInterval) {
+    broadcastRotated = millis();
+    broadcastCurrent = (broadcastCurrent + 1) % tankCount;
+    broadcastDirty = true;
+  }
+  if (broadcastDirty) advertiseTank();
+}
+
 void createBleServer(String hostname) {
   LOG_INFO_LN(F("[BLE] Initializing the Bluetooth low energy (BLE) stack"));
   NimBLEDevice::init(hostname.c_str());
+
+  if (bleBroadcast) {
+    // Nobody can connect, readers only have to scan
+    broadcastName = hostname;
+    broadcasting = false;
+    NimBLEAdvertising* pAdvertising = NimBLEDevice::getAdvertising();
+    pAdvertising->setAdvertisementType(BLE_GAP_CONN_MODE_NON);
+    pAdvertising->setMinInterval(BLE_BROADCAST_ADV_UNITS);
+    pAdvertising->setMaxInterval(BLE_BROADCAST_ADV_UNITS);
+    LOG_INFO_LN(F("[BLE] Broadcast mode, advertising starts with the first reading"));
+    return;
+  }
+
+  // All tanks fit into one notification
+  NimBLEDevice::setMTU(BLE_MTU);
   //NimBLEDevice::setPower(ESP_PWR_LVL_P9, ESP_BLE_PWR_TYPE_ADV);
   //NimBLEDevice::setSecurityIOCap(BLE_HS_IO_NO_INPUT_OUTPUT);
   //NimBLEDevice::setOwnAddrType(BLE_OWN_ADDR_PUBLIC);
@@ -48,19 +186,27 @@ void createBleServer(String hostname) {
 
   // BLE Environmental Service (haven't found a better one)
   NimBLEService *pEnvService = pServer->createService(BLE_SERVICE_LEVEL);
-  NimBLECharacteristic *pCharacteristicLevel = pEnvService->createCharacteristic(BLE_CHARACTERISTIC_LEVEL, // Generic Level
+  pLevelCharacteristic = pEnvService->createCharacteristic(BLE_CHARACTERISTIC_LEVEL, // Generic Level
     NIMBLE_PROPERTY::READ |
     NIMBLE_PROPERTY::BROADCAST |
-    NIMBLE_PROPERTY::NOTIFY 
+    NIMBLE_PROPERTY::NOTIFY
     //NIMBLE_PROPERTY::INDICATE
   );
-  NimBLE2904* p2904 = (NimBLE2904*)pCharacteristicLevel->createDescriptor("2904"); 
+  NimBLE2904* p2904 = (NimBLE2904*)pLevelCharacteristic->createDescriptor("2904");
   p2904->setFormat(NimBLE2904::FORMAT_UINT8);
   p2904->setUnit(NimBLE2904::FORMAT_UINT8);
 
+  pTanksCharacteristic = pEnvService->createCharacteristic(BLE_CHARACTERISTIC_TANKS,
+    NIMBLE_PROPERTY::READ |
+    NIMBLE_PROPERTY::NOTIFY
+  );
+
   pEnvService->start();
-  pCharacteristicLevel->setValue(0);
-  
+  bleTransfer.createService(pServer);
+  pLevelCharacteristic->setValue(0);
+  // Values from before a restart of the stack
+  if (tankCount) notifyTanks();
+
   NimBLEAdvertising* pAdvertising = NimBLEDevice::getAdvertising();
   LOG_INFO(F("[BLE] Begin Advertising of "));
   LOG_INFO_LN(pEnvService->getUUID().toString().c_str());
@@ -71,19 +217,3 @@ void createBleServer(String hostname) {
   advertisementStarttime = rtc_time_slowclk_to_us(rtc_time_get(), esp_clk_slowclk_cal_get()) / 1000;
   LOG_INFO_LN(F("[BLE] Advertising Started"));
 }
-
-// FIXME: need to manage multiple levels given by "ch"
-void updateBleCharacteristic(uint8_t ch, int val) {
-  if (pServer->getConnectedCount()) {
-    NimBLEService* pSvc = pServer->getServiceByUUID(BLE_SERVICE_LEVEL);
-    if(pSvc) {
-        NimBLECharacteristic* pChr = pSvc->getCharacteristic(BLE_CHARACTERISTIC_LEVEL);
-        if(pChr) {
-            LOG_INFO(F("[BLE] set value (and notify) to "));
-            LOG_INFO_LN(val);
-            pChr->setValue(val);
-            pChr->notify(true);
-        }
-    }
-  }
-}
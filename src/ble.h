@@ -12,6 +12,28 @@
 
 #define BLE_SERVICE_LEVEL "2AF9"            // Bluetooth LE service ID for tank level
 #define BLE_CHARACTERISTIC_LEVEL "181A"     // Bluetooth LE characteristic ID for tank level value
+#define BLE_CHARACTERISTIC_TANKS "6c1f0001-7a3e-4b2d-9c55-77a7e2c6e5b1"  // all tanks in one value, see below
+#define BLE_MAX_TANKS 15                    // the tank number and count are sent as nibbles in broadcasts
+#define BLE_MTU 185                         // requested ATT MTU, so all tanks fit into one notification
+
+// Tanks characteristic: version, tank count, then a record per tank with
+//  tank number (1..), flags below, level in %, volume in ml (4 bytes little endian)
+#define BLE_TANKS_VERSION 1
+#define BLE_TANK_RECORD_SIZE 7
+
+// Broadcast mode, the levels are sent as manufacturer data in non-connectable advertisements
+#define BLE_COMPANY_ID 0xFFFF               // reserved for tests and internal use, no assigned company
+#define BLE_BROADCAST_VERSION 1             // layout of the manufacturer data below
+#define BLE_BROADCAST_MIN_INTERVAL 100      // ms, shortest time a tank is advertised before the next one
+#define BLE_BROADCAST_ADV_UNITS 160         // advertising interval in 0.625ms units (100ms)
+
+// Manufacturer data, multi byte values are little endian:
+//  0-1  company ID          2  version          3  tank count << 4 | tank number (1..)
+//  4    flags below         5  level in %       6-9  volume in ml       10-11  counter
+#define BLE_FLAG_CONFIGURED 0x01            // the tank setup was done
+#define BLE_FLAG_SENSOR_ERROR 0x02          // the sensor does not respond
+#define BLE_FLAG_SETUP 0x04                 // the tank setup is running
+#define BLE_FLAG_AIR_PUMP 0x08              // the air pump is running
 
 #include <Arduino.h>
 
@@ -20,4 +42,11 @@ extern bool enableBle;
 bool shouldBleStayOn();
 void stopBleServer();
 void createBleServer(String hostname);
-void updateBleCharacteristic(uint8_t ch, int val);
+
+// Store the values of a tank after a reading, the counter of the broadcast increases with every call.
+// Free of heap allocations, the values are sent in bleLoop().
+void updateBleTank(uint8_t ch, uint8_t level, uint32_t volume, uint8_t flags);
+
+// Notify connected clients once values changed and send transfer chunks, or rotate the advertised tank every
+// bleAdvInterval ms in broadcast mode
+void bleLoop();
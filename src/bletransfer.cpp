@@ -0,0 +1,247 @@
+/**
+ * @file bletransfer.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Flow controlled download of the history and calibration over BLE
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+
+#include <NimBLEDevice.h>
+#include <esp_rom_crc.h>
+#include "bletransfer.h"
+#include "tanklevel.h"
+
+#define BLE_TRANSFER_MAX_CREDITS 1024           // more are not needed to keep the link busy
+
+static_assert(BLE_TRANSFER_CALIBRATION_SIZE == 4 + 1 + 1 + 4 + 8 + 101 * 4, "layout of the calibration stream");
+
+BleTransfer bleTransfer;
+
+static void putU32(uint8_t * out, uint32_t value) {
+  for (uint8_t i = 0; i < 4; i++) out[i] = (uint8_t)(value >> (i * 8));
+}
+
+static uint32_t getU32(const uint8_t * in) {
+  return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+class TransferControlCallbacks : public NimBLECharacteristicCallbacks {
+  void onWrite(NimBLECharacteristic * characteristic, ble_gap_conn_desc * desc) override {
+    std::string value = characteristic->getValue();
+    bleTransfer.onControl((const uint8_t *)value.data(), value.size(), desc->conn_handle);
+  }
+};
+static TransferControlCallbacks controlCallbacks;
+
+void BleTransfer::begin(TANKLEVEL ** tanks, History ** histories, uint8_t count) {
+  this->tanks = tanks;
+  this->histories = histories;
+  this->count = count;
+}
+
+void BleTransfer::createService(NimBLEServer * server) {
+  this->server = server;
+  NimBLEService * service = server->createService(BLE_SERVICE_TRANSFER);
+  control = service->createCharacteristic(BLE_CHARACTERISTIC_TRANSFER_CONTROL,
+    NIMBLE_PROPERTY::WRITE |
+    NIMBLE_PROPERTY::NOTIFY
+  );
+  control->setCallbacks(&controlCallbacks);
+  chunks = service->createCharacteristic(BLE_CHARACTERISTIC_TRANSFER_DATA, NIMBLE_PROPERTY::NOTIFY);
+  service->start();
+}
+
+void BleTransfer::end() {
+  server = NULL;
+  control = NULL;
+  chunks = NULL;
+  active = false;
+  portENTER_CRITICAL(&mux);
+  requestPending = false;
+  abortPending = false;
+  credits = 0;
+  portEXIT_CRITICAL(&mux);
+}
+
+void BleTransfer::onControl(const uint8_t * value, size_t len, uint16_t conn) {
+  if (!len) return;
+  portENTER_CRITICAL(&mux);
+  if (value[0] == BLE_TRANSFER_START && len >= BLE_TRANSFER_REQUEST_SIZE) {
+    memcpy(request, value, BLE_TRANSFER_REQUEST_SIZE);
+    requestPending = true;
+    credits = value[20];
+    connHandle = conn;
+  } else if (value[0] == BLE_TRANSFER_CREDIT && len >= 2) {
+    credits = credits + value[1] > BLE_TRANSFER_MAX_CREDITS ? BLE_TRANSFER_MAX_CREDITS : credits + value[1];
+  } else if (value[0] == BLE_TRANSFER_ABORT) {
+    abortPending = true;
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+void BleTransfer::start(const uint8_t * req) {
+  kind = (ble_transfer_kind_t)req[1];
+  tank = req[2];
+  res = (history_resolution_t)req[3];
+  uint32_t offset = getU32(req + 4);
+  uint32_t from = getU32(req + 8);
+  to = getU32(req + 12);
+  uint32_t expectedCrc = getU32(req + 16);
+  if (!to) to = time(nullptr);
+
+  bool valid = tank >= 1 && tank <= count;
+  if (kind == BLE_TRANSFER_HISTORY) valid &= res < HISTORY_RESOLUTIONS && from <= to;
+  else if (kind == BLE_TRANSFER_CALIBRATION) valid &= offset <= BLE_TRANSFER_CALIBRATION_SIZE;
+  else valid = false;
+
+  ble_transfer_status_t result = valid ? BLE_TRANSFER_OK : BLE_TRANSFER_BAD_REQUEST;
+  if (valid) {
+    prepare(from);
+    // Produce the stream up to the offset again, the records are encoded relative to each other
+    uint8_t skip[64];
+    while (position < offset && produce(skip, offset - position < sizeof(skip) ? offset - position : sizeof(skip))) {}
+    if (position != offset || crc != expectedCrc) result = BLE_TRANSFER_CHANGED;
+  }
+
+  uint8_t status[12] = { BLE_TRANSFER_STARTED, result, kind, tank };
+  putU32(status + 4, from);
+  putU32(status + 8, to);
+  control->setValue(status, sizeof(status));
+  control->notify(true);
+  if (result != BLE_TRANSFER_OK) {
+    LOG_INFO_F("[BLE] Transfer request rejected with status %u\n", result);
+    return;
+  }
+
+  active = true;
+  LOG_INFO_F("[BLE] Transfer of %s for tank %u started at offset %u\n",
+    kind == BLE_TRANSFER_HISTORY ? History::resolutionName(res) : "calibration", tank, position
+  );
+}
+
+void BleTransfer::prepare(uint32_t from) {
+  position = 0;
+  crc = 0;
+  stage = 0;
+  next = from;
+  state = series_state_t();
+  pendingLen = pendingPos = 0;
+  history.batchCount = history.batchPos = 0;
+
+  if (kind == BLE_TRANSFER_CALIBRATION) {
+    // Taken at once, a setup changed before a resumed download is detected by the CRC
+    TANKLEVEL * lm = tanks[tank-1];
+    double offsetValue = lm->getSensorOffset();
+    memcpy(calibration, "WLC1", 4);
+    calibration[4] = tank;
+    calibration[5] = lm->isConfigured();
+    putU32(calibration + 6, lm->getMaxVolume());
+    memcpy(calibration + 10, &offsetValue, sizeof(offsetValue));
+    for (uint8_t i = 0; i <= 100; i++) putU32(calibration + 18 + i * 4, (uint32_t)lm->getLevelData(i));
+  }
+}
+
+void BleTransfer::finish(ble_transfer_status_t result) {
+  uint8_t status[10] = { BLE_TRANSFER_DONE, result };
+  putU32(status + 2, position);
+  putU32(status + 6, crc);
+  control->setValue(status, sizeof(status));
+  control->notify(true);
+  active = false;
+  LOG_INFO_F("[BLE] Transfer ended with status %u after %u bytes\n", result, position);
+}
+
+size_t BleTransfer::produce(uint8_t * out, size_t max) {
+  size_t len = 0;
+  if (kind == BLE_TRANSFER_CALIBRATION) {
+    len = BLE_TRANSFER_CALIBRATION_SIZE - position < max ? BLE_TRANSFER_CALIBRATION_SIZE - position : max;
+    memcpy(out, calibration + position, len);
+    position += len;
+    crc = esp_rom_crc32_le(crc, out, len);
+    return len;
+  }
+
+  while (len < max) {
+    if (pendingPos < pendingLen) {
+      size_t n = pendingLen - pendingPos;
+      if (n > max - len) n = max - len;
+      memcpy(out + len, pendingBytes + pendingPos, n);
+      pendingPos += n;
+      len += n;
+      continue;
+    }
+    pendingPos = pendingLen = 0;
+
+    if (stage == 0) {
+      // Same header as /api/history?format=bin
+      memcpy(pendingBytes, "WLH1", 4);
+      pendingBytes[4] = tank;
+      pendingBytes[5] = res;
+      pendingLen = 6;
+      stage = 1;
+    } else if (stage == 1) {
+      if (history.batchPos == history.batchCount) {
+        history.batchCount = histories[tank-1]->read(res, next, to, history.batch, BLE_TRANSFER_BATCH);
+        history.batchPos = 0;
+        if (history.batchCount == 0) stage = 2;
+        continue;
+      }
+      const history_record_t &rec = history.batch[history.batchPos++];
+      next = rec.time + 1;
+      pendingLen = seriesEncode(state, rec, pendingBytes);
+    } else break;
+  }
+  position += len;
+  crc = esp_rom_crc32_le(crc, out, len);
+  return len;
+}
+
+void BleTransfer::loop() {
+  if (!chunks) return;
+
+  uint8_t req[BLE_TRANSFER_REQUEST_SIZE];
+  portENTER_CRITICAL(&mux);
+  bool startNow = requestPending;
+  bool abortNow = abortPending;
+  if (startNow) memcpy(req, request, sizeof(req));
+  requestPending = false;
+  abortPending = false;
+  portEXIT_CRITICAL(&mux);
+
+  if (active && (abortNow || startNow)) finish(BLE_TRANSFER_ABORTED);
+  if (startNow) start(req);
+  if (!active) return;
+  if (!server->getConnectedCount()) {
+    active = false;
+    return;
+  }
+
+  // Each chunk fills one notification, 3 bytes of it are the ATT header
+  uint16_t mtu = server->getPeerMTU(connHandle);
+  size_t chunkSize = mtu > 3 && mtu - 3 < BLE_TRANSFER_MAX_CHUNK ? mtu - 3 : BLE_TRANSFER_MAX_CHUNK;
+
+  for (uint8_t n = 0; n < BLE_TRANSFER_BURST; n++) {
+    portENTER_CRITICAL(&mux);
+    bool allowed = credits > 0;
+    if (allowed) credits--;
+    portEXIT_CRITICAL(&mux);
+    if (!allowed) break;
+
+    uint8_t chunk[BLE_TRANSFER_MAX_CHUNK];
+    putU32(chunk, position);
+    size_t len = produce(chunk + 4, chunkSize - 4);
+    if (!len) {
+      finish(BLE_TRANSFER_OK);
+      break;
+    }
+    chunks->setValue(chunk, len + 4);
+    chunks->notify(true);
+  }
+}
@@ -0,0 +1,131 @@
+/**
+ * @file bletransfer.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Flow controlled download of the history and calibration over BLE
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef BLETRANSFER_h
+#define BLETRANSFER_h
+
+#include <Arduino.h>
+#include "history.h"
+
+#define BLE_SERVICE_TRANSFER "6c1f0100-7a3e-4b2d-9c55-77a7e2c6e5b1"
+#define BLE_CHARACTERISTIC_TRANSFER_CONTROL "6c1f0101-7a3e-4b2d-9c55-77a7e2c6e5b1"  // requests (write) and status (notify)
+#define BLE_CHARACTERISTIC_TRANSFER_DATA "6c1f0102-7a3e-4b2d-9c55-77a7e2c6e5b1"     // chunks (notify)
+#define BLE_TRANSFER_MAX_CHUNK 180              // bytes of a data notification, limited further by the MTU
+#define BLE_TRANSFER_BURST 8                    // chunks sent per loop at most
+#define BLE_TRANSFER_BATCH 8                    // history records read from RAM or LittleFS at once
+#define BLE_TRANSFER_REQUEST_SIZE 21            // bytes of a start request
+#define BLE_TRANSFER_CALIBRATION_SIZE 422       // "WLC1", tank, setupDone, volume, offset and 101 readings
+
+// Requests written to the control characteristic, multi byte values are little endian
+enum ble_transfer_op_t : uint8_t {
+    BLE_TRANSFER_START = 1,                     // kind, tank, resolution, offset u32, from u32, to u32, crc u32, credits u8
+    BLE_TRANSFER_CREDIT = 2,                    // credits u8, the number of further chunks the client accepts
+    BLE_TRANSFER_ABORT = 3,
+    // Notified on the control characteristic
+    BLE_TRANSFER_STARTED = 0x81,                // status, kind, tank, from u32, to u32
+    BLE_TRANSFER_DONE = 0x82                    // status, length of the stream u32, crc u32
+};
+
+enum ble_transfer_kind_t : uint8_t {
+    BLE_TRANSFER_HISTORY = 1,                   // "WLH1", tank, resolution and records like /api/history?format=bin
+    BLE_TRANSFER_CALIBRATION = 2                // the level setup of a tank, see BLE_TRANSFER_CALIBRATION_SIZE
+};
+
+enum ble_transfer_status_t : uint8_t {
+    BLE_TRANSFER_OK = 0,
+    BLE_TRANSFER_BAD_REQUEST,
+    BLE_TRANSFER_ABORTED,
+    BLE_TRANSFER_CHANGED                        // the data before the offset differs, start again at 0
+};
+
+class TANKLEVEL;
+class NimBLEServer;
+class NimBLECharacteristic;
+
+// A single download at a time. Each data chunk starts with its offset in the stream (u32), a download
+// is resumed by starting it again with the same parameters, the offset of the missing data and the
+// CRC-32 (as zlib) of the data before it. The stream is produced again up to the offset, if the data
+// changed meanwhile (e.g. raw samples dropped out of RAM) the request is answered with
+// BLE_TRANSFER_CHANGED instead of continuing a different stream. The done message contains the
+// CRC-32 of the whole stream. Chunks are only sent while the client has credits left, it grants
+// more as it processes them.
+class BleTransfer {
+    public:
+        // Tanks and histories to read from
+        void begin(TANKLEVEL ** tanks, History ** histories, uint8_t count);
+
+        // Add the service to a server, call before the server starts advertising
+        void createService(NimBLEServer * server);
+
+        // Forget the characteristics, the BLE stack was stopped
+        void end();
+
+        // Send chunks while credits are left, call it from loop()
+        void loop();
+
+        // Called from the BLE host task
+        void onControl(const uint8_t * value, size_t len, uint16_t conn);
+
+    private:
+        TANKLEVEL ** tanks = NULL;
+        History ** histories = NULL;
+        uint8_t count = 0;
+
+        NimBLEServer * server = NULL;
+        NimBLECharacteristic * control = NULL;
+        NimBLECharacteristic * chunks = NULL;
+
+        // Shared with the BLE host task
+        portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        uint8_t request[BLE_TRANSFER_REQUEST_SIZE];
+        bool requestPending = false;
+        bool abortPending = false;
+        uint16_t credits = 0;
+        uint16_t connHandle = 0;
+
+        // Current download
+        bool active = false;
+        ble_transfer_kind_t kind;
+        uint8_t tank;
+        history_resolution_t res;
+        uint32_t next;                          // time of the next history record
+        uint32_t to;
+        uint32_t position = 0;                  // bytes of the stream produced so far
+        uint32_t crc = 0;                       // CRC-32 of the bytes produced so far
+        uint8_t stage = 0;                      // 0 header, 1 content, 2 done
+        series_state_t state;
+        uint8_t pendingBytes[SERIES_MAX_RECORD_SIZE];
+        uint8_t pendingLen = 0;
+        uint8_t pendingPos = 0;
+        union {
+            struct {
+                history_record_t batch[BLE_TRANSFER_BATCH];
+                uint8_t batchCount;
+                uint8_t batchPos;
+            } history;
+            uint8_t calibration[BLE_TRANSFER_CALIBRATION_SIZE];
+        };
+
+        void start(const uint8_t * req);
+
+        // Reset the stream to its start, take the calibration
+        void prepare(uint32_t from);
+        void finish(ble_transfer_status_t status);
+
+        // Copy the next bytes of the stream to out, returns 0 at the end
+        size_t produce(uint8_t * out, size_t max);
+};
+
+extern BleTransfer bleTransfer;
+
+#endif // BLETRANSFER_h
@@ -0,0 +1,103 @@
+/**
+ * @file burstmode.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Duty cycled battery mode: wake up, join WiFi, publish, deep sleep
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef BURSTMODE_h
+#define BURSTMODE_h
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define BURST_WIFI_TIMEOUT_MS 3000          // give up joining the WiFi after this time
+#define BURST_MQTT_TIMEOUT_MS 2000          // give up connecting to the broker after this time
+#define BURST_WIFI_ON_MINUTES 5             // keep WiFi on after power on, so the web UI stays reachable
+#define WIFICACHE_MAGIC 0x57434632          // "WCF2"
+
+// Connection details of the last successful WiFi connection, kept in RTC memory
+struct wificache_t {
+  uint32_t magic;
+  bool fast;                                // bssid, channel and IP configuration are valid
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+struct burststate_t {
+  uint32_t wakeups;                         // timer wakeups since power on
+  uint32_t cycles;                          // burst connections since power on
+  uint32_t failedJoins;                     // WiFi or MQTT connections that failed
+  uint32_t lastAwakeMs;                     // awake time of the last burst cycle
+};
+
+RTC_DATA_ATTR wificache_t wifiCache;
+RTC_DATA_ATTR burststate_t burstState;
+RTC_DATA_ATTR bool burstMode = false;       // Duty cycled MQTT publishing on battery, stored in NVS
+uint8_t burstEvery = 6;                     // Connect on every n-th timer wakeup, stored in NVS
+
+// Remember the current WiFi connection for a fast rejoin after deep sleep.
+// Only the connection details are kept in RTC memory, the credentials are stored in NVS.
+void cacheWifiConnection() {
+  if (WiFi.status() != WL_CONNECTED || !(WiFi.getMode() & WIFI_MODE_STA)) return;
+  uint8_t * bssid = WiFi.BSSID();
+  if (wifiCache.magic == WIFICACHE_MAGIC && wifiCache.fast && bssid
+    && memcmp(wifiCache.bssid, bssid, sizeof(wifiCache.bssid)) == 0
+    && wifiCache.ip == (uint32_t)WiFi.localIP()) return;
+
+  wifiCache.magic = WIFICACHE_MAGIC;
+  wifiCache.fast = bssid != nullptr;
+  if (bssid) memcpy(wifiCache.bssid, bssid, sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.ip = WiFi.localIP();
+  wifiCache.gateway = WiFi.gatewayIP();
+  wifiCache.subnet = WiFi.subnetMask();
+  wifiCache.dns = WiFi.dnsIP();
+
+  String ssid = WiFi.SSID();
+  String pass = WiFi.psk();
+  if (preferences.begin(NVS_NAMESPACE)) {
+    if (preferences.getString("burstSsid") != ssid) preferences.putString("burstSsid", ssid);
+    if (preferences.getString("burstPass") != pass) preferences.putString("burstPass", pass);
+    preferences.end();
+  }
+  LOG_INFO_F("[POWER] Cached WiFi connection to '%s' on channel %d\n", ssid.c_str(), wifiCache.channel);
+}
+
+// Join the cached WiFi, skipping the scan and DHCP if possible, preferences must be open
+bool fastWifiJoin() {
+  if (wifiCache.magic != WIFICACHE_MAGIC) return false;
+  String ssid = preferences.getString("burstSsid");
+  String pass = preferences.getString("burstPass");
+  if (ssid.isEmpty()) return false;
+
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  if (wifiCache.fast) {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+    WiFi.begin(ssid.c_str(), pass.c_str(), wifiCache.channel, wifiCache.bssid, true);
+  } else {
+    WiFi.begin(ssid.c_str(), pass.c_str());
+  }
+
+  uint32_t start = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - start < BURST_WIFI_TIMEOUT_MS) delay(5);
+  if (WiFi.status() == WL_CONNECTED) return true;
+
+  // The AP might have changed channel or the lease expired, use scan and DHCP next time
+  LOG_INFO_LN(F("[POWER] Fast WiFi join failed"));
+  wifiCache.fast = false;
+  return false;
+}
+
+#endif // BURSTMODE_h
@@ -9,6 +9,12 @@
  * 
  * License: CC BY-NC-SA 4.0
  */
+#ifndef DAC_h
+#define DAC_h
+
+#include <Arduino.h>
+#include <Preferences.h>
+
 #if HAS_DAC_INSTALLED
 #ifndef DAC_MIN_MVOLT
 #define DAC_MIN_MVOLT 500.0                 // DAC output minimum value (~0.5V on 0% tank level)
@@ -19,41 +25,160 @@
 #ifndef DAC_VCC
 #define DAC_VCC 3300.0                      // DAC output maximum voltage from esp32 3.3V = 3300mV
 #endif
+#define DAC_CAL_POINTS 11                   // calibration table with the output at 0%, 10%, .. 100%
+#define DAC_TIMER_US 2000                   // interval of the output updates
+#define DAC_DEFAULT_SLEW 200                // mV per second the output may change
 
-#include <Arduino.h>
 #include <driver/dac.h>
+#include <esp_timer.h>
 
 bool enableDac = true;                      // Disable it if you don't need an analog output
 
-// Set the current tank level value to the DAC output
-uint8_t dacValue(uint8_t use_dac, uint8_t percentage) {
-  if (!enableDac) return 0;
-
-  dac_channel_t channel;
-  switch (use_dac) {
-    case 1: channel = DAC_CHANNEL_1; break;
-    case 2: channel = DAC_CHANNEL_2; break;
-    default:
-      LOG_INFO_LN("[ERROR] DAC Channel not found!");
-      return -1;
+// Stored in NVS, changed through /api/dac
+struct dac_config_t {
+  uint16_t points[DAC_CAL_POINTS];          // mV at 0%, 10%, .. 100% for the gauge connected to the output
+  uint16_t slew = DAC_DEFAULT_SLEW;         // mV per second, 0 jumps to a new value at once
+  bool dither = false;                      // sigma-delta dithering between two steps for a finer average
+};
+dac_config_t dacConfig;
+portMUX_TYPE dacMux = portMUX_INITIALIZER_UNLOCKED;
+
+volatile float dacTarget[2] = {-1, -1};     // mV requested for each channel, negative while unused
+RTC_DATA_ATTR float dacOutput[2] = {-1, -1}; // mV after slew limiting, continues after a deep sleep
+float dacError[2] = {0, 0};                 // dithering error carried to the next update
+int16_t dacCode[2] = {-1, -1};              // last value written to the hardware
+esp_timer_handle_t dacTimer = NULL;
+bool dacTimerArmed = false;                 // the one-shot timer re-arms itself until the outputs settled
+
+// Linear output from DAC_MIN_MVOLT to DAC_MAX_MVOLT
+void dacDefaultPoints(uint16_t * points) {
+  for (uint8_t i = 0; i < DAC_CAL_POINTS; i++) {
+    points[i] = round(DAC_MIN_MVOLT + (DAC_MAX_MVOLT - DAC_MIN_MVOLT) * i / (DAC_CAL_POINTS - 1));
+  }
+}
+
+// Load the configuration, preferences must be open
+void dacLoadConfig(Preferences &prefs) {
+  if (prefs.getBytes("dacCal", dacConfig.points, sizeof(dacConfig.points)) != sizeof(dacConfig.points)) {
+    dacDefaultPoints(dacConfig.points);
+  }
+  dacConfig.slew = prefs.getUShort("dacSlew", dacConfig.slew);
+  dacConfig.dither = prefs.getBool("dacDither", dacConfig.dither);
+}
+
+// Use a new configuration, returns false if it did not change and nothing has to be written to NVS
+bool dacSetConfig(const dac_config_t &config) {
+  portENTER_CRITICAL(&dacMux);
+  bool changed = memcmp(config.points, dacConfig.points, sizeof(config.points)) != 0
+    || config.slew != dacConfig.slew || config.dither != dacConfig.dither;
+  dacConfig = config;
+  portEXIT_CRITICAL(&dacMux);
+  return changed;
+}
+
+dac_config_t dacGetConfig() {
+  portENTER_CRITICAL(&dacMux);
+  dac_config_t config = dacConfig;
+  portEXIT_CRITICAL(&dacMux);
+  return config;
+}
+
+// Move the outputs towards their target and write them if the value changed, runs in the esp_timer task
+void dacUpdate(void * arg) {
+  portENTER_CRITICAL(&dacMux);
+  float step = dacConfig.slew * (DAC_TIMER_US / 1000000.0f);
+  bool dither = dacConfig.dither;
+  portEXIT_CRITICAL(&dacMux);
+
+  for (uint8_t ch = 0; ch < 2; ch++) {
+    float target = dacTarget[ch];
+    if (target < 0) continue;
+
+    float &out = dacOutput[ch];
+    if (out < 0 || step <= 0) out = target;
+    else if (target > out + step) out += step;
+    else if (target < out - step) out -= step;
+    else out = target;
+
+    float exact = out / DAC_VCC * 255;
+    int16_t code;
+    if (dither) {
+      // The average of the written values follows the exact value between two steps
+      dacError[ch] += exact;
+      code = (int16_t)dacError[ch];
+      dacError[ch] -= code;
+    } else code = (int16_t)lroundf(exact);
+    code = constrain(code, 0, 255);
+
+    if (code != dacCode[ch]) {
+      dacCode[ch] = code;
+      dac_output_voltage(ch ? DAC_CHANNEL_2 : DAC_CHANNEL_1, code);
+    }
+  }
+
+  // Without dithering nothing changes once the targets are reached, don't wake the CPU for it
+  portENTER_CRITICAL(&dacMux);
+  bool settled = !dacConfig.dither;
+  for (uint8_t ch = 0; ch < 2; ch++) {
+    if (dacTarget[ch] >= 0 && dacOutput[ch] != dacTarget[ch]) settled = false;
+  }
+  dacTimerArmed = !settled;
+  portEXIT_CRITICAL(&dacMux);
+  if (!settled) esp_timer_start_once(dacTimer, DAC_TIMER_US);
+}
+
+// Stop the updates, e.g. before a deep sleep
+void dacStop() {
+  if (dacTimer == NULL) return;
+  esp_timer_stop(dacTimer);
+  portENTER_CRITICAL(&dacMux);
+  dacTimerArmed = false;
+  portEXIT_CRITICAL(&dacMux);
+}
+
+// Set the output of a channel from the tank level (0.0 - 1.0), the timer moves the output there
+void dacLevel(uint8_t use_dac, float fraction) {
+  if (!enableDac) return;
+  if (use_dac < 1 || use_dac > 2) {
+    LOG_ERROR_LN("[ERROR] DAC Channel not found!");
+    return;
   }
+  uint8_t ch = use_dac - 1;
+
+  // Interpolate the calibration table
+  fraction = constrain(fraction, 0.0f, 1.0f) * (DAC_CAL_POINTS - 1);
+  uint8_t i = min((uint8_t)fraction, (uint8_t)(DAC_CAL_POINTS - 2));
+  portENTER_CRITICAL(&dacMux);
+  float mv = dacConfig.points[i] + (dacConfig.points[i+1] - dacConfig.points[i]) * (fraction - i);
+  portEXIT_CRITICAL(&dacMux);
+  mv = constrain(mv, 0.0f, (float)DAC_VCC);
 
-  uint8_t val = 0;
-  if (percentage >= 0 && percentage <= 100) {
-    float start = DAC_MIN_MVOLT / DAC_VCC * 255;   // startvolt / maxvolt * datapoints
-    float end = DAC_MAX_MVOLT / DAC_VCC * 255;     // endvolt / maxvolt * datapoints
-    val = round(start + (end-start) / 100.0 * percentage);
-    dac_output_enable(channel);
-    dac_output_voltage(channel, val);
-    LOG_INFO_F("[GPIO] DAC output set to %d or %.2fmV\n", val, (float)DAC_VCC/255*val);
-  } else {
-    dac_output_enable(channel);
-    dac_output_voltage(channel, 0);
-    LOG_INFO_F("[GPIO] DAC output set to %d or %.2fmV\n", 0, 0.00);
+  if (dacTarget[ch] < 0) dac_output_enable(ch ? DAC_CHANNEL_2 : DAC_CHANNEL_1);
+  if (fabsf(mv - dacTarget[ch]) >= 1.0f) LOG_DEBUG_F("[GPIO] DAC %u output moves to %.0fmV\n", use_dac, mv);
+
+  if (dacTimer == NULL) {
+    esp_timer_create_args_t args = {};
+    args.callback = &dacUpdate;
+    args.name = "dac";
+    if (esp_timer_create(&args, &dacTimer) != ESP_OK) {
+      LOG_ERROR_LN("[ERROR] Unable to create the DAC timer!");
+      return;
+    }
   }
-  return val;
+
+  // Restart the timer if it stopped after the outputs settled
+  portENTER_CRITICAL(&dacMux);
+  bool start = !dacTimerArmed && (mv != dacOutput[ch] || dacConfig.dither);
+  dacTarget[ch] = mv;
+  if (start) dacTimerArmed = true;
+  portEXIT_CRITICAL(&dacMux);
+  if (start) esp_timer_start_once(dacTimer, DAC_TIMER_US);
 }
 #else
   bool enableDac = false;
-  uint8_t dacValue(uint8_t use_dac, uint8_t percentage) { return 0; }
-#endif
\ No newline at end of file
+  void dacLoadConfig(Preferences &prefs) {}
+  void dacLevel(uint8_t use_dac, float fraction) {}
+  void dacStop() {}
+#endif
+
+#endif // DAC_h
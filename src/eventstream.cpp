@@ -0,0 +1,149 @@
+/**
+ * @file eventstream.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Server sent events from a preallocated buffer shared by all clients
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+#include "eventstream.h"
+
+// First message of every connection, sets the reconnect delay like AsyncEventSource did
+static const char hello[] = "retry: " EVENTSTREAM_RETRY_MS "\r\ndata: connected\r\n\r\n";
+
+EventStream::EventStream(const char * url) : url(url) {
+  mutex = xSemaphoreCreateMutex();
+}
+
+void EventStream::onConnect(ConnectHandler handler) {
+  connectHandler = handler;
+}
+
+void EventStream::put(const char * data, size_t len) {
+  size_t at = end % EVENTSTREAM_BUFFER_SIZE;
+  size_t first = min(len, (size_t)EVENTSTREAM_BUFFER_SIZE - at);
+  memcpy(buffer + at, data, first);
+  memcpy(buffer, data + first, len - first);
+  end += len;
+}
+
+bool EventStream::send(const char * data, const char * event, uint32_t id) {
+  char head[48];
+  int headLen = snprintf(head, sizeof(head), "id: %u\r\nevent: %s\r\ndata: ", id, event);
+  size_t dataLen = strlen(data);
+  // A client that is up to date must not lose the start of the event while it is sent
+  if (headLen < 0 || (size_t)headLen >= sizeof(head) || headLen + dataLen + 4 > EVENTSTREAM_BUFFER_SIZE / 2) return false;
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (frameCount == EVENTSTREAM_FRAMES) {
+    frameHead = (frameHead + 1) % EVENTSTREAM_FRAMES;
+    frameCount--;
+  }
+  frames[(frameHead + frameCount) % EVENTSTREAM_FRAMES] = { id, end };
+  frameCount++;
+  put(head, headLen);
+  put(data, dataLen);
+  put("\r\n\r\n", 4);
+  xSemaphoreGive(mutex);
+  return true;
+}
+
+uint8_t EventStream::count() {
+  uint8_t num = 0;
+  for (uint8_t i = 0; i < EVENTSTREAM_CLIENTS; i++) {
+    if (clients[i].used) num++;
+  }
+  return num;
+}
+
+uint32_t EventStream::maxQueued() {
+  uint32_t queued = 0;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < EVENTSTREAM_CLIENTS; i++) {
+    if (clients[i].used && end - clients[i].pos > queued) queued = end - clients[i].pos;
+  }
+  xSemaphoreGive(mutex);
+  return queued;
+}
+
+bool EventStream::resumePosition(uint32_t lastId, uint32_t &pos) {
+  for (uint8_t i = 0; i < frameCount; i++) {
+    if (frames[(frameHead + i) % EVENTSTREAM_FRAMES].id != lastId) continue;
+    pos = i + 1 < frameCount ? frames[(frameHead + i + 1) % EVENTSTREAM_FRAMES].start : end;
+    return end - pos <= EVENTSTREAM_BUFFER_SIZE;
+  }
+  return false;
+}
+
+size_t EventStream::fill(uint8_t slot, uint8_t *out, size_t maxLen) {
+  client_t &c = clients[slot];
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (end - c.pos > EVENTSTREAM_BUFFER_SIZE) {
+    // Overwritten before it was sent, ending the response makes the client reconnect with its last id
+    overruns++;
+    xSemaphoreGive(mutex);
+    LOG_INFO_LN(F("[EVENTS] Client fell behind, disconnecting it"));
+    return 0;
+  }
+
+  size_t len = min(maxLen, sizeof(hello) - 1 - c.helloSent);
+  memcpy(out, hello + c.helloSent, len);
+  c.helloSent += len;
+
+  size_t num = min((size_t)(end - c.pos), maxLen - len);
+  size_t at = c.pos % EVENTSTREAM_BUFFER_SIZE;
+  size_t first = min(num, (size_t)EVENTSTREAM_BUFFER_SIZE - at);
+  memcpy(out + len, buffer + at, first);
+  memcpy(out + len + first, buffer, num - first);
+  c.pos += num;
+  len += num;
+  xSemaphoreGive(mutex);
+
+  // 0 would end the response
+  return len ? len : RESPONSE_TRY_AGAIN;
+}
+
+bool EventStream::canHandle(AsyncWebServerRequest *request) {
+  if (request->method() != HTTP_GET || request->url() != url) return false;
+  // AsyncWebServer only keeps headers that a handler asked for
+  request->addInterestingHeader("Last-Event-ID");
+  return true;
+}
+
+void EventStream::handleRequest(AsyncWebServerRequest *request) {
+  uint32_t lastId = 0;
+  if (request->hasHeader("Last-Event-ID")) lastId = strtoul(request->getHeader("Last-Event-ID")->value().c_str(), NULL, 10);
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  uint8_t slot = 0;
+  while (slot < EVENTSTREAM_CLIENTS && clients[slot].used) slot++;
+  if (slot == EVENTSTREAM_CLIENTS) {
+    xSemaphoreGive(mutex);
+    return request->send(503, "text/plain", "Too many event stream clients");
+  }
+  client_t &c = clients[slot];
+  bool resumed = lastId && resumePosition(lastId, c.pos);
+  if (!resumed) c.pos = end;
+  c.helloSent = 0;
+  c.used = true;
+  xSemaphoreGive(mutex);
+
+  AsyncWebServerResponse *response = request->beginResponse("text/event-stream", 0, [this, slot](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    return fill(slot, buffer, maxLen);
+  });
+  response->addHeader("Cache-Control", "no-cache");
+  request->onDisconnect([this, slot]() {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    clients[slot].used = false;
+    xSemaphoreGive(mutex);
+  });
+  request->send(response);
+
+  if (connectHandler) connectHandler(lastId, resumed);
+}
@@ -0,0 +1,92 @@
+/**
+ * @file eventstream.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Server sent events from a preallocated buffer shared by all clients
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef EVENTSTREAM_h
+#define EVENTSTREAM_h
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+#define EVENTSTREAM_CLIENTS 4                   // concurrent connections, more are refused
+#define EVENTSTREAM_BUFFER_SIZE 4096            // recent events, a client falling further behind is disconnected
+#define EVENTSTREAM_FRAMES 32                   // ids of the recent events, to resume reconnecting clients
+#define EVENTSTREAM_RETRY_MS "1000"             // reconnect delay for the clients
+
+static_assert((EVENTSTREAM_BUFFER_SIZE & (EVENTSTREAM_BUFFER_SIZE - 1)) == 0, "EVENTSTREAM_BUFFER_SIZE must be a power of 2");
+
+// AsyncEventSource allocates a message for every client and event. Here an event is formatted once
+// into a ring buffer and every client streams from its own position in it through a callback response,
+// so sending does not touch the heap. New events are picked up when AsyncTCP polls the connection
+// (every 500ms) or sent data was acknowledged.
+class EventStream : public AsyncWebHandler {
+    public:
+        // lastId is the Last-Event-ID of a reconnecting client or 0. resumed is true if all events
+        // since are still in the buffer and sent to the client. Called from the AsyncTCP task.
+        typedef std::function<void(uint32_t lastId, bool resumed)> ConnectHandler;
+
+        EventStream(const char * url);
+
+        void onConnect(ConnectHandler handler);
+
+        // Send an event to all clients, data must not contain line breaks.
+        // Returns false if it is too large for the buffer.
+        bool send(const char * data, const char * event, uint32_t id);
+
+        // Connected clients
+        uint8_t count();
+
+        // Bytes the slowest client has not received yet
+        uint32_t maxQueued();
+
+        // Clients disconnected because they fell behind by more than the buffer
+        uint32_t getOverruns() { return overruns; }
+
+        bool canHandle(AsyncWebServerRequest *request) override;
+        void handleRequest(AsyncWebServerRequest *request) override;
+
+    private:
+        struct frame_t {
+            uint32_t id;
+            uint32_t start;                     // position of the event in the stream
+        };
+
+        struct client_t {
+            bool used = false;
+            uint8_t helloSent = 0;              // bytes of the greeting already sent
+            uint32_t pos = 0;                   // position of the next byte to send
+        };
+
+        String url;
+        SemaphoreHandle_t mutex = NULL;
+        ConnectHandler connectHandler = nullptr;
+
+        // Positions count the bytes written since boot, the buffer holds the last EVENTSTREAM_BUFFER_SIZE of them
+        uint8_t buffer[EVENTSTREAM_BUFFER_SIZE];
+        uint32_t end = 0;
+        frame_t frames[EVENTSTREAM_FRAMES];
+        uint8_t frameHead = 0;                  // index of the oldest event in frames[]
+        uint8_t frameCount = 0;
+
+        client_t clients[EVENTSTREAM_CLIENTS];
+        uint32_t overruns = 0;
+
+        void put(const char * data, size_t len);
+
+        // Position after the event lastId, if everything since is still in the buffer
+        bool resumePosition(uint32_t lastId, uint32_t &pos);
+
+        // Response callback of a client, copies its next bytes to out
+        size_t fill(uint8_t slot, uint8_t *out, size_t maxLen);
+};
+
+#endif // EVENTSTREAM_h
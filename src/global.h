@@ -17,7 +17,15 @@
 #include <LittleFS.h>
 #include <Preferences.h>
 #include "MQTTclient.h"
+#include "readingbuffer.h"
+#include "history.h"
 #include "wifimanager.h"
+#include "responsecache.h"
+#include "eventstream.h"
+#include "metrics.h"
+#include "loopmonitor.h"
+#include "mempool.h"
+#include "journal.h"
 
 #define webserverPort 80                    // Start the Webserver on this port
 #define NVS_NAMESPACE "tanksensor"          // Preferences.h namespace to store settings
@@ -28,15 +36,24 @@
 bool otaRunning = false;
 
 RTC_DATA_ATTR struct timing_t {
-  // Check Services like MQTT, ...
-  uint64_t lastServiceCheck = 0;               // last millis() from ServiceCheck
-  const unsigned int serviceInterval = 30000;  // Interval in ms to execute code
-
   // Sensor data in loop()
   uint64_t lastStatusUpdate = 0;                  // last millis() from Status report
   const unsigned int statusUpdateInterval = 5000; // Interval in ms to execute code
+
+  // Store readings while MQTT is unavailable
+  uint64_t lastBufferedReading = 0;               // last millis() a reading was buffered
+  const unsigned int bufferInterval = 60000;      // Interval in ms to buffer a reading
+  uint64_t lastDrainFailure = 0;                  // last millis() buffered readings could not be published
+  const unsigned int drainRetryInterval = 5000;   // Interval in ms before publishing them is tried again
+
+  // Loop and task diagnostics via MQTT
+  uint64_t lastDiagPublish = 0;                   // last millis() the diagnostics were published
+  const unsigned int diagInterval = 60000;        // Interval in ms to publish the diagnostics
 } Timing;
 
+LoopMonitor loopMonitor;
+HeapSampler heapSampler;
+
 RTC_DATA_ATTR uint64_t sleepTime = 0;       // Time that the esp32 slept
 
 WIFIMANAGER WifiManager;
@@ -44,6 +61,8 @@ bool enableWifi = true;                     // Enable Wifi, disable to reduce po
 u_int16_t shutDownWifiMin = 0;              // Shut down Wifi that many minutes after booting up (so poweroff/on can be used as replacement for the button to request wifi)
 bool enableBle = true;                      // Enable Ble, disable to reduce power consumtion, stored in NVS
 bool enableBleSleep = true;                 // If WiFi is off, sleep between advertising while no BLE client is connected
+bool bleBroadcast = false;                  // Advertise the levels to passive readers instead of offering a connection, stored in NVS
+uint16_t bleAdvInterval = 1000;             // ms each tank is advertised in broadcast mode, stored in NVS
 
 #define LEVELMANAGERS 1
 TANKLEVEL LevelManager1(HX711_DT_PIN, HX711_SCK_PIN, (gpio_num_t)PUMP_PIN);
@@ -51,6 +70,21 @@ TANKLEVEL * LevelManagers[LEVELMANAGERS] = {
   &LevelManager1
 };
 
+// Readings taken while MQTT is unavailable, published once the broker is reachable again
+RTC_DATA_ATTR readingbuffer_rtc_t rtcReadings[LEVELMANAGERS];
+ReadingBuffer ReadingBuffer1(&rtcReadings[0], 0);
+ReadingBuffer * ReadingBuffers[LEVELMANAGERS] = {
+  &ReadingBuffer1
+};
+
+// Level history with raw samples in RAM and rollups on LittleFS
+RTC_DATA_ATTR history_rtc_t rtcHistory[LEVELMANAGERS];
+History History1(&rtcHistory[0], 0);
+History * Histories[LEVELMANAGERS] = {
+  &History1
+};
+uint32_t historySample[LEVELMANAGERS] = {0};  // last measurement added to the history
+
 #if HAS_BUTTON_INSTALLED
 struct Button {
   const gpio_num_t PIN;
@@ -64,8 +98,19 @@ void IRAM_ATTR ISR_button1() {
 
 String hostname;
 AsyncWebServer webServer(webserverPort);
-AsyncEventSource events("/api/events");
+EventStream events("/api/events");
+
+#define CACHE_SLOT_CONFIG 0
+#define CACHE_SLOT_LEVELDATA(i) (1 + (i))
+ResponseCache responseCache(1 + LEVELMANAGERS);
+
+#define STATUS_JSON_SIZE 1024
+char statusJson[STATUS_JSON_SIZE];          // preallocated buffer of the status event
+uint32_t statusCycleAllocs = 0;             // heap allocations of the last status update, should stay 0
+uint8_t lastLoggedLevel[LEVELMANAGERS] = {0};
 Preferences preferences;
+#include "burstmode.h"                      // keeps the WiFi credentials in preferences
+uint32_t configGeneration = 0;              // incremented whenever the configuration in NVS changes
 
 MQTTclient Mqtt;
 
@@ -96,7 +141,7 @@ void print_wakeup_reason() {
       timeNow = rtc_time_slowclk_to_us(rtc_time_get(), esp_clk_slowclk_cal_get());
       timeDiff = timeNow - sleepTime;
       printf("Now: %" PRIu64 "ms, Duration: %" PRIu64 "ms\n", timeNow / 1000, timeDiff / 1000);
-      delay(2000);
+      if (!burstMode) delay(2000);
     break;
     case ESP_SLEEP_WAKEUP_TOUCHPAD : LOG_INFO_LN(F("[POWER] Wakeup caused by touchpad")); break;
     case ESP_SLEEP_WAKEUP_ULP : LOG_INFO_LN(F("[POWER] Wakeup caused by ULP program")); break;
@@ -106,4 +151,13 @@ void print_wakeup_reason() {
 
 // Check if a feature is enabled, that prevents the
 // deep sleep mode of our ESP32 chip.
-void sleepOrDelay();
\ No newline at end of file
+void sleepOrDelay();
+
+// Power down the sensors and BLE and go into deep sleep
+void enterDeepSleep();
+
+// Battery mode wakeup: measure, publish and go back to deep sleep
+void runBurstCycle();
+
+// History and BLE, not needed by a burst cycle that goes back to sleep
+void beginRegularServices();
\ No newline at end of file
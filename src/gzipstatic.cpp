@@ -0,0 +1,92 @@
+/**
+ * @file gzipstatic.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Serve the pre-compressed web UI from LittleFS with content hash ETags
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+#include "gzipstatic.h"
+
+GzipStaticHandler::GzipStaticHandler(fs::FS &fs, const char* defaultFile) : fs(fs), defaultFile(defaultFile) {
+}
+
+void GzipStaticHandler::begin() {
+  etags.clear();
+  File file = fs.open(GZIPSTATIC_ETAG_FILE, "r");
+  if (!file) {
+    LOG_INFO_LN(F("[WEB] No ETag manifest found, serving UI without ETags"));
+    return;
+  }
+  // One "<path> <etag>" per line
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    line.trim();
+    int sep = line.indexOf(' ');
+    if (sep > 0) etags[line.substring(0, sep)] = line.substring(sep + 1);
+  }
+  file.close();
+  LOG_INFO_F("[WEB] Loaded %u ETags of the web UI\n", etags.size());
+}
+
+bool GzipStaticHandler::canHandle(AsyncWebServerRequest *request) {
+  if (request->method() != HTTP_GET || request->url().startsWith("/api/")) return false;
+  // AsyncWebServer only keeps headers that a handler asked for
+  request->addInterestingHeader("If-None-Match");
+  return true;
+}
+
+String GzipStaticHandler::resolve(const String &url) {
+  String path = url.endsWith("/") ? url + "index.html" : url;
+  if (fs.exists(path + ".gz") || fs.exists(path)) return path;
+  return defaultFile;
+}
+
+// If-None-Match is a list of weak (W/"...") or strong validators, or *. Weak comparison is used as for GET.
+static bool etagMatches(const char * header, const String &etag) {
+  const char * tag = etag.c_str();
+  if (!strncmp(tag, "W/", 2)) tag += 2;
+  size_t tagLen = strlen(tag);
+
+  const char * p = header;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    if (!*p) break;
+    if (*p == '*') return true;
+    if (!strncmp(p, "W/", 2)) p += 2;
+    const char * start = p;
+    // a quoted validator may not contain a comma, so it ends with the next one
+    while (*p && *p != ',') p++;
+    const char * end = p;
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    if ((size_t)(end - start) == tagLen && !strncmp(start, tag, tagLen)) return true;
+  }
+  return false;
+}
+
+void GzipStaticHandler::handleRequest(AsyncWebServerRequest *request) {
+  String path = resolve(request->url());
+  const char * cacheControl = path.startsWith(GZIPSTATIC_IMMUTABLE_PATH) ? "max-age=31536000, immutable" : "no-cache";
+
+  auto etag = etags.find(path);
+  if (etag != etags.end() && request->hasHeader("If-None-Match")
+    && etagMatches(request->getHeader("If-None-Match")->value().c_str(), etag->second)) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", etag->second);
+    response->addHeader("Cache-Control", cacheControl);
+    return request->send(response);
+  }
+
+  // Uses <path>.gz with Content-Encoding: gzip if only the compressed file exists
+  AsyncWebServerResponse *response = request->beginResponse(fs, path);
+  if (!response) return request->send(404, "text/plain", "Web UI not installed");
+  if (etag != etags.end()) response->addHeader("ETag", etag->second);
+  response->addHeader("Cache-Control", cacheControl);
+  request->send(response);
+}
@@ -0,0 +1,46 @@
+/**
+ * @file gzipstatic.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Serve the pre-compressed web UI from LittleFS with content hash ETags
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef GZIPSTATIC_h
+#define GZIPSTATIC_h
+
+#include <Arduino.h>
+#include <FS.h>
+#include <ESPAsyncWebServer.h>
+#include <map>
+
+#define GZIPSTATIC_ETAG_FILE "/etags.txt"          // written by tools/littlefsbuilder.py
+#define GZIPSTATIC_IMMUTABLE_PATH "/_app/immutable/" // svelte assets with a hash in the file name
+
+// Files are stored as <name>.gz by tools/littlefsbuilder.py, AsyncFileResponse picks
+// them up with Content-Encoding: gzip. Unknown paths get the index.html of the SPA.
+class GzipStaticHandler : public AsyncWebHandler {
+    public:
+        GzipStaticHandler(fs::FS &fs, const char* defaultFile = "/index.html");
+
+        // Load the ETags of all files
+        void begin();
+
+        bool canHandle(AsyncWebServerRequest *request) override;
+        void handleRequest(AsyncWebServerRequest *request) override;
+
+    private:
+        fs::FS &fs;
+        String defaultFile;
+        std::map<String, String> etags;         // url path -> "etag"
+
+        // Path of the file to answer the request with
+        String resolve(const String &url);
+};
+
+#endif // GZIPSTATIC_h
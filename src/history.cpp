@@ -0,0 +1,311 @@
+/**
+ * @file history.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Multi-resolution history of the tank level in RAM and on LittleFS
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+
+#include <LittleFS.h>
+#include "history.h"
+
+#define HISTORY_MAGIC 0x57485332                // "WHS2", compressed blocks
+
+History::History(history_rtc_t * rtcMemory, uint8_t tankIndex) {
+  rtc = rtcMemory;
+  tank = tankIndex;
+  mutex = xSemaphoreCreateMutex();
+  path[HISTORY_RAW][0] = '\0';
+  snprintf(path[HISTORY_1M], sizeof(path[HISTORY_1M]), HISTORY_DIR "/tank%u-1m.bin", tank + 1);
+  snprintf(path[HISTORY_15M], sizeof(path[HISTORY_15M]), HISTORY_DIR "/tank%u-15m.bin", tank + 1);
+}
+
+uint16_t History::capacity(history_resolution_t res) {
+  switch (res) {
+    case HISTORY_RAW: return HISTORY_RAW_SIZE;
+    case HISTORY_1M: return HISTORY_1M_BLOCKS;
+    default: return HISTORY_15M_BLOCKS;
+  }
+}
+
+uint32_t History::resolutionSeconds(history_resolution_t res) {
+  switch (res) {
+    case HISTORY_RAW: return 5;
+    case HISTORY_1M: return 60;
+    default: return 900;
+  }
+}
+
+const char * History::resolutionName(history_resolution_t res) {
+  switch (res) {
+    case HISTORY_RAW: return "raw";
+    case HISTORY_1M: return "1m";
+    default: return "15m";
+  }
+}
+
+void History::begin() {
+  if (!LittleFS.exists(HISTORY_DIR)) LittleFS.mkdir(HISTORY_DIR);
+  for (uint8_t r = HISTORY_1M; r < HISTORY_RESOLUTIONS; r++) {
+    history_resolution_t res = (history_resolution_t)r;
+    if (!LittleFS.exists(path[r])) continue;
+    File file = LittleFS.open(path[r], "r");
+    fs_header_t hdr;
+    if (!file || file.read((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != HISTORY_MAGIC
+      || hdr.head >= capacity(res) || hdr.count > capacity(res)) {
+      // Unknown or outdated format, start over
+      file.close();
+      LittleFS.remove(path[r]);
+      continue;
+    }
+    fsHead[r] = hdr.head;
+    fsCount[r] = hdr.count;
+
+    // Continue the last block where it ended
+    uint8_t data[HISTORY_BLOCK_SIZE];
+    if (fsCount[r] > 0 && !readBlock(res, file, fsCount[r] - 1, lastBlock[r], data)) {
+      // Unreadable, keep its times so the search still works and start a new block
+      lastBlock[r].count = 0;
+      lastBlock[r].length = 0;
+      lastBlockFull[r] = true;
+    } else if (fsCount[r] > 0) {
+      history_record_t rec;
+      size_t pos = 0;
+      for (uint16_t i = 0; i < lastBlock[r].count; i++) {
+        size_t len = seriesDecode(lastState[r], data + pos, lastBlock[r].length - pos, rec);
+        if (!len) {
+          // Damaged, keep the records before and start a new block with the next one
+          lastBlock[r].count = i;
+          lastBlock[r].length = pos;
+          if (i) lastBlock[r].lastTime = lastState[r].prev.time;
+          lastBlockFull[r] = true;
+          break;
+        }
+        pos += len;
+      }
+    }
+    LOG_INFO_F("[HISTORY] Tank %d has %u blocks of %s records\n", tank + 1, fsCount[r], resolutionName(res));
+    file.close();
+  }
+  started = true;
+}
+
+void History::accumulate(history_accumulator_t &acc, const history_record_t &rec, uint32_t seconds) {
+  if (acc.count == 0) acc.bucket = rec.time - rec.time % seconds;
+  acc.count += rec.count;
+  if (rec.levelMin < acc.levelMin) acc.levelMin = rec.levelMin;
+  if (rec.levelMax > acc.levelMax) acc.levelMax = rec.levelMax;
+  acc.levelSum += (uint32_t)rec.levelAvg * rec.count;
+  if (rec.pressureMin < acc.pressureMin) acc.pressureMin = rec.pressureMin;
+  if (rec.pressureMax > acc.pressureMax) acc.pressureMax = rec.pressureMax;
+  acc.pressureSum += (int64_t)rec.pressureAvg * rec.count;
+}
+
+history_record_t History::finish(history_accumulator_t &acc) {
+  history_record_t rec;
+  rec.time = acc.bucket;
+  rec.count = acc.count;
+  rec.levelMin = acc.levelMin;
+  rec.levelAvg = (acc.levelSum + acc.count / 2) / acc.count;
+  rec.levelMax = acc.levelMax;
+  rec.pressureMin = acc.pressureMin;
+  rec.pressureAvg = acc.pressureSum / acc.count;
+  rec.pressureMax = acc.pressureMax;
+  acc = history_accumulator_t();
+  return rec;
+}
+
+size_t History::blockOffset(history_resolution_t res, uint16_t i) {
+  return sizeof(fs_header_t) + ((fsHead[res] + i) % capacity(res)) * HISTORY_BLOCK_SIZE;
+}
+
+// Read block i (0 = oldest) of a rollup file, the encoded records only if data is given
+bool History::readBlock(history_resolution_t res, File &file, uint16_t i, block_header_t &hdr, uint8_t *data) {
+  file.seek(blockOffset(res, i));
+  if (file.read((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)) return false;
+  if (hdr.length > HISTORY_BLOCK_SIZE - sizeof(block_header_t)) return false;
+  return !data || file.read(data, hdr.length) == hdr.length;
+}
+
+bool History::append(history_resolution_t res, const history_record_t *records, uint8_t num) {
+  File file = LittleFS.exists(path[res]) ? LittleFS.open(path[res], "r+") : LittleFS.open(path[res], "w+");
+  if (!file) return false;
+
+  uint16_t cap = capacity(res);
+  block_header_t &block = lastBlock[res];
+  uint8_t data[SERIES_MAX_RECORD_SIZE];
+  for (uint8_t i = 0; i < num; i++) {
+    series_state_t state = lastState[res];
+    size_t len = seriesEncode(state, records[i], data);
+    if (fsCount[res] == 0 || lastBlockFull[res] || block.length + len > HISTORY_BLOCK_SIZE - sizeof(block_header_t)) {
+      if (fsCount[res] > 0) {
+        file.seek(blockOffset(res, fsCount[res] - 1));
+        file.write((const uint8_t *)&block, sizeof(block));
+      }
+      if (fsCount[res] >= cap) {
+        // full, overwrite the oldest block
+        fsHead[res] = (fsHead[res] + 1) % cap;
+        fsCount[res]--;
+      }
+      fsCount[res]++;
+      lastBlockFull[res] = false;
+      // Every block starts a new series, so it can be decoded on its own
+      block = { records[i].time, records[i].time, 0, 0 };
+      state = series_state_t();
+      len = seriesEncode(state, records[i], data);
+    }
+    file.seek(blockOffset(res, fsCount[res] - 1) + sizeof(block_header_t) + block.length);
+    file.write(data, len);
+    block.length += len;
+    block.count++;
+    block.lastTime = records[i].time;
+    lastState[res] = state;
+  }
+  file.seek(blockOffset(res, fsCount[res] - 1));
+  file.write((const uint8_t *)&block, sizeof(block));
+
+  fs_header_t hdr = { HISTORY_MAGIC, fsHead[res], fsCount[res] };
+  file.seek(0);
+  file.write((const uint8_t *)&hdr, sizeof(hdr));
+  file.close();
+  return true;
+}
+
+void History::flushPending() {
+  if (pendingCount == 0) return;
+  if (!append(HISTORY_1M, pending, pendingCount)) LOG_INFO_LN(F("[HISTORY] Unable to write to LittleFS"));
+  pendingCount = 0;
+}
+
+void History::closeMinute() {
+  history_record_t m = finish(rtc->minute);
+  if (rtc->quarter.count && m.time - m.time % 900 != rtc->quarter.bucket) {
+    history_record_t q = finish(rtc->quarter);
+    append(HISTORY_15M, &q, 1);
+    flushPending();
+  }
+  // Collect the minutes to spare the flash a write every minute
+  if (pendingCount == HISTORY_PENDING) flushPending();
+  pending[pendingCount++] = m;
+  accumulate(rtc->quarter, m, 900);
+}
+
+void History::flush(bool close) {
+  // Without begin() the rollup files must not be touched, nothing was added then anyway
+  if (!started) return;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  if (close) {
+    // Partial rollups, a sample of the same minute after the restart starts another record for it
+    if (rtc->minute.count) closeMinute();
+    if (rtc->quarter.count) {
+      history_record_t q = finish(rtc->quarter);
+      append(HISTORY_15M, &q, 1);
+    }
+  }
+  flushPending();
+
+  xSemaphoreGive(mutex);
+}
+
+void History::add(uint32_t time, uint8_t level, int32_t sensorPressure) {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  if (rawCount == HISTORY_RAW_SIZE) {
+    rawHead = (rawHead + 1) % HISTORY_RAW_SIZE;
+    rawCount--;
+  }
+  raw_t &r = raw[(rawHead + rawCount) % HISTORY_RAW_SIZE];
+  r.time = time;
+  r.level = level;
+  r.sensorPressure = sensorPressure;
+  rawCount++;
+
+  // Close the minute (and the quarter hour) once a sample of the next one arrives
+  if (rtc->minute.count && time - time % 60 != rtc->minute.bucket) closeMinute();
+  history_record_t sample = { time, 1, level, level, level, sensorPressure, sensorPressure, sensorPressure };
+  accumulate(rtc->minute, sample, 60);
+
+  xSemaphoreGive(mutex);
+}
+
+uint16_t History::readFile(history_resolution_t res, uint32_t from, uint32_t to, history_record_t *out, uint16_t max) {
+  if (fsCount[res] == 0) return 0;
+  File file = LittleFS.open(path[res], "r");
+  if (!file) return 0;
+
+  // Binary search the first block that ends at or after from, blocks are sorted by time
+  block_header_t hdr;
+  uint16_t lo = 0, hi = fsCount[res];
+  while (lo < hi) {
+    uint16_t mid = lo + (hi - lo) / 2;
+    if (!readBlock(res, file, mid, hdr, nullptr)) break;
+    if (hdr.lastTime < from) lo = mid + 1;
+    else hi = mid;
+  }
+
+  uint16_t num = 0;
+  uint8_t data[HISTORY_BLOCK_SIZE];
+  bool done = false;
+  for (uint16_t i = lo; i < fsCount[res] && !done; i++) {
+    // Skip damaged blocks, the following ones are still valid
+    if (!readBlock(res, file, i, hdr, data)) continue;
+    if (hdr.firstTime > to) break;
+    series_state_t state;
+    history_record_t rec;
+    size_t pos = 0;
+    for (uint16_t r = 0; r < hdr.count; r++) {
+      size_t len = seriesDecode(state, data + pos, hdr.length - pos, rec);
+      if (!len) break;
+      pos += len;
+      if (rec.time < from) continue;
+      if (rec.time > to || num == max) {
+        done = true;
+        break;
+      }
+      out[num++] = rec;
+    }
+  }
+  file.close();
+  return num;
+}
+
+uint16_t History::read(history_resolution_t res, uint32_t from, uint32_t to, history_record_t *out, uint16_t max) {
+  uint16_t num = 0;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  if (res == HISTORY_RAW) {
+    // Binary search the first sample at or after from
+    uint16_t lo = 0, hi = rawCount;
+    while (lo < hi) {
+      uint16_t mid = lo + (hi - lo) / 2;
+      if (raw[(rawHead + mid) % HISTORY_RAW_SIZE].time < from) lo = mid + 1;
+      else hi = mid;
+    }
+    for (uint16_t i = lo; i < rawCount && num < max; i++) {
+      const raw_t &r = raw[(rawHead + i) % HISTORY_RAW_SIZE];
+      if (r.time > to) break;
+      out[num++] = { r.time, 1, r.level, r.level, r.level, r.sensorPressure, r.sensorPressure, r.sensorPressure };
+    }
+  } else {
+    num = readFile(res, from, to, out, max);
+    // 1 minute rollups not yet written follow the ones on LittleFS
+    if (res == HISTORY_1M) {
+      for (uint8_t i = 0; i < pendingCount && num < max; i++) {
+        if (pending[i].time < from) continue;
+        if (pending[i].time > to) break;
+        out[num++] = pending[i];
+      }
+    }
+  }
+
+  xSemaphoreGive(mutex);
+  return num;
+}
@@ -0,0 +1,135 @@
+/**
+ * @file history.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Multi-resolution history of the tank level in RAM and on LittleFS
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef HISTORY_h
+#define HISTORY_h
+
+#include <Arduino.h>
+#include <FS.h>
+#include "seriescodec.h"
+
+#define HISTORY_RAW_SIZE 720                    // raw samples in RAM, one hour at the 5s sensor interval
+#define HISTORY_BLOCK_SIZE 256                  // rollups are stored compressed in blocks of this size
+#define HISTORY_1M_BLOCKS 128                   // 32 KB of 1 minute rollups on LittleFS, about four days
+#define HISTORY_15M_BLOCKS 64                   // 16 KB of 15 minute rollups on LittleFS, about four weeks
+#define HISTORY_PENDING 15                      // 1 minute rollups collected in RAM before they are written
+#define HISTORY_DIR "/history"
+
+// A rollup in progress
+struct history_accumulator_t {
+    uint32_t bucket = 0;                        // bucket start, 0 if empty
+    uint16_t count = 0;
+    uint8_t levelMin = 255;
+    uint8_t levelMax = 0;
+    uint32_t levelSum = 0;
+    int32_t pressureMin = INT32_MAX;
+    int32_t pressureMax = INT32_MIN;
+    int64_t pressureSum = 0;
+};
+
+// The minute and quarter hour in progress, place it in RTC_DATA_ATTR memory to continue them after a deep sleep
+struct history_rtc_t {
+    history_accumulator_t minute;
+    history_accumulator_t quarter;
+};
+
+enum history_resolution_t : uint8_t {
+    HISTORY_RAW = 0,
+    HISTORY_1M,
+    HISTORY_15M,
+    HISTORY_RESOLUTIONS
+};
+
+class History {
+    private:
+        struct raw_t {
+            uint32_t time;
+            int32_t sensorPressure;
+            uint8_t level;
+        };
+
+        // Header of a rollup file, followed by the capacity of blocks
+        struct fs_header_t {
+            uint32_t magic;
+            uint16_t head;                      // index of the oldest block
+            uint16_t count;                     // used blocks, the last one is still filled
+        };
+
+        // Header of a block, followed by the encoded records
+        struct block_header_t {
+            uint32_t firstTime;
+            uint32_t lastTime;
+            uint16_t count;                     // number of records
+            uint16_t length;                    // bytes of encoded records
+        };
+
+        history_rtc_t * rtc;
+        uint8_t tank;
+        SemaphoreHandle_t mutex = NULL;
+        bool started = false;                   // the state of the rollup files is known
+
+        raw_t raw[HISTORY_RAW_SIZE];
+        uint16_t rawHead = 0;
+        uint16_t rawCount = 0;
+
+        history_record_t pending[HISTORY_PENDING];
+        uint8_t pendingCount = 0;
+
+        char path[HISTORY_RESOLUTIONS][32];
+        uint16_t fsHead[HISTORY_RESOLUTIONS] = {0};
+        uint16_t fsCount[HISTORY_RESOLUTIONS] = {0};
+
+        // The last block of a file, new records are appended until it is full
+        block_header_t lastBlock[HISTORY_RESOLUTIONS];
+        series_state_t lastState[HISTORY_RESOLUTIONS];
+        bool lastBlockFull[HISTORY_RESOLUTIONS] = {false};  // damaged at the end, the next record starts a new block
+
+        static uint16_t capacity(history_resolution_t res);
+        void accumulate(history_accumulator_t &acc, const history_record_t &rec, uint32_t seconds);
+        history_record_t finish(history_accumulator_t &acc);
+
+        // Move the minute in progress to the pending rollups and the quarter hour
+        void closeMinute();
+
+        size_t blockOffset(history_resolution_t res, uint16_t i);
+        bool readBlock(history_resolution_t res, File &file, uint16_t i, block_header_t &hdr, uint8_t *data);
+
+        // Append records to the last block of the circular rollup file
+        bool append(history_resolution_t res, const history_record_t *records, uint8_t num);
+        void flushPending();
+
+        // Copy records of a rollup file with from <= time <= to into out
+        uint16_t readFile(history_resolution_t res, uint32_t from, uint32_t to, history_record_t *out, uint16_t max);
+
+    public:
+        History(history_rtc_t * rtcMemory, uint8_t tankIndex);
+
+        // Restore the state of the rollup files
+        void begin();
+
+        // Add a new raw sample, call it after every measurement
+        void add(uint32_t time, uint8_t level, int32_t sensorPressure);
+
+        // Write the pending 1 minute rollups to LittleFS, call it before a deep sleep or restart.
+        // close also writes the minute and quarter hour in progress, required if RTC memory is lost.
+        void flush(bool close);
+
+        // Copy up to max records with from <= time <= to into out, oldest first
+        uint16_t read(history_resolution_t res, uint32_t from, uint32_t to, history_record_t *out, uint16_t max);
+
+        // Duration of a record in seconds
+        static uint32_t resolutionSeconds(history_resolution_t res);
+        static const char * resolutionName(history_resolution_t res);
+};
+
+#endif // HISTORY_h
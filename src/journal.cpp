@@ -0,0 +1,288 @@
+/**
+ * @file journal.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Append-only journal of significant events and crashes on LittleFS
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+
+#include <LittleFS.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include "journal.h"
+
+#if CONFIG_IDF_TARGET_ARCH_XTENSA
+#include <esp_debug_helpers.h>
+#include <esp_private/panic_internal.h>
+#include <freertos/xtensa_context.h>
+#endif
+
+#define JOURNAL_PANIC_MAGIC 0x4a504e31          // "JPN1"
+
+static_assert(sizeof(journal_entry_t) == 64, "journal entries are stored as they are");
+
+Journal journal;
+
+// Written by the panic handler, the next boot moves it to the journal
+RTC_NOINIT_ATTR static struct {
+  uint32_t magic;
+  uint32_t pc;
+  uint8_t core;
+  uint8_t depth;
+  char reason[32];
+  uint32_t backtrace[JOURNAL_BACKTRACE];
+} rtcPanic;
+
+#if CONFIG_IDF_TARGET_ARCH_XTENSA
+extern "C" void __real_esp_panic_handler(panic_info_t *info);
+
+// Address of the calling instruction, like esp_cpu_process_stack_pc()
+static inline uint32_t IRAM_ATTR panicStackPc(uint32_t pc) {
+  if (pc & 0x80000000) pc = (pc & 0x3fffffff) | 0x40000000;
+  return pc - 3;
+}
+
+// Linked with -Wl,--wrap=esp_panic_handler, runs before the panic output and the reset.
+// Only RTC memory is written, flash and the heap may be in any state here.
+extern "C" void IRAM_ATTR __wrap_esp_panic_handler(panic_info_t *info) {
+  rtcPanic.core = info->core;
+  rtcPanic.pc = 0;
+  rtcPanic.depth = 0;
+
+  const char * reason = info->reason ? info->reason : "";
+  uint8_t i = 0;
+  for (; i < sizeof(rtcPanic.reason) - 1 && reason[i]; i++) rtcPanic.reason[i] = reason[i];
+  rtcPanic.reason[i] = '\0';
+
+  const XtExcFrame * frame = (const XtExcFrame *)info->frame;
+  if (frame) {
+    esp_backtrace_frame_t bt = {};
+    bt.pc = frame->pc;
+    bt.sp = frame->a1;
+    bt.next_pc = frame->a0;
+    rtcPanic.pc = bt.pc;
+    rtcPanic.backtrace[rtcPanic.depth++] = bt.pc;
+    while (rtcPanic.depth < JOURNAL_BACKTRACE && bt.next_pc && esp_backtrace_get_next_frame(&bt)) {
+      rtcPanic.backtrace[rtcPanic.depth++] = panicStackPc(bt.pc);
+    }
+  }
+  rtcPanic.magic = JOURNAL_PANIC_MAGIC;
+
+  __real_esp_panic_handler(info);
+}
+#endif
+
+const char * Journal::typeName(journal_type_t type) {
+  switch (type) {
+    case JOURNAL_BOOT: return "boot";
+    case JOURNAL_PANIC: return "panic";
+    case JOURNAL_BACKTRACE_ADDR: return "backtrace";
+    case JOURNAL_PUMP: return "pump";
+    case JOURNAL_SETUP: return "setup";
+    case JOURNAL_SENSOR: return "sensor";
+    case JOURNAL_MQTT: return "mqtt";
+    case JOURNAL_UPDATE: return "update";
+    default: return "unknown";
+  }
+}
+
+const char * Journal::path(uint8_t file) {
+  return file ? JOURNAL_DIR "/1.bin" : JOURNAL_DIR "/0.bin";
+}
+
+void Journal::scan(uint8_t file) {
+  firstSeq[file] = 0;
+  count[file] = 0;
+  if (!LittleFS.exists(path(file))) return;
+
+  File f = LittleFS.open(path(file), "r");
+  journal_entry_t entry;
+  size_t size = f ? f.size() : 0;
+  if (size % sizeof(entry) != 0 || size > JOURNAL_FILE_ENTRIES * sizeof(entry)
+    || f.read((uint8_t *)&entry, sizeof(entry)) != sizeof(entry)) {
+    // Unknown size, appending would not be aligned to the entries anymore
+    f.close();
+    LittleFS.remove(path(file));
+    return;
+  }
+  firstSeq[file] = entry.seq;
+  count[file] = size / sizeof(entry);
+  f.close();
+}
+
+void Journal::begin(int32_t reason, const char * phase) {
+  mutex = xSemaphoreCreateMutex();
+  if (!LittleFS.exists(JOURNAL_DIR)) LittleFS.mkdir(JOURNAL_DIR);
+  scan(0);
+  scan(1);
+  current = firstSeq[1] > firstSeq[0] ? 1 : 0;
+
+  // Continue the counters of the last entry
+  journal_entry_t last;
+  File f = count[current] ? LittleFS.open(path(current), "r") : File();
+  if (f && f.seek((count[current] - 1) * sizeof(last)) && f.read((uint8_t *)&last, sizeof(last)) == sizeof(last)) {
+    nextSeq = last.seq + 1;
+    boot = last.boot + 1;
+  }
+  if (f) f.close();
+
+  // A wakeup from deep sleep is no new start of the firmware
+  bool wakeup = reason == ESP_RST_DEEPSLEEP && boot > 1;
+  if (wakeup) boot--;
+
+  if (!wakeup) {
+    LOG_INFO_F("[JOURNAL] Boot %u, %u entries stored\n", boot, count[0] + count[1]);
+    add(JOURNAL_BOOT, 0, reason, phase);
+  }
+  restorePanic();
+  flush();
+}
+
+void Journal::restorePanic() {
+  if (rtcPanic.magic != JOURNAL_PANIC_MAGIC) return;
+  rtcPanic.magic = 0;
+  rtcPanic.reason[sizeof(rtcPanic.reason) - 1] = '\0';
+  if (rtcPanic.depth > JOURNAL_BACKTRACE) rtcPanic.depth = JOURNAL_BACKTRACE;
+
+  char text[JOURNAL_TEXT_SIZE];
+  snprintf(text, sizeof(text), "%s (core %u)", rtcPanic.reason, rtcPanic.core);
+  add(JOURNAL_PANIC, 0, rtcPanic.pc, text);
+  LOG_INFO_F("[JOURNAL] Last reset was a panic: %s at 0x%08x\n", text, rtcPanic.pc);
+
+  journal_entry_t entry = {};
+  entry.type = JOURNAL_BACKTRACE_ADDR;
+  entry.value = rtcPanic.depth;
+  memcpy(entry.addresses, rtcPanic.backtrace, rtcPanic.depth * sizeof(uint32_t));
+  queue(entry);
+}
+
+void Journal::add(journal_type_t type, uint8_t tank, int32_t value, const char * text) {
+  journal_entry_t entry = {};
+  entry.type = type;
+  entry.tank = tank;
+  entry.value = value;
+  strlcpy(entry.text, text, sizeof(entry.text));
+  queue(entry);
+}
+
+void Journal::queue(journal_entry_t &entry) {
+  time_t now = time(nullptr);
+  entry.time = now > 1600000000 ? now : 0;
+  entry.uptimeS = esp_timer_get_time() / 1000000;
+
+  portENTER_CRITICAL(&mux);
+  entry.boot = boot;
+  if (pendingCount < JOURNAL_PENDING) {
+    entry.seq = nextSeq++;
+    pending[pendingCount++] = entry;
+    if (entry.type == JOURNAL_BOOT || entry.type == JOURNAL_PANIC || entry.type == JOURNAL_UPDATE) urgent = true;
+  } else dropped++;
+  portEXIT_CRITICAL(&mux);
+}
+
+void Journal::loop() {
+  if (!pendingCount) return;
+  if (urgent || pendingCount >= JOURNAL_PENDING / 2 || millis() - lastFlush >= JOURNAL_FLUSH_MS) flush();
+}
+
+void Journal::flush() {
+  if (!mutex) return;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  journal_entry_t entries[JOURNAL_PENDING];
+  portENTER_CRITICAL(&mux);
+  uint8_t num = pendingCount;
+  memcpy(entries, pending, num * sizeof(journal_entry_t));
+  pendingCount = 0;
+  urgent = false;
+  portEXIT_CRITICAL(&mux);
+  lastFlush = millis();
+
+  File f;
+  uint8_t written = 0;
+  for (; written < num; written++) {
+    if (count[current] >= JOURNAL_FILE_ENTRIES) {
+      // Replace the older file
+      if (f) f.close();
+      current ^= 1;
+      LittleFS.remove(path(current));
+      count[current] = 0;
+      firstSeq[current] = 0;
+    }
+    if (!f) f = LittleFS.open(path(current), "a");
+    if (!f || f.write((const uint8_t *)&entries[written], sizeof(journal_entry_t)) != sizeof(journal_entry_t)) {
+      LOG_ERROR_LN(F("[JOURNAL] Unable to write the journal"));
+      break;
+    }
+    if (count[current]++ == 0) firstSeq[current] = entries[written].seq;
+  }
+  if (f) f.close();
+
+  if (written < num) {
+    // A partly written entry would misalign the file, the scan removes it in that case
+    scan(current);
+    // Try again with the next flush, in front of the entries recorded meanwhile
+    uint8_t keep = num - written;
+    portENTER_CRITICAL(&mux);
+    uint8_t newer = pendingCount;
+    if (keep + newer > JOURNAL_PENDING) {
+      dropped += keep + newer - JOURNAL_PENDING;
+      newer = JOURNAL_PENDING - keep;
+    }
+    memmove(pending + keep, pending, newer * sizeof(journal_entry_t));
+    memcpy(pending, entries + written, keep * sizeof(journal_entry_t));
+    pendingCount = keep + newer;
+    portEXIT_CRITICAL(&mux);
+  }
+  xSemaphoreGive(mutex);
+}
+
+uint16_t Journal::find(File &f, uint8_t file, uint32_t from) {
+  // Entries are sorted by seq, but a failed write may have left a gap
+  uint16_t lo = 0, hi = count[file];
+  journal_entry_t entry;
+  while (lo < hi) {
+    uint16_t mid = lo + (hi - lo) / 2;
+    if (!f.seek(mid * sizeof(entry)) || f.read((uint8_t *)&entry, sizeof(entry)) != sizeof(entry)) break;
+    if (entry.seq < from) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+uint16_t Journal::read(uint32_t from, journal_entry_t * out, uint16_t max) {
+  if (!mutex) return 0;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  uint16_t num = 0;
+  for (uint8_t n = 0; n < 2 && num < max; n++) {
+    uint8_t file = n == 0 ? current ^ 1 : current;
+    if (!count[file]) continue;
+
+    File f = LittleFS.open(path(file), "r");
+    if (!f) continue;
+    uint16_t start = from > firstSeq[file] ? find(f, file, from) : 0;
+    uint16_t len = count[file] - start;
+    if (len > max - num) len = max - num;
+    if (len && f.seek(start * sizeof(journal_entry_t))) {
+      num += f.read((uint8_t *)(out + num), len * sizeof(journal_entry_t)) / sizeof(journal_entry_t);
+    }
+    f.close();
+    if (num) from = out[num - 1].seq + 1;
+  }
+
+  // Entries not written yet
+  portENTER_CRITICAL(&mux);
+  for (uint8_t i = 0; i < pendingCount && num < max; i++) {
+    if (pending[i].seq >= from) out[num++] = pending[i];
+  }
+  portEXIT_CRITICAL(&mux);
+  xSemaphoreGive(mutex);
+  return num;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file journal.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Append-only journal of significant events and crashes on LittleFS
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef JOURNAL_h
+#define JOURNAL_h
+
+#include <Arduino.h>
+#include <FS.h>
+
+#define JOURNAL_DIR "/journal"
+#define JOURNAL_FILE_ENTRIES 128                // entries per file, two files are kept
+#define JOURNAL_PENDING 16                      // entries collected in RAM before they are written
+#define JOURNAL_FLUSH_MS 600000                 // write pending entries at least every 10 minutes
+#define JOURNAL_TEXT_SIZE 44
+#define JOURNAL_BACKTRACE (JOURNAL_TEXT_SIZE / 4)
+
+enum journal_type_t : uint8_t {
+    JOURNAL_BOOT = 0,                           // value: esp_reset_reason(), text: loop phase at a crash
+    JOURNAL_PANIC,                              // value: program counter, text: reason and core
+    JOURNAL_BACKTRACE_ADDR,                     // value: number of addresses, addresses: backtrace
+    JOURNAL_PUMP,                               // value: runs since boot, text: reason
+    JOURNAL_SETUP,                              // value: 1 started, 2 ended with a configuration, 0 ended without
+    JOURNAL_SENSOR,                             // value: 1 fault, 0 recovered
+    JOURNAL_MQTT,                               // value: 1 connected, 0 connection lost
+    JOURNAL_UPDATE,                             // value: 1 firmware, 2 filesystem, text: source
+    JOURNAL_TYPES
+};
+
+struct journal_entry_t {
+    uint32_t seq;                               // increases with every entry, never reused
+    uint32_t time;                              // unix time, 0 if not known yet
+    uint32_t uptimeS;
+    uint16_t boot;                              // counts the starts of the firmware
+    journal_type_t type;
+    uint8_t tank;                               // 1.., 0 for the device
+    int32_t value;
+    union {
+        char text[JOURNAL_TEXT_SIZE];
+        uint32_t addresses[JOURNAL_BACKTRACE];
+    };
+};
+
+// Events are kept in RAM and appended to the newer of two files, once it is full the older one
+// is replaced. Only whole entries are appended, so LittleFS spreads the writes over the flash.
+class Journal {
+    public:
+        // Restore the sequence and boot counters and record the start unless it is a deep sleep wakeup,
+        // reason is esp_reset_reason() and phase the loop phase that was running at a crash
+        void begin(int32_t reason, const char * phase);
+
+        // Record an event, safe from any task
+        void add(journal_type_t type, uint8_t tank, int32_t value, const char * text = "");
+
+        // Write pending entries if there are enough of them or they waited too long, call it from loop()
+        void loop();
+
+        // Write all pending entries, e.g. before a restart or deep sleep
+        void flush();
+
+        // Copy up to max entries with seq >= from into out, oldest first
+        uint16_t read(uint32_t from, journal_entry_t * out, uint16_t max);
+
+        uint16_t getBoot() { return boot; }
+
+        // Events lost because too many were recorded between two writes
+        uint32_t getDropped() { return dropped; }
+
+        static const char * typeName(journal_type_t type);
+
+    private:
+        portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        SemaphoreHandle_t mutex = NULL;         // file access
+
+        journal_entry_t pending[JOURNAL_PENDING];
+        uint8_t pendingCount = 0;
+        bool urgent = false;                    // a crash or boot entry waits to be written
+        uint32_t dropped = 0;
+        uint64_t lastFlush = 0;
+
+        uint32_t nextSeq = 1;
+        uint16_t boot = 1;
+        uint8_t current = 0;                    // file that is appended to
+        uint32_t firstSeq[2] = {0, 0};          // seq of the first entry in each file, 0 if empty
+        uint16_t count[2] = {0, 0};
+
+        const char * path(uint8_t file);
+        void scan(uint8_t file);
+
+        // Index of the first entry with seq >= from in an open file
+        uint16_t find(File &f, uint8_t file, uint32_t from);
+        void restorePanic();
+        void queue(journal_entry_t &entry);
+};
+
+extern Journal journal;
+
+#endif // JOURNAL_h
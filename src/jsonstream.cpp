@@ -0,0 +1,148 @@
+/**
+ * @file jsonstream.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Write JSON directly to a Print without building a document in memory
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "jsonstream.h"
+
+void JsonStream::separator() {
+  if (afterKey) {
+    afterKey = false;
+    return;
+  }
+  if (depth > 0 && (hasMembers & (1UL << depth))) out.write(',');
+  hasMembers |= 1UL << depth;
+}
+
+void JsonStream::string(const char *s) {
+  out.write('"');
+  for (; s && *s; s++) {
+    switch (*s) {
+      case '"':  out.print("\\\""); break;
+      case '\\': out.print("\\\\"); break;
+      case '\n': out.print("\\n"); break;
+      case '\r': out.print("\\r"); break;
+      case '\t': out.print("\\t"); break;
+      default:
+        if ((uint8_t)*s < 0x20) out.printf("\\u%04x", *s);
+        else out.write(*s);
+    }
+  }
+  out.write('"');
+}
+
+JsonStream& JsonStream::beginObject() {
+  separator();
+  out.write('{');
+  if (depth < JSONSTREAM_MAX_DEPTH - 1) depth++;
+  hasMembers &= ~(1UL << depth);
+  return *this;
+}
+
+JsonStream& JsonStream::endObject() {
+  out.write('}');
+  if (depth > 0) depth--;
+  return *this;
+}
+
+JsonStream& JsonStream::beginArray() {
+  separator();
+  out.write('[');
+  if (depth < JSONSTREAM_MAX_DEPTH - 1) depth++;
+  hasMembers &= ~(1UL << depth);
+  return *this;
+}
+
+JsonStream& JsonStream::endArray() {
+  out.write(']');
+  if (depth > 0) depth--;
+  return *this;
+}
+
+JsonStream& JsonStream::key(const char *name) {
+  separator();
+  string(name);
+  out.write(':');
+  afterKey = true;
+  return *this;
+}
+
+JsonStream& JsonStream::value(const char *v) {
+  separator();
+  if (v) string(v);
+  else out.print("null");
+  return *this;
+}
+
+JsonStream& JsonStream::value(bool v) {
+  separator();
+  out.print(v ? "true" : "false");
+  return *this;
+}
+
+JsonStream& JsonStream::value(int v) {
+  separator();
+  out.print(v);
+  return *this;
+}
+
+JsonStream& JsonStream::value(unsigned int v) {
+  separator();
+  out.print(v);
+  return *this;
+}
+
+JsonStream& JsonStream::value(long v) {
+  separator();
+  out.print(v);
+  return *this;
+}
+
+JsonStream& JsonStream::value(unsigned long v) {
+  separator();
+  out.print(v);
+  return *this;
+}
+
+JsonStream& JsonStream::value(long long v) {
+  separator();
+  out.print(v);
+  return *this;
+}
+
+JsonStream& JsonStream::value(unsigned long long v) {
+  separator();
+  out.print(v);
+  return *this;
+}
+
+JsonStream& JsonStream::value(double v, uint8_t decimals) {
+  separator();
+  if (isnan(v) || isinf(v)) out.print("null");
+  else out.print(v, decimals);
+  return *this;
+}
+
+size_t PrintWindow::write(uint8_t c) {
+  if (position >= offset && position < offset + maxLen) buffer[position - offset] = c;
+  position++;
+  return 1;
+}
+
+size_t PrintWindow::write(const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++) write(data[i]);
+  return size;
+}
+
+size_t PrintWindow::length() {
+  if (position <= offset) return 0;
+  return position - offset < maxLen ? position - offset : maxLen;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file jsonstream.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Write JSON directly to a Print without building a document in memory
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef JSONSTREAM_h
+#define JSONSTREAM_h
+
+#include <Arduino.h>
+
+#define JSONSTREAM_MAX_DEPTH 32                 // nesting of objects and arrays
+
+// Usage: json.beginObject().add("level", 42).beginArray("data").value(1).value(2).endArray().endObject();
+class JsonStream {
+    public:
+        JsonStream(Print &output) : out(output) {}
+
+        JsonStream& beginObject();
+        JsonStream& beginObject(const char *name) { return key(name).beginObject(); }
+        JsonStream& endObject();
+        JsonStream& beginArray();
+        JsonStream& beginArray(const char *name) { return key(name).beginArray(); }
+        JsonStream& endArray();
+
+        // Start a member of the current object, followed by a value or a nested object/array
+        JsonStream& key(const char *name);
+
+        JsonStream& value(const char *v);
+        JsonStream& value(bool v);
+        JsonStream& value(int v);
+        JsonStream& value(unsigned int v);
+        JsonStream& value(long v);
+        JsonStream& value(unsigned long v);
+        JsonStream& value(long long v);
+        JsonStream& value(unsigned long long v);
+        JsonStream& value(double v, uint8_t decimals = 2);
+
+        template <typename T> JsonStream& add(const char *name, T v) { return key(name).value(v); }
+        JsonStream& add(const char *name, double v, uint8_t decimals) { return key(name).value(v, decimals); }
+
+    private:
+        Print &out;
+        uint8_t depth = 0;
+        uint32_t hasMembers = 0;                // bit per depth, set once the first member was written
+        bool afterKey = false;
+
+        // Write the separator in front of a value or key
+        void separator();
+        void string(const char *s);
+};
+
+// Print that only keeps the bytes [offset, offset + maxLen) of everything written to it.
+// Used to serialize a document in chunks with a fixed buffer by repeating the serialization.
+class PrintWindow : public Print {
+    public:
+        PrintWindow(uint8_t *buffer, size_t maxLen, size_t offset) : buffer(buffer), maxLen(maxLen), offset(offset) {}
+
+        size_t write(uint8_t c) override;
+        size_t write(const uint8_t *data, size_t size) override;
+
+        // Bytes stored in the buffer
+        size_t length();
+
+        // Bytes written to it, also those outside of the window
+        size_t total() { return position; }
+
+    private:
+        uint8_t *buffer;
+        size_t maxLen;
+        size_t offset;
+        size_t position = 0;
+};
+
+#endif // JSONSTREAM_h
@@ -0,0 +1,69 @@
+/**
+ * @file log.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Log lines collected and formatted for the log ring
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include <Arduino.h>
+#include "log.h"
+#include "mempool.h"
+
+#define LOG_STACK_BUFFER 128                    // most log lines fit, longer ones use the log pool
+
+void logPrintf(const char *format, ...) {
+  char stackBuffer[LOG_STACK_BUFFER];
+  char * buffer = stackBuffer;
+  va_list arg;
+  va_list copy;
+  va_start(arg, format);
+  va_copy(copy, arg);
+  int len = vsnprintf(stackBuffer, sizeof(stackBuffer), format, copy);
+  va_end(copy);
+
+  if (len >= (int)sizeof(stackBuffer)) {
+    if (len < LOGPOOL_BLOCK_SIZE) buffer = (char *)logPool.acquire();
+    // Pool exhausted or the line too long for a block
+    if (buffer == stackBuffer || buffer == nullptr) buffer = (char *)malloc(len + 1);
+    if (buffer == nullptr) {
+      va_end(arg);
+      return;
+    }
+    vsnprintf(buffer, len + 1, format, arg);
+  }
+  va_end(arg);
+
+  if (len > 0) logRing.push(buffer, len);
+
+  if (logPool.owns(buffer)) logPool.release(buffer);
+  else if (buffer != stackBuffer) free(buffer);
+}
+
+LogLine::~LogLine() {
+  if (len) logRing.push(buffer, len);
+}
+
+size_t LogLine::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t LogLine::write(const uint8_t *data, size_t size) {
+  for (size_t done = 0; done < size; ) {
+    if (len == sizeof(buffer)) {
+      logRing.push(buffer, len);
+      len = 0;
+    }
+    size_t n = sizeof(buffer) - len;
+    if (n > size - done) n = size - done;
+    memcpy(buffer + len, data + done, n);
+    len += n;
+    done += n;
+  }
+  return size;
+}
@@ -1,25 +1,105 @@
-
+#ifndef LOG_h
+#define LOG_h
 
 #include "webserial.h"
+#include "logring.h"
 extern WebSerialClass WebSerial;
 
-#ifndef LOG_INFO
-  #define LOG_INFO(...)  do {     \
-    Serial.print(__VA_ARGS__);    \
-    WebSerial.print(__VA_ARGS__); \
-    } while(0)
-#endif // LOG_INFO(...)
+// Levels are filtered at compile time, disabled macros expand to nothing and their arguments are not evaluated
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
 
-#ifndef LOG_INFO_LN
-  #define LOG_INFO_LN(...) do {    \
-    Serial.println(__VA_ARGS__);   \
-    WebSerial.println(__VA_ARGS__);  \
-    } while(0)
-#endif // LOG_INFO_LN(...)
+#ifndef LOG_LEVEL
+  #define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_BINARY
+  #define LOG_BINARY 0                          // 1 to log a format string ID and the raw arguments, see tools/logdecode.py
+#endif
+
+#define LOG_LINE_SIZE 128                       // text collected by LOG_INFO() before it is pushed to the log ring
+
+// Collects the output of one LOG_INFO() on the stack and pushes it as a single record
+class LogLine : public Print {
+    public:
+        ~LogLine();
+        size_t write(uint8_t c) override;
+        size_t write(const uint8_t *data, size_t size) override;
+
+    private:
+        char buffer[LOG_LINE_SIZE];
+        size_t len = 0;
+};
+
+// Format into the log ring, long lines use the log pool instead of the heap
+void logPrintf(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+
+#if LOG_BINARY
+  #include "logbinary.h"
 
-#ifndef LOG_INFO_F
-  #define LOG_INFO_F(format, ...)  do {     \
-    Serial.printf(format, __VA_ARGS__);    \
-    WebSerial.printf(format, __VA_ARGS__);  \
+  // The format string is only checked by the compiler, it does not end up in the firmware
+  #define LOG_FORMAT(format, ...) do {                        \
+    (void)sizeof((logPrintf(format, __VA_ARGS__), 0));        \
+    constexpr uint32_t logId = logFormatId(format);           \
+    logBinary(logId, __VA_ARGS__);                            \
     } while(0)
-#endif // LOG_INFO_F(format, ...)
+#else
+  #define LOG_FORMAT(format, ...) logPrintf(format, __VA_ARGS__)
+#endif
+
+#define LOG_PRINT(...) do {       \
+  LogLine line;                   \
+  line.print(__VA_ARGS__);        \
+  } while(0)
+
+#define LOG_PRINTLN(...) do {     \
+  LogLine line;                   \
+  line.println(__VA_ARGS__);      \
+  } while(0)
+
+#define LOG_DISABLED(...) do {} while(0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+  #define LOG_ERROR_LN(...) LOG_PRINTLN(__VA_ARGS__)
+  #define LOG_ERROR_F(format, ...) LOG_FORMAT(format, __VA_ARGS__)
+#else
+  #define LOG_ERROR_LN(...) LOG_DISABLED()
+  #define LOG_ERROR_F(format, ...) LOG_DISABLED()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+  #define LOG_WARN_LN(...) LOG_PRINTLN(__VA_ARGS__)
+  #define LOG_WARN_F(format, ...) LOG_FORMAT(format, __VA_ARGS__)
+#else
+  #define LOG_WARN_LN(...) LOG_DISABLED()
+  #define LOG_WARN_F(format, ...) LOG_DISABLED()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+  #ifndef LOG_INFO
+    #define LOG_INFO(...) LOG_PRINT(__VA_ARGS__)
+  #endif
+  #ifndef LOG_INFO_LN
+    #define LOG_INFO_LN(...) LOG_PRINTLN(__VA_ARGS__)
+  #endif
+  #ifndef LOG_INFO_F
+    #define LOG_INFO_F(format, ...) LOG_FORMAT(format, __VA_ARGS__)
+  #endif
+#else
+  #define LOG_INFO(...) LOG_DISABLED()
+  #define LOG_INFO_LN(...) LOG_DISABLED()
+  #define LOG_INFO_F(format, ...) LOG_DISABLED()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  #define LOG_DEBUG_LN(...) LOG_PRINTLN(__VA_ARGS__)
+  #define LOG_DEBUG_F(format, ...) LOG_FORMAT(format, __VA_ARGS__)
+#else
+  #define LOG_DEBUG_LN(...) LOG_DISABLED()
+  #define LOG_DEBUG_F(format, ...) LOG_DISABLED()
+#endif
+
+#endif // LOG_h
@@ -0,0 +1,104 @@
+/**
+ * @file logbinary.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Compact log records with a format string ID and the raw arguments, decoded by tools/logdecode.py
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef LOGBINARY_h
+#define LOGBINARY_h
+
+#include <Arduino.h>
+#include <type_traits>
+#include "logring.h"
+
+#define LOGBINARY_MARKER 0xFF                   // never part of UTF-8 text, starts a binary record
+#define LOGBINARY_HEADER_SIZE 6                 // marker, format ID and argument length
+#define LOGBINARY_MAX_ARGS 240                  // argument bytes of a record, further arguments are left out
+#define LOGBINARY_MAX_STRING 64                 // longer string arguments are cut
+
+// FNV-1a hash of the format string, tools/logdecode.py hashes the strings from the sources the same way
+constexpr uint32_t logFormatId(const char *format) {
+  uint32_t hash = 2166136261UL;
+  while (*format) hash = (hash ^ (uint8_t)*format++) * 16777619UL;
+  return hash;
+}
+
+// Record layout: marker, uint32 ID, uint8 argument length, arguments in little endian.
+// Integers take 4 bytes (8 for 64 bit types), floating point values are sent as float,
+// strings as a length byte followed by the characters.
+class LogFrame {
+    public:
+        LogFrame(uint32_t id) {
+            buffer[0] = LOGBINARY_MARKER;
+            memcpy(buffer + 1, &id, sizeof(id));
+        }
+
+        void add(const void *data, size_t size) {
+            if (full || len + size > sizeof(buffer)) {
+                full = true;
+                return;
+            }
+            memcpy(buffer + len, data, size);
+            len += size;
+        }
+
+        void push() {
+            buffer[5] = len - LOGBINARY_HEADER_SIZE;
+            logRing.push((const char *)buffer, len);
+        }
+
+    private:
+        uint8_t buffer[LOGBINARY_HEADER_SIZE + LOGBINARY_MAX_ARGS];
+        size_t len = LOGBINARY_HEADER_SIZE;
+        bool full = false;
+};
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type logArg(LogFrame &frame, T value) {
+    if (sizeof(T) > 4) {
+        uint64_t raw = (uint64_t)value;
+        frame.add(&raw, sizeof(raw));
+    } else {
+        uint32_t raw = (uint32_t)value;
+        frame.add(&raw, sizeof(raw));
+    }
+}
+
+inline void logArg(LogFrame &frame, double value) {
+    float raw = value;
+    frame.add(&raw, sizeof(raw));
+}
+
+inline void logArg(LogFrame &frame, const char *value) {
+    uint8_t len = value ? strnlen(value, LOGBINARY_MAX_STRING) : 0;
+    frame.add(&len, 1);
+    frame.add(value, len);
+}
+
+inline void logArg(LogFrame &frame, const String &value) {
+    logArg(frame, value.c_str());
+}
+
+inline void logArgs(LogFrame &frame) {}
+
+template<typename T, typename... Rest>
+void logArgs(LogFrame &frame, const T &value, const Rest &... rest) {
+    logArg(frame, value);
+    logArgs(frame, rest...);
+}
+
+template<typename... Args>
+void logBinary(uint32_t id, const Args &... args) {
+    LogFrame frame(id);
+    logArgs(frame, args...);
+    frame.push();
+}
+
+#endif // LOGBINARY_h
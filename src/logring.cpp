@@ -0,0 +1,148 @@
+/**
+ * @file logring.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Lock-free log buffer, drained to Serial and WebSerial by a background task
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "logring.h"
+#include "webserial.h"
+#if LOG_BINARY
+#include "logbinary.h"
+#endif
+
+extern WebSerialClass WebSerial;
+
+#define LOGRING_MASK (LOGRING_SIZE - 1)
+#define LOGRING_COMMITTED 0x80000000UL          // set in the header word once the text is complete
+
+static_assert((LOGRING_SIZE & LOGRING_MASK) == 0, "LOGRING_SIZE must be a power of two");
+static_assert(LOGRING_MAX_RECORD + 4 <= LOGRING_SIZE / 4, "a record must not fill a large part of the ring");
+
+LogRing logRing;
+
+void LogRing::begin() {
+  if (taskHandle != NULL) return;
+  consumer = xSemaphoreCreateMutex();
+  xTaskCreate(&LogRing::drainTask, "log", 3072, this, LOGRING_TASK_PRIORITY, &taskHandle);
+}
+
+bool IRAM_ATTR LogRing::push(const char * data, size_t len) {
+  bool ok = true;
+  while (len > 0) {
+    size_t n = len > LOGRING_MAX_RECORD ? LOGRING_MAX_RECORD : len;
+    ok &= pushRecord(data, n);
+    data += n;
+    len -= n;
+  }
+  return ok;
+}
+
+bool IRAM_ATTR LogRing::pushRecord(const char * data, size_t len) {
+  uint32_t need = 4 + ((len + 3) & ~3UL);
+
+  // Reserve the space, the consumer only frees space it has cleared again
+  uint32_t pos = head.load(std::memory_order_relaxed);
+  do {
+    if (pos + need - tail.load(std::memory_order_acquire) > LOGRING_SIZE) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!head.compare_exchange_weak(pos, pos + need, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+  uint8_t * bytes = (uint8_t *)words;
+  uint32_t start = (pos + 4) & LOGRING_MASK;
+  size_t first = len < LOGRING_SIZE - start ? len : LOGRING_SIZE - start;
+  memcpy(bytes + start, data, first);
+  memcpy(bytes, data + first, len - first);
+
+  // Publish the record, the consumer waits for this flag and not for the head
+  __atomic_store_n(&words[(pos & LOGRING_MASK) / 4], len | LOGRING_COMMITTED, __ATOMIC_RELEASE);
+  records.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+size_t LogRing::pop(char * out, size_t max) {
+  uint32_t pos = tail.load(std::memory_order_relaxed);
+  uint32_t used = head.load(std::memory_order_relaxed) - pos;
+  if (used > highWater) highWater = used;
+
+  uint8_t * bytes = (uint8_t *)words;
+  size_t total = 0;
+  for (;;) {
+    uint32_t header = __atomic_load_n(&words[(pos & LOGRING_MASK) / 4], __ATOMIC_ACQUIRE);
+    if (!(header & LOGRING_COMMITTED)) break;
+    size_t len = header & ~LOGRING_COMMITTED;
+    if (total + len > max) break;
+
+    uint32_t start = (pos + 4) & LOGRING_MASK;
+    size_t first = len < LOGRING_SIZE - start ? len : LOGRING_SIZE - start;
+    memcpy(out + total, bytes + start, first);
+    memcpy(out + total + first, bytes, len - first);
+    total += len;
+
+    // Producers rely on free space being zero, any word may become the header of a later record
+    uint32_t need = 4 + ((len + 3) & ~3UL);
+    for (uint32_t i = 0; i < need; i += 4) words[((pos + i) & LOGRING_MASK) / 4] = 0;
+    pos += need;
+    tail.store(pos, std::memory_order_release);
+  }
+  return total;
+}
+
+void LogRing::drainLocked() {
+  char chunk[LOGRING_MAX_RECORD * 2];
+  size_t len;
+  while ((len = pop(chunk, sizeof(chunk))) > 0) {
+    Serial.write((const uint8_t *)chunk, len);
+    writeText(chunk, len);
+  }
+}
+
+void LogRing::writeText(const char * data, size_t len) {
+  #if LOG_BINARY
+  // Binary records are for the serial port and tools/logdecode.py, the websocket only gets text
+  size_t start = 0;
+  size_t i = 0;
+  while (i < len) {
+    if ((uint8_t)data[i] != LOGBINARY_MARKER || i + LOGBINARY_HEADER_SIZE > len) {
+      i++;
+      continue;
+    }
+    if (i > start) WebSerial.write(data + start, i - start);
+    i += LOGBINARY_HEADER_SIZE + (uint8_t)data[i + 5];
+    start = i;
+  }
+  if (start < len) WebSerial.write(data + start, len - start);
+  #else
+  WebSerial.write(data, len);
+  #endif
+}
+
+void LogRing::drainTask(void * arg) {
+  LogRing * self = (LogRing *)arg;
+  for (;;) {
+    xSemaphoreTake(self->consumer, portMAX_DELAY);
+    self->drainLocked();
+    xSemaphoreGive(self->consumer);
+    WebSerial.loop();
+    vTaskDelay(pdMS_TO_TICKS(LOGRING_DRAIN_MS));
+  }
+}
+
+void LogRing::flush() {
+  if (consumer) xSemaphoreTake(consumer, portMAX_DELAY);
+  drainLocked();
+  if (consumer) xSemaphoreGive(consumer);
+  Serial.flush();
+}
+
+LogRing::metrics_t LogRing::getMetrics() {
+  return { records.load(std::memory_order_relaxed), dropped.load(std::memory_order_relaxed), highWater };
+}
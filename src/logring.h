@@ -0,0 +1,75 @@
+/**
+ * @file logring.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Lock-free log buffer, drained to Serial and WebSerial by a background task
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef LOGRING_h
+#define LOGRING_h
+
+#include <Arduino.h>
+#include <atomic>
+
+#define LOGRING_SIZE 4096                       // log text waiting for output, must be a power of two
+#define LOGRING_MAX_RECORD 256                  // longer text is split into several records
+#define LOGRING_DRAIN_MS 20                     // interval of the drain task
+#define LOGRING_TASK_PRIORITY 1                 // below everything that produces log lines
+
+// Multi-producer ring of log records. push() reserves space with a compare-and-swap and never
+// blocks, so it can be called from any task or an ISR. A single consumer, the drain task,
+// writes the records to Serial and hands them to WebSerial, which batches them into frames.
+class LogRing {
+    public:
+        // Counters exposed through the API
+        struct metrics_t {
+            uint32_t records;                   // pushed records
+            uint32_t dropped;                   // records lost because the ring was full
+            uint32_t highWater;                 // most bytes waiting for the drain task
+        };
+
+        // Start the drain task, records pushed before are kept until then
+        void begin();
+
+        // Append text, returns false if it was dropped. Safe in ISRs, but format the text outside of them.
+        bool push(const char * data, size_t len);
+
+        // Write everything pending to Serial and wait until it is sent, e.g. before a deep sleep
+        void flush();
+
+        metrics_t getMetrics();
+
+    private:
+        uint32_t words[LOGRING_SIZE / 4];       // a header word (length and commit flag) and the padded text per record
+        std::atomic<uint32_t> head{0};          // end of the reserved space, grows forever and wraps with the ring
+        std::atomic<uint32_t> tail{0};          // start of the records not yet consumed
+        std::atomic<uint32_t> records{0};
+        std::atomic<uint32_t> dropped{0};
+        uint32_t highWater = 0;
+
+        SemaphoreHandle_t consumer = NULL;      // the drain task and flush() take turns
+        TaskHandle_t taskHandle = NULL;
+
+        bool pushRecord(const char * data, size_t len);
+
+        // Copy committed records in order, stops at the first one still being written
+        size_t pop(char * out, size_t max);
+
+        // Pop and write everything to the outputs, requires the consumer semaphore
+        void drainLocked();
+
+        // Hand text records to WebSerial
+        void writeText(const char * data, size_t len);
+
+        static void drainTask(void * arg);
+};
+
+extern LogRing logRing;
+
+#endif // LOGRING_h
@@ -0,0 +1,201 @@
+/**
+ * @file loopmonitor.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Loop latency, stalls and task stack usage for diagnostics
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+
+#include <esp_attr.h>
+#include "loopmonitor.h"
+
+#define LOOPMONITOR_MAGIC 0x4c4d5031            // "LMP1"
+
+// The running phase survives a watchdog reset or panic, so the next boot can tell where it hung
+RTC_NOINIT_ATTR static struct {
+  uint32_t magic;
+  char phase[LOOPMONITOR_PHASE_SIZE];
+} rtcPhase;
+
+#if configUSE_TRACE_FACILITY
+static TaskStatus_t taskStatus[LOOPMONITOR_MAX_TASKS];
+#endif
+
+const uint32_t LoopMonitor::bucketLimitsMs[LOOPMONITOR_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+
+void LoopMonitor::begin() {
+  memset(&data, 0, sizeof(data));
+  data.resetReason = esp_reset_reason();
+  bool crashed = data.resetReason == ESP_RST_PANIC || data.resetReason == ESP_RST_INT_WDT
+    || data.resetReason == ESP_RST_TASK_WDT || data.resetReason == ESP_RST_WDT;
+  if (crashed && rtcPhase.magic == LOOPMONITOR_MAGIC) {
+    strlcpy(data.resetPhase, rtcPhase.phase, sizeof(data.resetPhase));
+    LOG_INFO_F("[MONITOR] Reset by watchdog or panic (reason %d) in loop phase '%s'\n", data.resetReason, data.resetPhase);
+  }
+  rtcPhase.magic = LOOPMONITOR_MAGIC;
+  strlcpy(rtcPhase.phase, "setup", sizeof(rtcPhase.phase));
+}
+
+void LoopMonitor::beginIteration() {
+  uint64_t now = esp_timer_get_time();
+  // Longer than the intended delay means higher priority tasks kept the CPU
+  if (iterationEnd) {
+    uint32_t gapUs = now - iterationEnd;
+    if (gapUs > (idleMs + LOOPMONITOR_STARVED_MS) * 1000) {
+      portENTER_CRITICAL(&mux);
+      data.starved++;
+      portEXIT_CRITICAL(&mux);
+      recordStall(gapUs - idleMs * 1000, "starved");
+    }
+  }
+  iterationStart = now;
+  phaseStart = now;
+  currentPhase = "loop";
+  slowestPhase = currentPhase;
+  slowestPhaseUs = 0;
+}
+
+void LoopMonitor::phase(const char *name) {
+  uint64_t now = esp_timer_get_time();
+  uint32_t elapsed = now - phaseStart;
+  if (elapsed > slowestPhaseUs) {
+    slowestPhaseUs = elapsed;
+    slowestPhase = currentPhase;
+  }
+  currentPhase = name;
+  phaseStart = now;
+  strlcpy(rtcPhase.phase, name, sizeof(rtcPhase.phase));
+}
+
+void LoopMonitor::endIteration(uint32_t idle) {
+  if (!iterationStart) return;
+  phase("idle");
+  uint64_t now = esp_timer_get_time();
+  uint32_t durationUs = now - iterationStart;
+
+  uint8_t bucket = 0;
+  while (bucket < LOOPMONITOR_BUCKETS - 1 && durationUs > bucketLimitsMs[bucket] * 1000) bucket++;
+
+  portENTER_CRITICAL(&mux);
+  data.buckets[bucket]++;
+  data.iterations++;
+  data.sumUs += durationUs;
+  if (durationUs > data.maxUs) data.maxUs = durationUs;
+  portEXIT_CRITICAL(&mux);
+
+  recordStall(durationUs, slowestPhase);
+  iterationStart = 0;
+  iterationEnd = now;
+  idleMs = idle;
+}
+
+// Keep the slowest iterations, sorted by duration
+void LoopMonitor::recordStall(uint32_t durationUs, const char *phase) {
+  if (durationUs <= data.stalls[LOOPMONITOR_STALLS - 1].durationUs) return;
+
+  stall_t stall;
+  stall.durationUs = durationUs;
+  stall.uptimeS = esp_timer_get_time() / 1000000;
+  strlcpy(stall.phase, phase, sizeof(stall.phase));
+
+  portENTER_CRITICAL(&mux);
+  uint8_t i = LOOPMONITOR_STALLS - 1;
+  while (i > 0 && data.stalls[i - 1].durationUs < durationUs) {
+    data.stalls[i] = data.stalls[i - 1];
+    i--;
+  }
+  data.stalls[i] = stall;
+  portEXIT_CRITICAL(&mux);
+}
+
+void LoopMonitor::sampleTasks() {
+  uint64_t now = esp_timer_get_time();
+  if (lastSample && now - lastSample < LOOPMONITOR_SAMPLE_MS * 1000ULL) return;
+  lastSample = now;
+
+  task_t tasks[LOOPMONITOR_MAX_TASKS];
+  uint8_t count = 0;
+
+  #if configUSE_TRACE_FACILITY
+  uint32_t total = 0;
+  UBaseType_t num = uxTaskGetSystemState(taskStatus, LOOPMONITOR_MAX_TASKS, &total);
+  for (UBaseType_t i = 0; i < num; i++) {
+    const TaskStatus_t &s = taskStatus[i];
+    task_t &t = tasks[count++];
+    strlcpy(t.name, s.pcTaskName, sizeof(t.name));
+    t.stackFree = s.usStackHighWaterMark;
+    t.priority = s.uxCurrentPriority;
+    #if configTASKLIST_INCLUDE_COREID
+    t.core = s.xCoreID == tskNO_AFFINITY ? -1 : s.xCoreID;
+    #else
+    t.core = -1;
+    #endif
+    t.cpuPercent = -1;
+
+    #if configGENERATE_RUN_TIME_STATS
+    // Share of the runtime since the last sample, tasks are matched by their handle
+    for (uint8_t p = 0; p < previousCount; p++) {
+      if (previousHandles[p] != s.xHandle || total == previousTotal) continue;
+      // Both cores count, so the total is twice the elapsed time
+      uint32_t share = (uint64_t)(s.ulRunTimeCounter - previousRuntime[p]) * 100 * portNUM_PROCESSORS / (total - previousTotal);
+      t.cpuPercent = share > 100 ? 100 : share;
+    }
+    #endif
+  }
+  #if configGENERATE_RUN_TIME_STATS
+  for (UBaseType_t i = 0; i < num; i++) {
+    previousHandles[i] = taskStatus[i].xHandle;
+    previousRuntime[i] = taskStatus[i].ulRunTimeCounter;
+  }
+  previousCount = num;
+  previousTotal = total;
+  #endif
+  #else
+  // Without the trace facility only the calling task is known
+  task_t &t = tasks[count++];
+  strlcpy(t.name, pcTaskGetName(NULL), sizeof(t.name));
+  t.stackFree = uxTaskGetStackHighWaterMark(NULL);
+  t.priority = uxTaskPriorityGet(NULL);
+  t.core = xPortGetCoreID();
+  t.cpuPercent = -1;
+  #endif
+
+  portENTER_CRITICAL(&mux);
+  memcpy(data.tasks, tasks, sizeof(task_t) * count);
+  data.taskCount = count;
+  portEXIT_CRITICAL(&mux);
+}
+
+void LoopMonitor::getReport(report_t &report) {
+  portENTER_CRITICAL(&mux);
+  memcpy(&report, &data, sizeof(report));
+  portEXIT_CRITICAL(&mux);
+}
+
+size_t LoopMonitor::formatSummary(char *buffer, size_t size) {
+  // Only the loop task writes, a torn read of single values does not matter for a summary
+  uint32_t avgUs = data.iterations ? data.sumUs / data.iterations : 0;
+
+  // The task closest to a stack overflow
+  task_t tightest = { "", 0, 0, -1, -1 };
+  portENTER_CRITICAL(&mux);
+  for (uint8_t i = 0; i < data.taskCount; i++) {
+    if (i == 0 || data.tasks[i].stackFree < tightest.stackFree) tightest = data.tasks[i];
+  }
+  stall_t worst = data.stalls[0];
+  portEXIT_CRITICAL(&mux);
+
+  return snprintf(buffer, size,
+    "{\"iterations\":%u,\"avgUs\":%u,\"maxUs\":%u,\"starved\":%u,\"worstStallUs\":%u,\"worstStallPhase\":\"%s\","
+    "\"minStackFree\":%u,\"minStackTask\":\"%s\",\"resetReason\":%d,\"resetPhase\":\"%s\"}",
+    data.iterations, avgUs, data.maxUs, data.starved, worst.durationUs, worst.phase,
+    tightest.stackFree, tightest.name, data.resetReason, data.resetPhase
+  );
+}
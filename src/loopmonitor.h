@@ -0,0 +1,103 @@
+/**
+ * @file loopmonitor.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Loop latency, stalls and task stack usage for diagnostics
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef LOOPMONITOR_h
+#define LOOPMONITOR_h
+
+#include <Arduino.h>
+#include <esp_system.h>
+
+#define LOOPMONITOR_BUCKETS 11                  // loop durations up to 1, 2, 5 ... 1000 ms and +Inf
+#define LOOPMONITOR_STALLS 5                    // slowest loop iterations kept
+#define LOOPMONITOR_MAX_TASKS 24                // FreeRTOS tasks sampled
+#define LOOPMONITOR_SAMPLE_MS 10000             // interval of the task statistics
+#define LOOPMONITOR_STARVED_MS 250              // the loop did not get the CPU back this long after its delay
+#define LOOPMONITOR_PHASE_SIZE 16
+
+class LoopMonitor {
+    public:
+        struct stall_t {
+            uint32_t durationUs = 0;
+            uint32_t uptimeS = 0;               // when it happened
+            char phase[LOOPMONITOR_PHASE_SIZE] = "";  // slowest phase of the iteration, "starved" if other tasks blocked the loop
+        };
+
+        struct task_t {
+            char name[configMAX_TASK_NAME_LEN];
+            uint32_t stackFree;                 // lowest free stack in bytes since the task started
+            uint8_t priority;
+            int8_t core;                        // -1 if not pinned
+            int8_t cpuPercent;                  // of the last sample interval, -1 without runtime stats
+        };
+
+        // Consistent copy of all values for the API
+        struct report_t {
+            uint32_t buckets[LOOPMONITOR_BUCKETS];
+            uint32_t iterations;
+            uint64_t sumUs;
+            uint32_t maxUs;
+            uint32_t starved;                   // times other tasks kept the loop from running
+            stall_t stalls[LOOPMONITOR_STALLS]; // slowest first
+            task_t tasks[LOOPMONITOR_MAX_TASKS];
+            uint8_t taskCount;
+            esp_reset_reason_t resetReason;
+            char resetPhase[LOOPMONITOR_PHASE_SIZE]; // loop phase running at a watchdog reset or panic
+        };
+
+        static const uint32_t bucketLimitsMs[LOOPMONITOR_BUCKETS - 1];
+
+        // Check the reset reason and the phase that was running before it, call it early in setup()
+        void begin();
+
+        // Mark the start and the end of a loop() iteration, idleMs is the intended delay until the next one
+        void beginIteration();
+        void endIteration(uint32_t idleMs);
+
+        // Name the part of loop() that runs from now on, must be a string literal
+        void phase(const char *name);
+
+        // Sample stack high water marks and runtime statistics of all tasks, call it from loop()
+        void sampleTasks();
+
+        void getReport(report_t &report);
+
+        // Loop phase that was running at a watchdog reset or panic, empty otherwise
+        const char * getResetPhase() { return data.resetPhase; }
+
+        // Short JSON summary for MQTT, returns the length
+        size_t formatSummary(char *buffer, size_t size);
+
+    private:
+        portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        report_t data;
+
+        uint64_t iterationStart = 0;
+        uint64_t iterationEnd = 0;
+        uint32_t idleMs = 0;
+        const char *currentPhase = "";
+        uint64_t phaseStart = 0;
+        const char *slowestPhase = "";
+        uint32_t slowestPhaseUs = 0;
+
+        uint64_t lastSample = 0;
+        #if configGENERATE_RUN_TIME_STATS
+        TaskHandle_t previousHandles[LOOPMONITOR_MAX_TASKS];
+        uint32_t previousRuntime[LOOPMONITOR_MAX_TASKS];
+        uint8_t previousCount = 0;
+        uint32_t previousTotal = 0;
+        #endif
+
+        void recordStall(uint32_t durationUs, const char *phase);
+};
+
+#endif // LOOPMONITOR_h
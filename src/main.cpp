@@ -48,9 +48,12 @@
 #include <esp32/clk.h>
 
 #include "global.h"
+#include "statusevents.h"
 #include "api-routes.h"
 #include "ble.h"
+#include "bletransfer.h"
 #include "dac.h"
+#include "alloccounter.h"
 
 #include <Adafruit_Sensor.h>
 #include <Adafruit_BMP085_U.h>
@@ -66,7 +69,7 @@ Ticker statusLedTimer;
 void initWifiAndServices() {
 
   // Load well known Wifi AP credentials from NVS  
-  LOG_INFO_F("SoftAP Password '%s'\n", preferences.getString("softAPPassword", ""));
+  LOG_INFO_F("SoftAP Password '%s'\n", preferences.getString("softAPPassword", "").c_str());
   WifiManager.fallbackToSoftAp(preferences.getBool("enableSoftAp", true), hostname, preferences.getString("softAPPassword", ""));
   WifiManager.startBackgroundTask();
   WifiManager.attachWebServer(&webServer);
@@ -83,7 +86,10 @@ void initWifiAndServices() {
     MDNS.begin(hostname.c_str());
     MDNS.addService("http", "tcp", 80);
     MDNS.addService("ota", "udp", 3232);
-    LOG_INFO_F("[MDNS] You should be able now to open http://%s.local/ in your browser.\n", hostname);
+    LOG_INFO_F("[MDNS] You should be able now to open http://%s.local/ in your browser.\n", hostname.c_str());
+
+    // Timestamps for buffered readings, does not block
+    configTime(0, 0, "pool.ntp.org");
   }
 
   if (enableMqtt) {
@@ -94,6 +100,7 @@ void initWifiAndServices() {
       preferences.getString("mqttUser", ""),
       preferences.getString("mqttPass", "")
     );
+    Mqtt.startBackgroundTask();
   }
   else LOG_INFO_LN(F("[MQTT] Publish to MQTT is disabled."));
 }
@@ -104,7 +111,10 @@ void setup() {
 
   Serial.begin(115200);
   Serial.setDebugOutput(true);
+  logRing.begin();
   print_wakeup_reason();
+  beginStatusEvents();
+  loopMonitor.begin();
 
   if (!isDeepSleepWakeup)
   {
@@ -133,13 +143,15 @@ void setup() {
   #endif
     
   if (!LittleFS.begin(true)) {
-    LOG_INFO_LN(F("[FS] An Error has occurred while mounting LittleFS"));
+    LOG_ERROR_LN(F("[FS] An Error has occurred while mounting LittleFS"));
     // Reduce power consumption while having issues with NVS
     // This won't fix the problem, a check of the sensor log is required
     deepsleepForSeconds(5);
   }
   if (!preferences.begin(NVS_NAMESPACE)) preferences.clear();
   LOG_INFO_LN(F("[LITTLEFS] initialized"));
+  // Also on a burst wakeup, so its MQTT events reach the file before the next deep sleep
+  journal.begin(esp_reset_reason(), loopMonitor.getResetPhase());
 
   float currentPressure = 0.f;
   sensors_event_t event;
@@ -161,10 +173,19 @@ void setup() {
   }
 
   enableBle = preferences.getBool("enableBle", enableBle);
+  bleBroadcast = preferences.getBool("bleBroadcast", bleBroadcast);
+  bleAdvInterval = max((uint16_t)BLE_BROADCAST_MIN_INTERVAL, preferences.getUShort("bleAdvInterval", bleAdvInterval));
   #if HAS_DAC_INSTALLED
   enableDac = preferences.getBool("enableDac", enableDac);
   #endif
+  dacLoadConfig(preferences);
   enableMqtt = preferences.getBool("enableMqtt", enableMqtt);
+  burstMode = enableMqtt && preferences.getBool("burstMode", false);
+  burstEvery = max((uint8_t)1, preferences.getUChar("burstEvery", burstEvery));
+
+  // Each millisecond of a burst wakeup costs battery, the rest is only started if it stays awake
+  bool isBurstWakeup = burstMode && isWakeUpByTimer;
+  if (!isBurstWakeup) beginRegularServices();
   
   if (!isWakeUpByTimer)
   { 
@@ -177,6 +198,8 @@ void setup() {
     if (!isDeepSleepWakeup)
     {
       shutDownWifiMin = preferences.getUShort("shutDownWifiMin", 0);
+      // In battery mode the WiFi is only kept on for a while to reach the web UI
+      if (burstMode && shutDownWifiMin == 0) shutDownWifiMin = BURST_WIFI_ON_MINUTES;
       if (enableWifi && shutDownWifiMin > 0)
       {
         LOG_INFO_F("[WIFI] Wifi will be turned off in %d minutes\n", shutDownWifiMin);
@@ -201,9 +224,6 @@ void setup() {
   if (enableWifi) initWifiAndServices();
     else LOG_INFO_LN(F("[WIFI] Not starting WiFi!"));
 
-  if (enableBle) createBleServer(hostname);
-  else LOG_INFO_LN(F("[BLE] Bluetooth low energy is disabled."));
-  
   if (enableWifi)
   {
     String otaPassword = preferences.getString("otaPassword");
@@ -211,7 +231,7 @@ void setup() {
       otaPassword = String((uint32_t)ESP.getEfuseMac());
       preferences.putString("otaPassword", otaPassword);
     }
-    LOG_INFO_F("[OTA] Password set to '%s'\n", otaPassword);
+    LOG_INFO_F("[OTA] Password set to '%s'\n", otaPassword.c_str());
 
     ArduinoOTA
       .setHostname(hostname.c_str())
@@ -229,6 +249,10 @@ void setup() {
       .onEnd([]() {
         otaRunning = false;
         LOG_INFO_LN("\nEnd");
+        if (ArduinoOTA.getCommand() == U_FLASH) {
+          journal.add(JOURNAL_UPDATE, 0, 1, "ArduinoOTA");
+          journal.flush();
+        }
       })
       .onProgress([](unsigned int progress, unsigned int total) {
         //LOG_INFO_F("Progress: %u%%\r", (progress / (total / 100)));
@@ -251,16 +275,120 @@ void setup() {
     LevelManagers[i]->setAirPressureThreshold(preferences.getUInt("pressureThresh", 10));
     LevelManagers[i]->setAirPressure(currentPressure, false);
     if (!isDeepSleepWakeup && preferences.getBool("airPumpOnBoot", true)) {
-      LevelManagers[i]->activateAirPump();
+      LevelManagers[i]->activateAirPump("Boot");
     }
     LevelManagers[i]->begin((String(NVS_NAMESPACE) + String("s") + String(i)).c_str());
+    ReadingBuffers[i]->begin();
+  }
+
+  if (isBurstWakeup) {
+    runBurstCycle();
+    beginRegularServices();
   }
 
   preferences.end();
+
+  // setup() and loop() run in the same task, from now on its allocations are counted
+  allocCounterTrackCurrentTask();
   
 }
 
+void beginRegularServices() {
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) Histories[i]->begin();
+
+  bleTransfer.begin(LevelManagers, Histories, LEVELMANAGERS);
+  if (enableBle) createBleServer(hostname);
+  else LOG_INFO_LN(F("[BLE] Bluetooth low energy is disabled."));
+}
+
+// Battery mode: take a reading, publish it together with the buffered ones and go back to deep sleep.
+// Returns only if the regular operation has to continue (e.g. the air pump has to run).
+void runBurstCycle() {
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    if (!LevelManagers[i]->canSleep()) return;
+  }
+  burstState.wakeups++;
+
+  bool bufferReadings = runtime() - Timing.lastBufferedReading > Timing.bufferInterval;
+  if (bufferReadings) Timing.lastBufferedReading = runtime();
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    LevelManagers[i]->loop();
+    if (!LevelManagers[i]->canSleep()) return;
+    if (bufferReadings && LevelManagers[i]->isConfigured()) {
+      ReadingBuffers[i]->push(LevelManagers[i]->getLevel(), LevelManagers[i]->getLastMedian(), LevelManagers[i]->getAirPressure(), LevelManagers[i]->getSensorError());
+    }
+  }
+  if (burstState.wakeups % burstEvery != 0) return enterDeepSleep();
+
+  enableWifi = true;
+  if (fastWifiJoin()) {
+    Mqtt.prepare(
+      preferences.getString("mqttHost", "localhost"),
+      preferences.getUInt("mqttPort", 1883),
+      preferences.getString("mqttTopic", "verges/waterlevel"),
+      preferences.getString("mqttUser", ""),
+      preferences.getString("mqttPass", "")
+    );
+    uint32_t start = millis();
+    while (!Mqtt.isReady() && millis() - start < BURST_MQTT_TIMEOUT_MS) {
+      Mqtt.loop();
+      delay(1);
+    }
+  }
+
+  if (Mqtt.isReady()) {
+    char topic[MQTT_TOPIC_SIZE];
+    for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+      if (LevelManagers[i]->isConfigured()) {
+        Mqtt.publishInt("tanklevel", i+1, LevelManagers[i]->getLevel());
+        Mqtt.publishInt("tankvolume", i+1, LevelManagers[i]->getCurrentVolume());
+      }
+      snprintf(topic, sizeof(topic), "%s/buffer%u", Mqtt.mqttTopic.c_str(), i+1);
+      while (ReadingBuffers[i]->count() && ReadingBuffers[i]->drain([&](const char *payload) { return Mqtt.publish(topic, payload, false); })) {}
+    }
+    // Time since boot of this cycle, only turning off the WiFi follows
+    Mqtt.publishInt("awakeMs", 0, millis());
+    Mqtt.disconnect();
+    burstState.cycles++;
+  } else burstState.failedJoins++;
+
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+  burstState.lastAwakeMs = millis();
+  LOG_INFO_F("[POWER] Burst cycle done after %u ms\n", burstState.lastAwakeMs);
+  enterDeepSleep();
+}
+
+// Record pump runs, setup transitions and sensor faults in the journal
+void journalTankEvents() {
+  static uint32_t pumpRuns[LEVELMANAGERS] = {0};
+  static bool setupRunning[LEVELMANAGERS] = {false};
+  static bool sensorError[LEVELMANAGERS] = {false};
+
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    TANKLEVEL * tank = LevelManagers[i];
+    // The pump runs with every reading of a setup, only the transitions are of interest there
+    if (tank->getAirPumpRuns() != pumpRuns[i] && !tank->isSetupRunning()) {
+      journal.add(JOURNAL_PUMP, i+1, tank->getAirPumpRuns(), tank->getAirPumpReason());
+    }
+    pumpRuns[i] = tank->getAirPumpRuns();
+
+    if (tank->isSetupRunning() != setupRunning[i]) {
+      setupRunning[i] = tank->isSetupRunning();
+      journal.add(JOURNAL_SETUP, i+1, setupRunning[i] ? 1 : (tank->isConfigured() ? 2 : 0));
+    }
+
+    bool error = tank->getSnapshot().error;
+    if (error != sensorError[i]) {
+      sensorError[i] = error;
+      journal.add(JOURNAL_SENSOR, i+1, error ? 1 : 0);
+    }
+  }
+}
+
 void loop() {
+  loopMonitor.beginIteration();
+  loopMonitor.phase("ota");
   ArduinoOTA.handle();
   #if HAS_BUTTON_INSTALLED
   if (button1.pressed) {
@@ -277,19 +405,64 @@ void loop() {
 
   // Do not continue regular operation as long as a OTA is running
   // Reason: Background workload can cause upgrade issues that we want to avoid!
-  if (otaRunning) return sleepOrDelay();
+  if (otaRunning) {
+    // A running air pump would keep going unattended until the reboot
+    for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+      if (LevelManagers[i]->isAirPumpRunning()) LevelManagers[i]->deactivateAirPump();
+    }
+    sendOtaEvents();
+    return sleepOrDelay();
+  }
   
-  if (runtime() - Timing.lastServiceCheck > Timing.serviceInterval) {
-    Timing.lastServiceCheck = runtime();
-    // Check if all the services work
-    if (enableWifi && WiFi.status() == WL_CONNECTED && WiFi.getMode() & WIFI_MODE_STA) {
-      if (enableMqtt && !Mqtt.isConnected()) Mqtt.connect();
+  loopMonitor.phase("sensor");
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) LevelManagers[i]->loop();
+  sendPumpEvents();
+
+  // Add every new measurement to the history
+  loopMonitor.phase("history");
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    TANKLEVEL::snapshot_t snapshot = LevelManagers[i]->getSnapshot();
+    if (snapshot.sample == historySample[i]) continue;
+    historySample[i] = snapshot.sample;
+    // Without a synced clock the samples could not be sorted into the history
+    time_t now = time(nullptr);
+    if (!snapshot.error && now > 1600000000) Histories[i]->add(now, snapshot.level, snapshot.sensorPressure);
+  }
+
+  // Forward readings stored while the broker was unreachable
+  loopMonitor.phase("buffer");
+  if (enableMqtt && Mqtt.isReady() && runtime() - Timing.lastDrainFailure > Timing.drainRetryInterval) {
+    for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+      if (!ReadingBuffers[i]->count()) continue;
+      char topic[MQTT_TOPIC_SIZE];
+      snprintf(topic, sizeof(topic), "%s/buffer%u", Mqtt.mqttTopic.c_str(), i+1);
+      // A busy connection is not retried every loop, each attempt reads the segment on LittleFS
+      if (!ReadingBuffers[i]->drain([&](const char *payload) { return Mqtt.publish(topic, payload, false); })) {
+        Timing.lastDrainFailure = runtime();
+        break;
+      }
     }
   }
 
-  for (uint8_t i=0; i < LEVELMANAGERS; i++) LevelManagers[i]->loop();
+  loopMonitor.phase("ble");
+  if (enableBle) bleLoop();
+
+  loopMonitor.phase("monitor");
+  loopMonitor.sampleTasks();
+  heapSampler.loop();
+  journalTankEvents();
+  journal.loop();
+  if (enableMqtt && Mqtt.isReady() && runtime() - Timing.lastDiagPublish > Timing.diagInterval) {
+    Timing.lastDiagPublish = runtime();
+    char topic[MQTT_TOPIC_SIZE];
+    char payload[256];
+    snprintf(topic, sizeof(topic), "%s/diag", Mqtt.mqttTopic.c_str());
+    loopMonitor.formatSummary(payload, sizeof(payload));
+    Mqtt.publish(topic, payload, false);
+  }
 
   // run regular operation
+  loopMonitor.phase("status");
   if (runtime() - Timing.lastStatusUpdate > Timing.statusUpdateInterval) {
     Timing.lastStatusUpdate = runtime();
 
@@ -305,73 +478,87 @@ void loop() {
     }
     #endif
 
-    String jsonOutput;
-    StaticJsonDocument<1024> jsonDoc;
+    if (burstMode) cacheWifiConnection();
+
+    // Everything below runs every few seconds for weeks, keep it free of heap allocations
+    uint32_t allocsBefore = allocCounterGet();
 
     sensors_event_t event;
     float temperature = 0.f;
     if (bmp180_found) {
+      METRICS_SCOPE(metricsBmp180Read);
       bmp180.getEvent(&event);
       bmp180.getTemperature(&temperature);
     } else {
       event.pressure = 0;
     }
+    bool bufferReadings = enableMqtt && !Mqtt.isReady() && runtime() - Timing.lastBufferedReading > Timing.bufferInterval;
+    if (bufferReadings) Timing.lastBufferedReading = runtime();
+
     for (uint8_t i=0; i < LEVELMANAGERS; i++) {
       // Update air pressure value on all levelmanagers
       // 101.325 Pa = 101,325 kPa = 1013,25 hPa ≈ 1 bar.
       LevelManagers[i]->setAirPressure(roundf(event.pressure));
 
+      tankStatus[i].sensorPressure = LevelManagers[i]->getLastMedian();
+      tankStatus[i].airPressure = event.pressure;
+      tankStatus[i].temperature = temperature;
+      tankStatus[i].error = LevelManagers[i]->getSensorError();
+      tankStatus[i].configured = LevelManagers[i]->isConfigured();
+
       if (LevelManagers[i]->isConfigured()) {
-        String ident = String("level") + String(i);
-        if (enableDac) dacValue(i+1, LevelManagers[i]->getLevel());
-        if (enableBle) updateBleCharacteristic(i+1, LevelManagers[i]->getLevel());
+        if (enableDac) dacLevel(i+1, LevelManagers[i]->getLevelFraction());
         if (enableMqtt && Mqtt.isReady()) {
-          Mqtt.client.publish((Mqtt.mqttTopic + "/tanklevel" + String(i+1)).c_str(), String(LevelManagers[i]->getLevel()).c_str(), true);
-          Mqtt.client.publish((Mqtt.mqttTopic + "/tankvolume" + String(i+1)).c_str(), String(LevelManagers[i]->getCurrentVolume()).c_str(), true);
-          Mqtt.client.publish((Mqtt.mqttTopic + "/sensorPressure" + String(i+1)).c_str(), String(LevelManagers[i]->getLastMedian()).c_str(), true);
-          Mqtt.client.publish((Mqtt.mqttTopic + "/airPressure" + String(i+1)).c_str(), String(event.pressure).c_str(), true);
-          Mqtt.client.publish((Mqtt.mqttTopic + "/temperature" + String(i+1)).c_str(), String(temperature).c_str(), true);
+          Mqtt.publishInt("tanklevel", i+1, LevelManagers[i]->getLevel());
+          Mqtt.publishInt("tankvolume", i+1, LevelManagers[i]->getCurrentVolume());
+          Mqtt.publishInt("sensorPressure", i+1, LevelManagers[i]->getLastMedian());
+          Mqtt.publishFloat("airPressure", i+1, event.pressure);
+          Mqtt.publishFloat("temperature", i+1, temperature);
+        } else if (bufferReadings) {
+          ReadingBuffers[i]->push(LevelManagers[i]->getLevel(), LevelManagers[i]->getLastMedian(), roundf(event.pressure), LevelManagers[i]->getSensorError());
         }
 
-        jsonDoc[i]["id"] = i;
-        jsonDoc[i]["level"] = LevelManagers[i]->getLevel();
-        jsonDoc[i]["volume"] = LevelManagers[i]->getCurrentVolume();
-        jsonDoc[i]["sensorPressure"] = LevelManagers[i]->getLastMedian();
-        jsonDoc[i]["airPressure"] = event.pressure;
-        jsonDoc[i]["temperature"] = temperature;
-        jsonDoc[i]["error"] = LevelManagers[i]->getSensorError();
-        jsonDoc[i]["configured"] = true;
-
-        LOG_INFO_F("[SENSOR] Current level of %d. sensor is %d%% (raw %d, calculated %d)\n",
-          i+1, LevelManagers[i]->getLevel(), (int)LevelManagers[i]->lastRawReading, LevelManagers[i]->getLastMedian()
-        );
+        tankStatus[i].level = LevelManagers[i]->getLevel();
+        tankStatus[i].volume = LevelManagers[i]->getCurrentVolume();
+
+        if (LevelManagers[i]->getLevel() != lastLoggedLevel[i]) {
+          lastLoggedLevel[i] = LevelManagers[i]->getLevel();
+          LOG_INFO_F("[SENSOR] Level of %d. sensor is %d%% (raw %d, calc %d)\n",
+            i+1, LevelManagers[i]->getLevel(), (int)LevelManagers[i]->lastRawReading, LevelManagers[i]->getLastMedian()
+          );
+        }
       } else {
-        if (enableDac) dacValue(i+1, 0);
-        if (enableBle) updateBleCharacteristic(i+1, 0);
-
-        jsonDoc[i]["id"] = i;
-        jsonDoc[i]["level"] = 0;
-        jsonDoc[i]["volume"] = 0;
-        jsonDoc[i]["sensorPressure"] = LevelManagers[i]->getLastMedian();
-        jsonDoc[i]["airPressure"] = event.pressure;
-        jsonDoc[i]["temperature"] = temperature;
-        jsonDoc[i]["error"] = LevelManagers[i]->getSensorError();
-        jsonDoc[i]["configured"] = false;
+        if (enableDac) dacLevel(i+1, 0.0);
+
+        tankStatus[i].level = 0;
+        tankStatus[i].volume = 0;
 
         // LOG_INFO_F("[SENSOR] Sensor %d not configured, please run the setup! (raw %d, calculated %d)\n",
         //   i+1, (int)LevelManagers[i]->lastRawReading, LevelManagers[i]->getLastMedian()
         // );
       }
+
+      if (enableBle) {
+        updateBleTank(i+1, tankStatus[i].level, tankStatus[i].volume,
+          (tankStatus[i].configured ? BLE_FLAG_CONFIGURED : 0) |
+          (tankStatus[i].error ? BLE_FLAG_SENSOR_ERROR : 0) |
+          (LevelManagers[i]->isSetupRunning() ? BLE_FLAG_SETUP : 0) |
+          (LevelManagers[i]->isAirPumpRunning() ? BLE_FLAG_AIR_PUMP : 0)
+        );
+      }
     }
 
-    serializeJsonPretty(jsonDoc, jsonOutput);
-    events.send(jsonOutput.c_str(), "status", millis());
-    //LOG_INFO_LN(jsonOutput);
+    sendStatusEvents();
+    statusCycleAllocs = allocCounterGet() - allocsBefore;
+  } else if (statusFullRequested) {
+    // Don't let a freshly connected web UI wait for the next status cycle
+    sendStatusEvents();
   }
   sleepOrDelay();
 }
 
 void sleepOrDelay() {
+  loopMonitor.endIteration(50);
   for (uint8_t i=0; i < LEVELMANAGERS; i++) {
     if (!LevelManagers[i]->canSleep()) {
       yield();
@@ -379,42 +566,51 @@ void sleepOrDelay() {
       return;
     }
   }
-  if (enableWifi || enableMqtt || (enableBle && (shouldBleStayOn() || !enableBleSleep))) {
+  if (enableWifi || (enableMqtt && !burstMode) || (enableBle && (shouldBleStayOn() || !enableBleSleep))) {
     yield();
     delay(50);
   } else {
     // We can save a lot of power by going into deepsleep
     // This disables WIFI and everything.
-    esp_sleep_enable_timer_wakeup(TIME_TO_SLEEP * uS_TO_S_FACTOR);
-    sleepTime = rtc_time_slowclk_to_us(rtc_time_get(), esp_clk_slowclk_cal_get());
-    #if HAS_BUTTON_INSTALLED
-    rtc_gpio_pullup_en(button1.PIN);
-    rtc_gpio_pulldown_dis(button1.PIN);
-    esp_sleep_enable_ext0_wakeup(button1.PIN, 0);
-    #endif
+    enterDeepSleep();
+  }
+}
 
-    LOG_INFO_LN(F("[POWER] Deep Sleeping..."));
-    if (enableBle)
-    {
-      stopBleServer();
-    }
-    for (uint8_t i=0; i < LEVELMANAGERS; i++) {
-      LevelManagers[i]->powerDownSensor();
-    }
-    preferences.end();
-    esp_deep_sleep_start();
-    /*
-    At least for sporadic BLE advertisement the power consumption with light sleep is not that much higher than deep sleep
-    So if we ever decided keeping our RAM and so on might be of advantage, it would be an easy switch
-
-    esp_light_sleep_start();
-    if (enableBle)
-    {
-      createBleServer(hostname);
-    }
-    for (uint8_t i=0; i < LEVELMANAGERS; i++) {
-      LevelManagers[i]->powerUpSensor();
-    }
-    */    
+void enterDeepSleep() {
+  esp_sleep_enable_timer_wakeup(TIME_TO_SLEEP * uS_TO_S_FACTOR);
+  sleepTime = rtc_time_slowclk_to_us(rtc_time_get(), esp_clk_slowclk_cal_get());
+  #if HAS_BUTTON_INSTALLED
+  rtc_gpio_pullup_en(button1.PIN);
+  rtc_gpio_pulldown_dis(button1.PIN);
+  esp_sleep_enable_ext0_wakeup(button1.PIN, 0);
+  #endif
+
+  LOG_INFO_LN(F("[POWER] Deep Sleeping..."));
+  if (enableBle)
+  {
+    stopBleServer();
+  }
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    LevelManagers[i]->powerDownSensor();
+  }
+  dacStop();
+  preferences.end();
+  // The rollups in progress stay in RTC memory
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) Histories[i]->flush(false);
+  journal.flush();
+  logRing.flush();
+  esp_deep_sleep_start();
+  /*
+  At least for sporadic BLE advertisement the power consumption with light sleep is not that much higher than deep sleep
+  So if we ever decided keeping our RAM and so on might be of advantage, it would be an easy switch
+
+  esp_light_sleep_start();
+  if (enableBle)
+  {
+    createBleServer(hostname);
+  }
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    LevelManagers[i]->powerUpSensor();
   }
+  */
 }
@@ -0,0 +1,49 @@
+/**
+ * @file mempool.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Fixed block pools for short-lived buffers and a heap fragmentation sampler
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "mempool.h"
+
+BlockPool<LOGPOOL_BLOCK_SIZE, LOGPOOL_BLOCKS> logPool;
+BlockPool<WEBPOOL_BLOCK_SIZE, WEBPOOL_BLOCKS> webPool;
+BlockPool<JSONPOOL_BLOCK_SIZE, JSONPOOL_BLOCKS> jsonPool;
+
+void HeapSampler::loop() {
+  uint64_t now = millis();
+  if (lastSample && now - lastSample < HEAPSAMPLER_INTERVAL_MS) return;
+  lastSample = now;
+
+  sample_t sample = { (uint32_t)(now / 1000), ESP.getFreeHeap(), ESP.getMaxAllocHeap() };
+  portENTER_CRITICAL(&mux);
+  if (count == HEAPSAMPLER_SAMPLES) {
+    head = (head + 1) % HEAPSAMPLER_SAMPLES;
+    count--;
+  }
+  samples[(head + count) % HEAPSAMPLER_SAMPLES] = sample;
+  count++;
+  if (sample.largestBlock < minLargestBlock) minLargestBlock = sample.largestBlock;
+  portEXIT_CRITICAL(&mux);
+}
+
+uint8_t HeapSampler::fragmentation(uint32_t freeHeap, uint32_t largestBlock) {
+  if (freeHeap == 0 || largestBlock >= freeHeap) return 0;
+  return 100 - (uint64_t)largestBlock * 100 / freeHeap;
+}
+
+uint8_t HeapSampler::getSamples(sample_t * out, uint8_t max) {
+  portENTER_CRITICAL(&mux);
+  uint8_t num = count < max ? count : max;
+  // the newest samples if there are more than requested
+  for (uint8_t i = 0; i < num; i++) out[i] = samples[(head + count - num + i) % HEAPSAMPLER_SAMPLES];
+  portEXIT_CRITICAL(&mux);
+  return num;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file mempool.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Fixed block pools for short-lived buffers and a heap fragmentation sampler
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef MEMPOOL_h
+#define MEMPOOL_h
+
+#include <Arduino.h>
+#include <memory>
+#include <new>
+
+#define LOGPOOL_BLOCK_SIZE 256                  // formatted log lines longer than the stack buffer
+#define LOGPOOL_BLOCKS 4
+#define WEBPOOL_BLOCK_SIZE 2560                 // per request state of streamed API responses
+#define WEBPOOL_BLOCKS 3
+#define JSONPOOL_BLOCK_SIZE 10240               // /api/esp serialized once, with all heap samples and tasks
+#define JSONPOOL_BLOCKS 1
+#define HEAPSAMPLER_INTERVAL_MS 1800000         // sample the heap every 30 minutes
+#define HEAPSAMPLER_SAMPLES 48                  // keep one day of samples
+
+// Statistics of a pool, exposed through the API
+struct poolstats_t {
+    uint16_t blockSize;
+    uint8_t blocks;
+    uint8_t inUse;
+    uint8_t peak;                               // most blocks in use at the same time
+    uint32_t acquired;
+    uint32_t exhausted;                         // requests that found no free block
+};
+
+// Blocks allocated once at boot and reused, so short-lived buffers never fragment the heap.
+// acquire() returns nullptr if all blocks are in use, callers fall back to the heap or a smaller buffer.
+template<size_t BLOCK_SIZE, uint8_t BLOCKS>
+class BlockPool {
+    static_assert(BLOCKS <= 32, "the free map holds 32 blocks");
+
+    public:
+        static const size_t blockSize = BLOCK_SIZE;
+
+        void * acquire() {
+            void * block = nullptr;
+            portENTER_CRITICAL(&mux);
+            for (uint8_t i = 0; i < BLOCKS; i++) {
+                if (used & (1UL << i)) continue;
+                used |= 1UL << i;
+                block = storage[i];
+                stats.acquired++;
+                if (++stats.inUse > stats.peak) stats.peak = stats.inUse;
+                break;
+            }
+            if (!block) stats.exhausted++;
+            portEXIT_CRITICAL(&mux);
+            return block;
+        }
+
+        void release(void * block) {
+            if (!owns(block)) return;
+            uint8_t i = ((uint8_t *)block - storage[0]) / BLOCK_SIZE;
+            portENTER_CRITICAL(&mux);
+            used &= ~(1UL << i);
+            stats.inUse--;
+            portEXIT_CRITICAL(&mux);
+        }
+
+        bool owns(const void * block) {
+            return block >= storage[0] && block < storage[BLOCKS];
+        }
+
+        poolstats_t getStats() {
+            portENTER_CRITICAL(&mux);
+            poolstats_t copy = stats;
+            portEXIT_CRITICAL(&mux);
+            return copy;
+        }
+
+    private:
+        alignas(8) uint8_t storage[BLOCKS][BLOCK_SIZE];
+        uint32_t used = 0;
+        portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        poolstats_t stats = { BLOCK_SIZE, BLOCKS, 0, 0, 0, 0 };
+};
+
+// Construct a T in a block of the pool, on the heap if the pool is exhausted
+template<typename T, typename Pool>
+std::shared_ptr<T> makePooled(Pool &pool) {
+    static_assert(sizeof(T) <= Pool::blockSize, "type does not fit into a block of the pool");
+    void * block = pool.acquire();
+    if (!block) return std::make_shared<T>();
+    return std::shared_ptr<T>(new (block) T(), [&pool](T * p) {
+        p->~T();
+        pool.release(p);
+    });
+}
+
+extern BlockPool<LOGPOOL_BLOCK_SIZE, LOGPOOL_BLOCKS> logPool;
+extern BlockPool<WEBPOOL_BLOCK_SIZE, WEBPOOL_BLOCKS> webPool;
+extern BlockPool<JSONPOOL_BLOCK_SIZE, JSONPOOL_BLOCKS> jsonPool;
+
+// Free heap and the largest free block over time, fragmentation shows as a growing gap between them
+class HeapSampler {
+    public:
+        struct sample_t {
+            uint32_t uptimeS;
+            uint32_t freeHeap;
+            uint32_t largestBlock;
+        };
+
+        // Take a sample if the interval passed, call it from loop()
+        void loop();
+
+        // 0 for a single free block, close to 100 if the free heap is split into small pieces
+        static uint8_t fragmentation(uint32_t freeHeap, uint32_t largestBlock);
+
+        // Copy up to max samples, oldest first, returns the number of samples
+        uint8_t getSamples(sample_t * out, uint8_t max);
+
+        // Smallest largest block seen since boot
+        uint32_t getMinLargestBlock() { return minLargestBlock; }
+
+    private:
+        portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+        sample_t samples[HEAPSAMPLER_SAMPLES];
+        uint8_t head = 0;
+        uint8_t count = 0;
+        uint64_t lastSample = 0;
+        uint32_t minLargestBlock = UINT32_MAX;
+};
+
+#endif // MEMPOOL_h
@@ -0,0 +1,98 @@
+/**
+ * @file metrics.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Cycle count histograms of hot paths in the Prometheus text format
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "metrics.h"
+
+static portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const struct {
+  const char *name;
+  const char *help;
+} families[METRICS_FAMILIES] = {
+  { "waterlevel_hotpath_cycles", "CPU cycles spent in a hot path" },
+  { "waterlevel_http_handler_cycles", "CPU cycles spent in a web handler, without sending the response" },
+};
+
+MetricsHistogram *MetricsHistogram::first = nullptr;
+
+MetricsHistogram metricsSensorRead(METRICS_HOTPATH, "path=\"sensor_read\"");
+MetricsHistogram metricsCalculateLevel(METRICS_HOTPATH, "path=\"calculate_level\"");
+MetricsHistogram metricsNvsWrite(METRICS_HOTPATH, "path=\"nvs_write\"");
+MetricsHistogram metricsBmp180Read(METRICS_HOTPATH, "path=\"bmp180_read\"");
+MetricsHistogram metricsMqttPublish(METRICS_HOTPATH, "path=\"mqtt_publish\"");
+
+MetricsHistogram::MetricsHistogram(metrics_family_t family, const char *labels) : family(family), labels(labels) {
+  portENTER_CRITICAL(&metricsMux);
+  next = first;
+  first = this;
+  portEXIT_CRITICAL(&metricsMux);
+}
+
+void MetricsHistogram::record(uint32_t cycles) {
+  // Buckets grow by a factor of 4, starting with 1024 cycles
+  uint8_t bits = cycles > 1 ? 32 - __builtin_clz(cycles - 1) : 0;
+  uint8_t bucket = bits <= 10 ? 0 : (bits - 9) / 2;
+  if (bucket >= METRICS_BUCKETS) bucket = METRICS_BUCKETS - 1;
+
+  portENTER_CRITICAL(&metricsMux);
+  buckets[bucket]++;
+  count++;
+  sum += cycles;
+  portEXIT_CRITICAL(&metricsMux);
+}
+
+void MetricsHistogram::writeAll(Print &out) {
+  for (uint8_t f = 0; f < METRICS_FAMILIES; f++) {
+    bool header = false;
+    for (MetricsHistogram *h = first; h; h = h->next) {
+      if (h->family != f) continue;
+      if (!header) {
+        metricsWriteHeader(out, families[f].name, "histogram", families[f].help);
+        header = true;
+      }
+
+      // Copy it, so the buckets, sum and count of a histogram are consistent
+      uint32_t buckets[METRICS_BUCKETS];
+      portENTER_CRITICAL(&metricsMux);
+      memcpy(buckets, h->buckets, sizeof(buckets));
+      uint32_t count = h->count;
+      uint64_t sum = h->sum;
+      portEXIT_CRITICAL(&metricsMux);
+
+      uint32_t cumulative = 0;
+      for (uint8_t b = 0; b < METRICS_BUCKETS; b++) {
+        cumulative += buckets[b];
+        out.printf("%s_bucket{%s,le=\"", families[f].name, h->labels);
+        if (b == METRICS_BUCKETS - 1) out.print("+Inf");
+        else out.printf("%lu", 1UL << (10 + 2 * b));
+        out.printf("\"} %u\n", cumulative);
+      }
+      out.printf("%s_sum{%s} %" PRIu64 "\n", families[f].name, h->labels, sum);
+      out.printf("%s_count{%s} %u\n", families[f].name, h->labels, count);
+    }
+  }
+}
+
+void metricsWriteHeader(Print &out, const char *name, const char *type, const char *help) {
+  out.printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metricsWrite(Print &out, const char *name, const char *type, const char *help, uint64_t value) {
+  metricsWriteHeader(out, name, type, help);
+  out.printf("%s %" PRIu64 "\n", name, value);
+}
+
+void metricsWrite(Print &out, const char *name, const char *type, const char *help, float value) {
+  metricsWriteHeader(out, name, type, help);
+  out.printf("%s %.3f\n", name, value);
+}
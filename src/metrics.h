@@ -0,0 +1,87 @@
+/**
+ * @file metrics.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Cycle count histograms of hot paths in the Prometheus text format
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef METRICS_h
+#define METRICS_h
+
+#include <Arduino.h>
+
+#define METRICS_BUCKETS 12                      // upper bounds of 2^10, 2^12 ... 2^30 cycles and +Inf
+
+enum metrics_family_t : uint8_t {
+    METRICS_HOTPATH = 0,                        // waterlevel_hotpath_cycles{path="..."}
+    METRICS_HTTP,                               // waterlevel_http_handler_cycles{handler="...",method="..."}
+    METRICS_FAMILIES
+};
+
+// A histogram of CPU cycles, all histograms register themselves for the output
+class MetricsHistogram {
+    public:
+        // labels are written as is, e.g. path="sensor_read"
+        MetricsHistogram(metrics_family_t family, const char *labels);
+
+        void record(uint32_t cycles);
+
+        // Write all registered histograms
+        static void writeAll(Print &out);
+
+    private:
+        metrics_family_t family;
+        const char *labels;
+        uint32_t buckets[METRICS_BUCKETS] = {0};
+        uint32_t count = 0;
+        uint64_t sum = 0;
+
+        MetricsHistogram *next;
+        static MetricsHistogram *first;
+};
+
+// Records the cycles until the end of the scope, measurements that moved to the other core are dropped
+class MetricsScope {
+    public:
+        MetricsScope(MetricsHistogram &histogram) : histogram(histogram), core(xPortGetCoreID()), start(ESP.getCycleCount()) {}
+        ~MetricsScope() {
+            uint32_t cycles = ESP.getCycleCount() - start;
+            if (xPortGetCoreID() == core) histogram.record(cycles);
+        }
+    private:
+        MetricsHistogram &histogram;
+        BaseType_t core;
+        uint32_t start;
+};
+
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+
+// Measure the rest of the current scope
+#define METRICS_SCOPE(histogram) MetricsScope METRICS_CONCAT(metricsScope, __LINE__)(histogram)
+
+// Measure a web handler, the histogram is registered with the first request
+#define METRICS_HTTP_HANDLER(method, path) \
+    static MetricsHistogram METRICS_CONCAT(metricsHandler, __LINE__)(METRICS_HTTP, "handler=\"" path "\",method=\"" method "\""); \
+    METRICS_SCOPE(METRICS_CONCAT(metricsHandler, __LINE__))
+
+extern MetricsHistogram metricsSensorRead;      // HX711 median reading
+extern MetricsHistogram metricsCalculateLevel;
+extern MetricsHistogram metricsNvsWrite;
+extern MetricsHistogram metricsBmp180Read;
+extern MetricsHistogram metricsMqttPublish;
+
+// Write a single counter or gauge without labels, including the HELP and TYPE lines
+void metricsWrite(Print &out, const char *name, const char *type, const char *help, uint64_t value);
+void metricsWrite(Print &out, const char *name, const char *type, const char *help, float value);
+
+// Write only the HELP and TYPE lines, for metrics with labels
+void metricsWriteHeader(Print &out, const char *name, const char *type, const char *help);
+
+#endif // METRICS_h
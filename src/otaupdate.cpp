@@ -0,0 +1,366 @@
+/**
+ * @file otaupdate.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Firmware and filesystem updates written by a background task with on the fly verification
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include "otaupdate.h"
+
+extern bool otaRunning;
+
+OtaPipeline otaPipeline;
+OtaDelta otaDelta;
+
+static uint32_t getU32(const uint8_t * in) {
+  return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static void sha256Hex(const uint8_t * hash, char * out) {
+  for (uint8_t i = 0; i < 32; i++) snprintf(out + i * 2, 3, "%02x", hash[i]);
+}
+
+bool OtaPipeline::begin(int command, uint32_t total, const void * owner) {
+  if (state == OTA_RUNNING) return false;
+  error = NULL;
+  failed = false;
+  written = 0;
+  digest[0] = '\0';
+  this->total = total;
+  startMs = millis();
+
+  memory = (uint8_t *)malloc(OTA_BUFFER_SIZE * (OTA_BUFFERS + 1));
+  freeQueue = xQueueCreate(OTA_BUFFERS, sizeof(uint8_t *));
+  jobQueue = xQueueCreate(OTA_JOBS, sizeof(job_t));
+  finished = xSemaphoreCreateBinary();
+  if (!memory || !freeQueue || !jobQueue || !finished) {
+    fail("Not enough memory for the update buffers");
+    release();
+    return false;
+  }
+  for (uint8_t i = 1; i < OTA_BUFFERS; i++) {
+    uint8_t * buffer = memory + i * OTA_BUFFER_SIZE;
+    xQueueSend(freeQueue, &buffer, 0);
+  }
+  current = memory;
+  currentLen = currentQueued = 0;
+
+  if (!Update.begin(UPDATE_SIZE_UNKNOWN, command)) {
+    fail(Update.errorString());
+    release();
+    return false;
+  }
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+  if (xTaskCreate(&OtaPipeline::writerTask, "ota", 4096, this, OTA_TASK_PRIORITY, NULL) != pdPASS) {
+    fail("Unable to start the writer task");
+    mbedtls_sha256_free(&sha);
+    Update.abort();
+    release();
+    return false;
+  }
+
+  // Pause the measurements and everything else that runs in loop()
+  otaRunning = true;
+  this->owner = owner;
+  state = OTA_RUNNING;
+  LOG_INFO_F("[OTA] Update of %u bytes started\n", total);
+  return true;
+}
+
+void OtaPipeline::writerTask(void * arg) {
+  OtaPipeline * self = (OtaPipeline *)arg;
+  uint8_t * scratch = self->memory + OTA_BUFFERS * OTA_BUFFER_SIZE;
+  job_t job;
+  while (xQueueReceive(self->jobQueue, &job, portMAX_DELAY) == pdTRUE && (job.data || job.partition)) {
+    if (job.data) self->process(job.data, job.len);
+    // Copies are read in sector sized chunks, in between the other tasks get the CPU
+    while (job.partition && job.len > 0 && !self->failed) {
+      uint32_t n = job.len < OTA_BUFFER_SIZE ? job.len : OTA_BUFFER_SIZE;
+      if (esp_partition_read(job.partition, job.offset, scratch, n) != ESP_OK) self->fail("Unable to read the running firmware");
+      else self->process(scratch, n);
+      job.offset += n;
+      job.len -= n;
+      vTaskDelay(1);
+    }
+    if (job.buffer) xQueueSend(self->freeQueue, &job.buffer, portMAX_DELAY);
+  }
+  xSemaphoreGive(self->finished);
+  vTaskDelete(NULL);
+}
+
+void OtaPipeline::process(const uint8_t * data, size_t len) {
+  // After a failure the remaining jobs are only skipped
+  if (failed) return;
+  mbedtls_sha256_update_ret(&sha, data, len);
+  if (Update.write((uint8_t *)data, len) != len) fail(Update.errorString());
+  else written += len;
+}
+
+bool OtaPipeline::stalled(uint32_t &progress, uint32_t &since) {
+  if (written != progress) {
+    progress = written;
+    since = millis();
+  } else if (millis() - since > OTA_QUEUE_TIMEOUT_MS) {
+    fail("Timeout while writing to the flash");
+    return true;
+  }
+  return false;
+}
+
+bool OtaPipeline::queue(const job_t &job) {
+  // A queued copy can keep the writer task busy for longer than the timeout, only give up without progress
+  uint32_t progress = written;
+  uint32_t since = millis();
+  while (xQueueSend(jobQueue, &job, pdMS_TO_TICKS(100)) != pdTRUE) {
+    if (stalled(progress, since)) return false;
+  }
+  return true;
+}
+
+bool OtaPipeline::submit(bool release) {
+  job_t job = { current + currentQueued, (uint32_t)(currentLen - currentQueued), NULL, 0, release ? current : NULL };
+  if (!queue(job)) return false;
+  if (!release) {
+    currentQueued = currentLen;
+    return true;
+  }
+
+  uint32_t progress = written;
+  uint32_t since = millis();
+  while (xQueueReceive(freeQueue, &current, pdMS_TO_TICKS(100)) != pdTRUE) {
+    if (stalled(progress, since)) {
+      current = NULL;
+      return false;
+    }
+  }
+  currentLen = currentQueued = 0;
+  return true;
+}
+
+bool OtaPipeline::write(const uint8_t * data, size_t len) {
+  if (state != OTA_RUNNING || failed || !current) return false;
+  while (len > 0) {
+    size_t room = OTA_BUFFER_SIZE - currentLen;
+    size_t n = room < len ? room : len;
+    memcpy(current + currentLen, data, n);
+    currentLen += n;
+    data += n;
+    len -= n;
+    if (currentLen == OTA_BUFFER_SIZE && !submit(true)) return false;
+  }
+  return !failed;
+}
+
+bool OtaPipeline::copy(const esp_partition_t * partition, uint32_t offset, uint32_t len) {
+  if (state != OTA_RUNNING || failed || !current) return false;
+  // The data before the copy goes first, the rest of the buffer is filled with the data after it
+  if (currentLen > currentQueued && !submit(false)) return false;
+  job_t job = { NULL, len, partition, offset, NULL };
+  return queue(job) && !failed;
+}
+
+void OtaPipeline::fail(const char * reason) {
+  if (!error) error = reason;
+  failed = true;
+}
+
+void OtaPipeline::drain() {
+  // The writer task skips the queued jobs after a failure, otherwise this waits for the queued copies
+  if (current && currentLen > currentQueued) {
+    job_t job = { current + currentQueued, (uint32_t)(currentLen - currentQueued), NULL, 0, NULL };
+    xQueueSend(jobQueue, &job, portMAX_DELAY);
+  }
+  current = NULL;
+  currentLen = currentQueued = 0;
+  job_t stopMarker = { NULL, 0, NULL, 0, NULL };
+  xQueueSend(jobQueue, &stopMarker, portMAX_DELAY);
+  xSemaphoreTake(finished, portMAX_DELAY);
+}
+
+void OtaPipeline::release() {
+  if (freeQueue) vQueueDelete(freeQueue);
+  if (jobQueue) vQueueDelete(jobQueue);
+  if (finished) vSemaphoreDelete(finished);
+  free(memory);
+  freeQueue = jobQueue = NULL;
+  finished = NULL;
+  memory = NULL;
+  current = NULL;
+  currentLen = currentQueued = 0;
+  owner = NULL;
+  endMs = millis();
+  state = failed ? OTA_FAILED : OTA_DONE;
+  if (failed) otaRunning = false;
+}
+
+bool OtaPipeline::end(const char * expectedSha256) {
+  if (state != OTA_RUNNING) return false;
+  drain();
+
+  uint8_t hash[32];
+  mbedtls_sha256_finish_ret(&sha, hash);
+  mbedtls_sha256_free(&sha);
+  sha256Hex(hash, digest);
+
+  if (!failed && expectedSha256 && *expectedSha256 && strcasecmp(expectedSha256, digest) != 0) {
+    fail("SHA-256 checksum mismatch");
+  }
+  if (failed) Update.abort();
+  else if (!Update.end(true)) fail(Update.errorString());
+  release();
+
+  if (failed) LOG_ERROR_F("[OTA] Update failed: %s\n", error);
+  else LOG_INFO_F("[OTA] Update of %u bytes verified, SHA-256 %s\n", written, digest);
+  return !failed;
+}
+
+void OtaPipeline::abort(const void * owner) {
+  if (!isOwner(owner)) return;
+  fail("Update aborted");
+  drain();
+  mbedtls_sha256_free(&sha);
+  Update.abort();
+  release();
+  LOG_INFO_LN(F("[OTA] Update aborted"));
+}
+
+OtaPipeline::progress_t OtaPipeline::getProgress() {
+  progress_t progress;
+  progress.state = state;
+  progress.written = written;
+  progress.total = total;
+  uint32_t elapsed = (state == OTA_RUNNING ? millis() : endMs) - startMs;
+  progress.bytesPerSecond = elapsed ? (uint64_t)written * 1000 / elapsed : 0;
+  strlcpy(progress.sha256, digest, sizeof(progress.sha256));
+  progress.error = error;
+  return progress;
+}
+
+const char * runningFirmwareSha256() {
+  // Like the host tool, images with an appended hash are identified by it
+  static char digest[65] = "";
+  if (!digest[0]) {
+    uint8_t hash[32];
+    if (esp_partition_get_sha256(esp_ota_get_running_partition(), hash) == ESP_OK) sha256Hex(hash, digest);
+  }
+  return digest;
+}
+
+bool OtaDelta::begin(const void * owner) {
+  if (this->owner || otaPipeline.isRunning()) return false;
+  this->owner = owner;
+  error = NULL;
+  step = HEADER;
+  filled = 0;
+  return true;
+}
+
+bool OtaDelta::fail(const char * reason) {
+  if (!error) error = reason;
+  if (otaPipeline.isOwner(owner)) otaPipeline.abort(owner);
+  owner = NULL;
+  if (reason) LOG_ERROR_F("[OTA] Delta update failed: %s\n", reason);
+  return false;
+}
+
+bool OtaDelta::start() {
+  if (memcmp(header, "WLDP", 4) != 0 || header[4] != OTA_DELTA_VERSION) return fail("Not a firmware patch");
+  char sourceSha256[65];
+  sha256Hex(header + 8, sourceSha256);
+  if (strcmp(sourceSha256, runningFirmwareSha256()) != 0) return fail("Patch is for a different firmware");
+  sha256Hex(header + 44, targetSha256);
+
+  source = esp_ota_get_running_partition();
+  if (!otaPipeline.begin(U_FLASH, getU32(header + 40), owner)) return fail(NULL);
+  LOG_INFO_F("[OTA] Delta update from %s started\n", source->label);
+  return true;
+}
+
+bool OtaDelta::write(const uint8_t * data, size_t len) {
+  if (!owner) return false;
+  while (len > 0) {
+    size_t n, room;
+    switch (step) {
+      case HEADER:
+        room = OTA_DELTA_HEADER_SIZE - filled;
+        n = room < len ? room : len;
+        memcpy(header + filled, data, n);
+        filled += n;
+        data += n;
+        len -= n;
+        if (filled < OTA_DELTA_HEADER_SIZE) break;
+        if (!start()) return false;
+        step = OPCODE;
+        break;
+
+      case OPCODE:
+        op = *data++;
+        len--;
+        filled = 0;
+        if (op == OTA_DELTA_END) step = FINISHED;
+        else if (op == OTA_DELTA_COPY || op == OTA_DELTA_INSERT) step = ARGUMENTS;
+        else return fail("Invalid operation in the patch");
+        break;
+
+      case ARGUMENTS: {
+        uint8_t needed = op == OTA_DELTA_COPY ? 8 : 4;
+        room = needed - filled;
+        n = room < len ? room : len;
+        memcpy(arguments + filled, data, n);
+        filled += n;
+        data += n;
+        len -= n;
+        if (filled < needed) break;
+        if (op == OTA_DELTA_COPY) {
+          uint32_t offset = getU32(arguments);
+          uint32_t length = getU32(arguments + 4);
+          if (offset > source->size || length > source->size - offset) return fail("Patch copies outside of the running firmware");
+          // Only queued here, the writer task reads the running partition
+          if (!otaPipeline.copy(source, offset, length)) return fail(NULL);
+          step = OPCODE;
+        } else {
+          remaining = getU32(arguments);
+          step = remaining ? INSERT : OPCODE;
+        }
+        break;
+      }
+
+      case INSERT:
+        n = remaining < len ? remaining : len;
+        if (!otaPipeline.write(data, n)) return fail(NULL);
+        remaining -= n;
+        data += n;
+        len -= n;
+        if (!remaining) step = OPCODE;
+        break;
+
+      case FINISHED:
+        return fail("Data after the end of the patch");
+    }
+  }
+  return true;
+}
+
+bool OtaDelta::end() {
+  if (!owner) return false;
+  if (step != FINISHED) return fail("Incomplete patch");
+  owner = NULL;
+  // Update.end() checks the image and switches to it with esp_ota_set_boot_partition()
+  return otaPipeline.end(targetSha256);
+}
+
+void OtaDelta::abort(const void * owner) {
+  if (isOwner(owner)) fail("Update aborted");
+}
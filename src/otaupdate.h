@@ -0,0 +1,178 @@
+/**
+ * @file otaupdate.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Firmware and filesystem updates written by a background task with on the fly verification
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef OTAUPDATE_h
+#define OTAUPDATE_h
+
+#include <Arduino.h>
+#include <mbedtls/sha256.h>
+#include <esp_partition.h>
+
+#define OTA_BUFFER_SIZE 4096                    // one flash sector per write
+#define OTA_BUFFERS 4                           // buffers between the web server and the writer task
+#define OTA_JOBS 32                             // writes and copies queued for the writer task
+#define OTA_QUEUE_TIMEOUT_MS 10000              // give up if the writer makes no progress for this long
+#define OTA_TASK_PRIORITY 5                     // above the loop, below the network stack
+#define OTA_DELTA_VERSION 1
+#define OTA_DELTA_HEADER_SIZE 76                // "WLDP", version, 3 reserved, source SHA-256, target size, target SHA-256
+
+enum ota_state_t : uint8_t {
+    OTA_IDLE = 0,
+    OTA_RUNNING,
+    OTA_DONE,
+    OTA_FAILED
+};
+
+// Data received by the web server is copied into sector sized buffers and handed to a writer task
+// through a bounded queue, which also hashes it. Copies from another partition (of a delta update)
+// are queued the same way and read by the writer task. The receiver only blocks while the queue or
+// all buffers wait for the flash, which throttles the upload through the TCP window.
+class OtaPipeline {
+    public:
+        struct progress_t {
+            ota_state_t state;
+            uint32_t written;                   // bytes written to the flash
+            uint32_t total;                     // expected bytes, 0 if unknown
+            uint32_t bytesPerSecond;
+            char sha256[65];                    // hex digest once the update ended
+            const char * error;
+        };
+
+        // Start an update of the firmware (U_FLASH) or the filesystem (U_SPIFFS) for owner, e.g. the
+        // request that uploads it. total is only used for the progress. Returns false if an update
+        // is running already or the partition can not be prepared.
+        bool begin(int command, uint32_t total, const void * owner);
+
+        // Queue data, blocks while all buffers are in use. Returns false once the update failed.
+        bool write(const uint8_t * data, size_t len);
+
+        // Queue len bytes at offset of a partition, they are read by the writer task.
+        // Returns false once the update failed.
+        bool copy(const esp_partition_t * partition, uint32_t offset, uint32_t len);
+
+        // Wait for the writer, compare the SHA-256 if one is expected (hex, empty to skip) and finish the update
+        bool end(const char * expectedSha256);
+
+        // Cancel the update of owner, e.g. when the client disconnected
+        void abort(const void * owner);
+
+        bool isOwner(const void * owner) { return state == OTA_RUNNING && this->owner == owner; }
+        bool isRunning() { return state == OTA_RUNNING; }
+
+        progress_t getProgress();
+
+    private:
+        // Work for the writer task, without data and partition it stops
+        struct job_t {
+            const uint8_t * data;               // bytes to write
+            uint32_t len;
+            const esp_partition_t * partition;  // or copy len bytes at offset of this partition
+            uint32_t offset;
+            uint8_t * buffer;                   // returned to the free buffers once written, NULL while it is still filled
+        };
+
+        volatile ota_state_t state = OTA_IDLE;
+        const void * owner = NULL;
+        const char * error = NULL;
+        volatile bool failed = false;           // set by the writer task
+
+        QueueHandle_t freeQueue = NULL;         // buffers the receiver can fill
+        QueueHandle_t jobQueue = NULL;
+        SemaphoreHandle_t finished = NULL;      // given by the writer task once it stopped
+        uint8_t * memory = NULL;                // OTA_BUFFERS buffers and one the writer task copies through
+        uint8_t * current = NULL;               // buffer filled by the receiver
+        uint16_t currentLen = 0;
+        uint16_t currentQueued = 0;             // bytes of current handed to the writer task already
+
+        mbedtls_sha256_context sha;
+        char digest[65] = "";
+        uint32_t total = 0;
+        volatile uint32_t written = 0;
+        uint32_t startMs = 0;
+        uint32_t endMs = 0;
+
+        // Queue a job, waits as long as the writer task makes progress
+        bool queue(const job_t &job);
+
+        // Hand the new data of the current buffer to the writer, with release also the buffer and take the next free one
+        bool submit(bool release);
+
+        // Fails the update once the writer task made no progress for OTA_QUEUE_TIMEOUT_MS
+        bool stalled(uint32_t &progress, uint32_t &since);
+
+        // Hash and write data, called by the writer task
+        void process(const uint8_t * data, size_t len);
+
+        // Queue the rest and wait until the writer task stopped
+        void drain();
+
+        // Free the buffers and queues, the writer task must not run anymore
+        void release();
+        void fail(const char * reason);
+
+        static void writerTask(void * arg);
+};
+
+// Operations of a delta patch following the header, multi byte values are little endian
+enum ota_delta_op_t : uint8_t {
+    OTA_DELTA_END = 0,
+    OTA_DELTA_COPY = 1,                         // offset u32 in the running partition, length u32
+    OTA_DELTA_INSERT = 2                        // length u32 and the data
+};
+
+// Rebuilds a new firmware from a patch created by tools/firmware-delta.py and the running partition,
+// while the patch is received. Only the current operation is kept, the result goes through the
+// OtaPipeline and is checked against the SHA-256 of the new firmware before it is activated.
+class OtaDelta {
+    public:
+        // Start receiving a patch for owner, the update itself begins once the header was checked
+        bool begin(const void * owner);
+
+        // Apply the next bytes of the patch, returns false if it is invalid or the update failed
+        bool write(const uint8_t * data, size_t len);
+
+        // Verify the new firmware and make it the boot partition
+        bool end();
+
+        void abort(const void * owner);
+
+        bool isOwner(const void * owner) { return this->owner != NULL && this->owner == owner; }
+
+        // Reason of the last failure, NULL if the OtaPipeline reports it
+        const char * getError() { return error; }
+
+    private:
+        enum step_t : uint8_t { HEADER, OPCODE, ARGUMENTS, INSERT, FINISHED };
+
+        const void * owner = NULL;
+        const char * error = NULL;
+        const esp_partition_t * source = NULL;
+        step_t step = HEADER;
+        uint8_t header[OTA_DELTA_HEADER_SIZE];
+        uint8_t arguments[8];
+        uint8_t filled = 0;                     // bytes of the header or arguments received
+        uint8_t op = OTA_DELTA_END;
+        uint32_t remaining = 0;                 // bytes left of the data to insert
+        char targetSha256[65];
+
+        bool start();
+        bool fail(const char * reason);
+};
+
+// SHA-256 of the running firmware as hex, a delta patch must be created against it
+const char * runningFirmwareSha256();
+
+extern OtaPipeline otaPipeline;
+extern OtaDelta otaDelta;
+
+#endif // OTAUPDATE_h
@@ -0,0 +1,184 @@
+/**
+ * @file readingbuffer.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Store and forward buffer for readings taken while MQTT is unavailable
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+
+#include <FS.h>
+#include <LittleFS.h>
+#include <time.h>
+#include "readingbuffer.h"
+
+#define READINGBUFFER_MAGIC 0x57524231          // "WRB1"
+
+ReadingBuffer::ReadingBuffer(readingbuffer_rtc_t * rtcMemory, uint8_t tankIndex) {
+  rtc = rtcMemory;
+  tank = tankIndex;
+  snprintf(path, sizeof(path), "/buffer%u.bin", tank + 1);
+}
+
+File ReadingBuffer::openSegment() {
+  if (LittleFS.exists(path)) return LittleFS.open(path, "r+");
+  File file = LittleFS.open(path, "w+");
+  if (file) {
+    fs_header_t hdr = { READINGBUFFER_MAGIC, rtc->nextSeq, 0, 0 };
+    writeHeader(file, hdr);
+  }
+  return file;
+}
+
+bool ReadingBuffer::readHeader(File &file, fs_header_t &hdr) {
+  file.seek(0);
+  if (file.read((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != READINGBUFFER_MAGIC) {
+    hdr = { READINGBUFFER_MAGIC, rtc->nextSeq, 0, 0 };
+    return false;
+  }
+  return true;
+}
+
+bool ReadingBuffer::writeHeader(File &file, fs_header_t &hdr) {
+  file.seek(0);
+  return file.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr);
+}
+
+// Persist the sequence counter, so it continues after a power loss
+void ReadingBuffer::saveSequence() {
+  File file = openSegment();
+  if (!file) return;
+  fs_header_t hdr;
+  readHeader(file, hdr);
+  hdr.nextSeq = rtc->nextSeq;
+  writeHeader(file, hdr);
+  file.close();
+}
+
+void ReadingBuffer::begin() {
+  if (!LittleFS.exists(path)) return;
+  File file = LittleFS.open(path, "r");
+  fs_header_t hdr;
+  if (file && readHeader(file, hdr)) {
+    fsCount = hdr.count;
+    // After a power loss the RTC memory is empty, continue with the persisted sequence
+    if (hdr.nextSeq > rtc->nextSeq) rtc->nextSeq = hdr.nextSeq;
+    if (count()) LOG_INFO_F("[BUFFER] Tank %d has %u buffered readings\n", tank + 1, count());
+  }
+  file.close();
+}
+
+void ReadingBuffer::push(uint8_t level, int32_t sensorPressure, uint16_t airPressure, bool sensorError) {
+  if (rtc->count >= READINGBUFFER_RTC_SIZE && !spillToFs(READINGBUFFER_SPILL)) {
+    // LittleFS unavailable, drop the oldest reading
+    rtc->head = (rtc->head + 1) % READINGBUFFER_RTC_SIZE;
+    rtc->count--;
+    rtc->dropped++;
+  }
+
+  time_t now = time(nullptr);
+  reading_t &r = rtc->ring[(rtc->head + rtc->count) % READINGBUFFER_RTC_SIZE];
+  r.seq = rtc->nextSeq++;
+  r.time = (uint32_t)now;
+  r.sensorPressure = sensorPressure;
+  r.airPressure = airPressure;
+  r.level = level;
+  r.flags = (sensorError ? READING_FLAG_SENSOR_ERROR : 0) | (now > 1600000000 ? READING_FLAG_TIME_SYNCED : 0);
+  rtc->count++;
+}
+
+bool ReadingBuffer::spillToFs(uint8_t num) {
+  File file = openSegment();
+  if (!file) return false;
+
+  fs_header_t hdr;
+  readHeader(file, hdr);
+  for (uint8_t i = 0; i < num && rtc->count > 0; i++) {
+    if (hdr.count >= READINGBUFFER_FS_SIZE) {
+      // segment is full, overwrite the oldest reading
+      hdr.head = (hdr.head + 1) % READINGBUFFER_FS_SIZE;
+      hdr.count--;
+      rtc->dropped++;
+    }
+    file.seek(sizeof(hdr) + ((hdr.head + hdr.count) % READINGBUFFER_FS_SIZE) * sizeof(reading_t));
+    file.write((uint8_t *)&rtc->ring[rtc->head], sizeof(reading_t));
+    hdr.count++;
+    rtc->head = (rtc->head + 1) % READINGBUFFER_RTC_SIZE;
+    rtc->count--;
+  }
+  hdr.nextSeq = rtc->nextSeq;
+  writeHeader(file, hdr);
+  file.close();
+  fsCount = hdr.count;
+  return true;
+}
+
+size_t ReadingBuffer::formatBatch(const reading_t * readings, uint8_t num) {
+  size_t len = snprintf(payload, sizeof(payload), "{\"tank\":%u,\"readings\":[", tank + 1);
+  for (uint8_t i = 0; i < num && len < sizeof(payload); i++) {
+    // [seq, time, level, sensorPressure, airPressure, flags]
+    len += snprintf(payload + len, sizeof(payload) - len, "%s[%u,%u,%u,%d,%u,%u]", i ? "," : "",
+      readings[i].seq, readings[i].time, readings[i].level, readings[i].sensorPressure, readings[i].airPressure, readings[i].flags
+    );
+  }
+  if (len < sizeof(payload)) len += snprintf(payload + len, sizeof(payload) - len, "]}");
+  return len;
+}
+
+uint16_t ReadingBuffer::drain(std::function<bool(const char *payload)> publish, uint8_t maxBatches) {
+  uint16_t published = 0;
+  reading_t batch[READINGBUFFER_BATCH];
+
+  // Oldest readings are on LittleFS
+  if (fsCount > 0) {
+    File file = openSegment();
+    if (!file) return 0;
+    fs_header_t hdr;
+    readHeader(file, hdr);
+    while (maxBatches > 0 && hdr.count > 0) {
+      uint8_t num = 0;
+      while (num < READINGBUFFER_BATCH && num < hdr.count) {
+        file.seek(sizeof(hdr) + ((hdr.head + num) % READINGBUFFER_FS_SIZE) * sizeof(reading_t));
+        if (file.read((uint8_t *)&batch[num], sizeof(reading_t)) != sizeof(reading_t)) break;
+        num++;
+      }
+      if (num == 0 || formatBatch(batch, num) >= sizeof(payload) || !publish(payload)) break;
+      hdr.head = (hdr.head + num) % READINGBUFFER_FS_SIZE;
+      hdr.count -= num;
+      published += num;
+      maxBatches--;
+    }
+    // Only touch the flash if readings were taken off the segment
+    if (published) {
+      hdr.nextSeq = rtc->nextSeq;
+      writeHeader(file, hdr);
+    }
+    file.close();
+    fsCount = hdr.count;
+    if (fsCount > 0) return published;
+  }
+  uint16_t fromFs = published;
+
+  while (maxBatches > 0 && rtc->count > 0) {
+    uint8_t num = 0;
+    while (num < READINGBUFFER_BATCH && num < rtc->count) {
+      batch[num] = rtc->ring[(rtc->head + num) % READINGBUFFER_RTC_SIZE];
+      num++;
+    }
+    if (formatBatch(batch, num) >= sizeof(payload) || !publish(payload)) break;
+    rtc->head = (rtc->head + num) % READINGBUFFER_RTC_SIZE;
+    rtc->count -= num;
+    published += num;
+    maxBatches--;
+  }
+
+  if (published > fromFs) saveSequence();
+  if (published) LOG_INFO_F("[BUFFER] Published %u buffered readings of tank %d\n", published, tank + 1);
+  return published;
+}
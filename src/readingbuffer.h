@@ -0,0 +1,95 @@
+/**
+ * @file readingbuffer.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Store and forward buffer for readings taken while MQTT is unavailable
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef READINGBUFFER_h
+#define READINGBUFFER_h
+
+#include <Arduino.h>
+#include <FS.h>
+#include <functional>
+
+#define READINGBUFFER_RTC_SIZE 32               // readings kept in RTC memory per tank (survives deep sleep)
+#define READINGBUFFER_FS_SIZE 512               // readings kept in the LittleFS overflow segment per tank
+#define READINGBUFFER_SPILL 16                  // move that many readings at once from RTC to LittleFS
+#define READINGBUFFER_BATCH 16                  // readings per published MQTT message
+#define READINGBUFFER_PAYLOAD_SIZE 1024         // buffer for one published batch, keep below MQTT_BUFFER_SIZE
+
+#define READING_FLAG_SENSOR_ERROR 0x01
+#define READING_FLAG_TIME_SYNCED  0x02
+
+// One timestamped reading, 16 byte
+struct reading_t {
+    uint32_t seq;                               // per tank sequence number, consumers use it to deduplicate
+    uint32_t time;                              // unix time, or seconds since power on if the clock was not synced
+    int32_t sensorPressure;                     // calculated median sensor reading
+    uint16_t airPressure;                       // atmospheric pressure in hPa
+    uint8_t level;                              // tank level 0-100%
+    uint8_t flags;                              // READING_FLAG_*
+};
+
+// State that has to survive deep sleep, place it in RTC_DATA_ATTR memory
+struct readingbuffer_rtc_t {
+    uint32_t nextSeq;                           // sequence number of the next reading
+    uint32_t dropped;                           // readings lost because both buffers were full
+    uint16_t head;                              // index of the oldest reading in ring[]
+    uint16_t count;                             // number of readings in ring[]
+    reading_t ring[READINGBUFFER_RTC_SIZE];
+};
+
+class ReadingBuffer {
+    private:
+        // Header of the LittleFS overflow segment, followed by READINGBUFFER_FS_SIZE records
+        struct fs_header_t {
+            uint32_t magic;
+            uint32_t nextSeq;                   // sequence number persisted for the next cold boot
+            uint16_t head;
+            uint16_t count;
+        };
+
+        readingbuffer_rtc_t * rtc;
+        uint8_t tank;
+        char path[24];
+        uint16_t fsCount = 0;                   // cached number of readings on LittleFS
+        char payload[READINGBUFFER_PAYLOAD_SIZE];
+
+        bool readHeader(File &file, fs_header_t &hdr);
+        bool writeHeader(File &file, fs_header_t &hdr);
+        File openSegment();
+        void saveSequence();
+
+        // Move the oldest readings from RTC memory into the LittleFS segment
+        bool spillToFs(uint8_t num);
+
+        // Format readings as JSON into payload
+        size_t formatBatch(const reading_t * readings, uint8_t num);
+
+    public:
+        ReadingBuffer(readingbuffer_rtc_t * rtcMemory, uint8_t tankIndex);
+
+        // Restore the sequence counter and overflow state from LittleFS
+        void begin();
+
+        // Store a new reading
+        void push(uint8_t level, int32_t sensorPressure, uint16_t airPressure, bool sensorError);
+
+        // Number of readings waiting to be published
+        uint32_t count() { return rtc->count + fsCount; }
+
+        // Readings lost due to a full buffer
+        uint32_t dropped() { return rtc->dropped; }
+
+        // Publish up to maxBatches batches, oldest first. Readings are removed only if publish() succeeds.
+        uint16_t drain(std::function<bool(const char *payload)> publish, uint8_t maxBatches = 2);
+};
+
+#endif // READINGBUFFER_h
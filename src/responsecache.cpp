@@ -0,0 +1,56 @@
+/**
+ * @file responsecache.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Keep serialized API responses until the underlying data changes
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "log.h"
+#include "responsecache.h"
+#include <StreamString.h>
+
+ResponseCache::ResponseCache(uint8_t slots) {
+  numSlots = slots;
+  entries = new entry_t[slots];
+}
+
+ResponseCache::~ResponseCache() {
+  for (uint8_t i = 0; i < numSlots; i++) free(entries[i].body);
+  delete[] entries;
+}
+
+void ResponseCache::send(AsyncWebServerRequest *request, uint8_t slot, uint32_t generation, std::function<void(Print &output)> build) {
+  if (slot >= numSlots) return request->send(500, "text/plain", "Invalid cache slot");
+  entry_t &entry = entries[slot];
+
+  if (!entry.valid || entry.generation != generation) {
+    misses++;
+    StreamString output;
+    build(output);
+
+    // Keep the buffer if the new body fits, config changes rarely alter the size much
+    if (output.length() > entry.length || !entry.body) {
+      free(entry.body);
+      entry.body = (char *)malloc(output.length());
+    }
+    entry.valid = entry.body != nullptr;
+    if (!entry.valid) {
+      entry.length = 0;
+      // out of memory, still answer the request
+      return request->send(200, "application/json", output);
+    }
+    memcpy(entry.body, output.c_str(), output.length());
+    entry.length = output.length();
+    entry.generation = generation;
+  } else hits++;
+
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->write((const uint8_t *)entry.body, entry.length);
+  request->send(response);
+}
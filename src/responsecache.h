@@ -0,0 +1,46 @@
+/**
+ * @file responsecache.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Keep serialized API responses until the underlying data changes
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef RESPONSECACHE_h
+#define RESPONSECACHE_h
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <functional>
+
+// Each slot holds one response (e.g. an endpoint and sensor) together with the
+// generation of the data it was built from. Only use it from the AsyncTCP task.
+class ResponseCache {
+    public:
+        ResponseCache(uint8_t slots);
+        virtual ~ResponseCache();
+
+        // Send the response of a slot, calls build() first if the slot is empty or outdated
+        void send(AsyncWebServerRequest *request, uint8_t slot, uint32_t generation, std::function<void(Print &output)> build);
+
+        // Counters exposed through the API
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+
+    private:
+        struct entry_t {
+            bool valid = false;
+            uint32_t generation = 0;
+            char * body = nullptr;
+            size_t length = 0;
+        };
+        entry_t * entries;
+        uint8_t numSlots;
+};
+
+#endif // RESPONSECACHE_h
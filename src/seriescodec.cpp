@@ -0,0 +1,103 @@
+/**
+ * @file seriescodec.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Compact encoding of level history records, also builds on the host
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "seriescodec.h"
+
+#define FIELD_TIME        0x01
+#define FIELD_COUNT       0x02
+#define FIELD_LEVEL       0x04
+#define FIELD_LEVELMIN    0x08
+#define FIELD_LEVELMAX    0x10
+#define FIELD_PRESSURE    0x20
+#define FIELD_PRESSUREMIN 0x40
+#define FIELD_PRESSUREMAX 0x80
+
+static inline uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+static inline int32_t unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+static inline size_t putVarint(uint8_t *out, uint32_t v) {
+  size_t len = 0;
+  while (v >= 0x80) {
+    out[len++] = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  out[len++] = (uint8_t)v;
+  return len;
+}
+
+static inline bool getVarint(const uint8_t *in, size_t len, size_t &pos, uint32_t &v) {
+  v = 0;
+  for (uint8_t shift = 0; shift < 35; shift += 7) {
+    if (pos >= len) return false;
+    uint8_t b = in[pos++];
+    v |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+size_t seriesEncode(series_state_t &state, const history_record_t &rec, uint8_t *out) {
+  const history_record_t &prev = state.prev;
+  uint32_t delta = rec.time - prev.time;
+
+  // Differences are calculated unsigned, so they wrap around and decode to the same values
+  uint32_t v[8] = {
+    zigzag((int32_t)(delta - state.prevDelta)),
+    zigzag((int32_t)((uint32_t)rec.count - prev.count)),
+    zigzag((int32_t)rec.levelAvg - prev.levelAvg),
+    zigzag((int32_t)rec.levelAvg - rec.levelMin),
+    zigzag((int32_t)rec.levelMax - rec.levelAvg),
+    zigzag((int32_t)((uint32_t)rec.pressureAvg - (uint32_t)prev.pressureAvg)),
+    zigzag((int32_t)((uint32_t)rec.pressureAvg - (uint32_t)rec.pressureMin)),
+    zigzag((int32_t)((uint32_t)rec.pressureMax - (uint32_t)rec.pressureAvg))
+  };
+
+  uint8_t mask = 0;
+  size_t len = 1;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (!v[i]) continue;
+    mask |= 1 << i;
+    len += putVarint(out + len, v[i]);
+  }
+  out[0] = mask;
+
+  state.prevDelta = delta;
+  state.prev = rec;
+  return len;
+}
+
+size_t seriesDecode(series_state_t &state, const uint8_t *in, size_t len, history_record_t &rec) {
+  if (len == 0) return 0;
+  uint8_t mask = in[0];
+  size_t pos = 1;
+  uint32_t v[8];
+  for (uint8_t i = 0; i < 8; i++) {
+    v[i] = 0;
+    if ((mask & (1 << i)) && !getVarint(in, len, pos, v[i])) return 0;
+  }
+
+  const history_record_t &prev = state.prev;
+  uint32_t delta = state.prevDelta + (uint32_t)unzigzag(v[0]);
+  rec.time = prev.time + delta;
+  rec.count = prev.count + unzigzag(v[1]);
+  rec.levelAvg = prev.levelAvg + unzigzag(v[2]);
+  rec.levelMin = rec.levelAvg - unzigzag(v[3]);
+  rec.levelMax = rec.levelAvg + unzigzag(v[4]);
+  rec.pressureAvg = (int32_t)((uint32_t)prev.pressureAvg + (uint32_t)unzigzag(v[5]));
+  rec.pressureMin = (int32_t)((uint32_t)rec.pressureAvg - (uint32_t)unzigzag(v[6]));
+  rec.pressureMax = (int32_t)((uint32_t)rec.pressureAvg + (uint32_t)unzigzag(v[7]));
+
+  state.prevDelta = delta;
+  state.prev = rec;
+  return pos;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file seriescodec.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Compact encoding of level history records, also builds on the host
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef SERIESCODEC_h
+#define SERIESCODEC_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A field mask byte, 5 bytes time, 3 bytes count, 3 level fields with 2 bytes and 3 pressure fields with 5 bytes
+#define SERIES_MAX_RECORD_SIZE 30
+
+// A rollup of all samples in [time, time + resolution), raw samples have count 1 and min = avg = max
+struct history_record_t {
+    uint32_t time;                              // unix time of the first sample (bucket start for rollups)
+    uint16_t count;                             // number of raw samples
+    uint8_t levelMin;
+    uint8_t levelAvg;
+    uint8_t levelMax;
+    int32_t pressureMin;                        // calculated median sensor reading
+    int32_t pressureAvg;
+    int32_t pressureMax;
+};
+
+// Records are encoded relative to the previous one, a new series starts with an empty state
+struct series_state_t {
+    history_record_t prev = {0, 0, 0, 0, 0, 0, 0, 0};
+    uint32_t prevDelta = 0;                     // time difference of the last two records
+};
+
+// Each record starts with a mask of the fields that changed, followed by zig-zag varints of:
+//   time       delta of the time delta, 0 for a fixed interval
+//   count      delta to the previous count
+//   levelAvg   delta to the previous average, levelMin/levelMax as distance to the average
+//   pressure   the same as the level
+// A record of an unchanged series at a fixed interval is encoded in a single byte.
+
+// Encode rec into out (at least SERIES_MAX_RECORD_SIZE bytes), returns the number of bytes written
+size_t seriesEncode(series_state_t &state, const history_record_t &rec, uint8_t *out);
+
+// Decode the next record of in, returns the number of bytes read or 0 if the input is truncated
+size_t seriesDecode(series_state_t &state, const uint8_t *in, size_t len, history_record_t &rec);
+
+#endif // SERIESCODEC_h
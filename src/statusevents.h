@@ -0,0 +1,189 @@
+/**
+ * @file statusevents.h
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Server sent status events of all tanks for the web UI
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef STATUSEVENTS_h
+#define STATUSEVENTS_h
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "eventstream.h"
+#include "otaupdate.h"
+
+#define STATUS_AIRPRESSURE_DELTA 0.1        // Report air pressure changes in hPa larger than this
+#define STATUS_TEMPERATURE_DELTA 0.1        // Report temperature changes in °C larger than this
+#define EVENTS_HOLD_MS 60000                // keep recording events this long after the last client left
+#define EVENTS_OTA_INTERVAL_MS 500          // progress of a running update
+#define EVENTS_MAX_QUEUED 2048              // hold back events while a client has more bytes waiting
+
+struct tankstatus_t {
+  uint8_t level = 0;
+  uint32_t volume = 0;
+  int sensorPressure = 0;
+  float airPressure = 0.f;
+  float temperature = 0.f;
+  bool error = false;
+  bool configured = false;
+  bool pump = false;
+};
+
+tankstatus_t tankStatus[LEVELMANAGERS];     // current status, updated in loop()
+tankstatus_t sentStatus[LEVELMANAGERS];     // status as last sent to the event stream clients
+volatile bool statusFullRequested = true;   // a client connected and needs a full snapshot
+
+uint32_t lastEventId = 0;                   // id of the last sent event, increases with every event
+uint32_t replayFromId = 1;                  // clients that got an event before this id missed changes
+uint64_t lastClientSeen = 0;                // millis() when the last client was connected
+bool eventsRecorded = true;                 // false while changes are not recorded
+SemaphoreHandle_t eventMutex = NULL;
+uint32_t statusEventsCoalesced = 0;         // status cycles merged into a later delta due to slow clients
+
+void beginStatusEvents() {
+  eventMutex = xSemaphoreCreateMutex();
+  // Start with a random id, so a client connected before a reboot never matches an id of this boot
+  lastEventId = esp_random() & 0x3fffffff;
+  replayFromId = lastEventId + 1;
+}
+
+// Events are recorded as long as a client is connected or might reconnect soon
+bool isRecordingEvents() {
+  if (events.count() > 0) lastClientSeen = millis();
+  return millis() - lastClientSeen <= EVENTS_HOLD_MS;
+}
+
+// Slow clients fall out of the buffer of the event stream, give them time to catch up
+bool isEventStreamCongested() {
+  return events.count() > 0 && events.maxQueued() > EVENTS_MAX_QUEUED;
+}
+
+// Send an event with the next id to all clients, it stays in the buffer of the event stream for reconnecting clients
+void emitEvent(const char * name, const char * data) {
+  xSemaphoreTake(eventMutex, portMAX_DELAY);
+  uint32_t id = ++lastEventId;
+  eventsRecorded = true;
+  if (!events.send(data, name, id)) {
+    // Nobody got it, so it can not be resumed from an earlier event
+    replayFromId = id + 1;
+    LOG_ERROR_F("[EVENTS] Event %s of %u bytes does not fit into the buffer\n", name, strlen(data));
+  }
+  xSemaphoreGive(eventMutex);
+}
+
+// Stop recording, every reconnecting client gets a full snapshot
+void stopRecordingEvents() {
+  xSemaphoreTake(eventMutex, portMAX_DELAY);
+  // Changes are no longer sent, so even a client that got the last event is outdated
+  replayFromId = ++lastEventId + 1;
+  eventsRecorded = false;
+  xSemaphoreGive(eventMutex);
+}
+
+// A client connected to the event stream, runs in the AsyncTCP task. A reconnecting client
+// continues with the events it missed, unless changes were not recorded in between.
+void onEventsConnect(uint32_t lastId, bool resumed) {
+  if (lastId) LOG_INFO_F("[EVENTS] Client reconnected, last event it got is %u\n", lastId);
+  if (resumed && eventMutex) {
+    xSemaphoreTake(eventMutex, portMAX_DELAY);
+    resumed = lastId <= lastEventId && lastId + 1 >= replayFromId;
+    xSemaphoreGive(eventMutex);
+  }
+  // Otherwise start over with a full snapshot
+  if (!resumed) statusFullRequested = true;
+}
+
+// Send the status of all tanks to the event stream clients. After a client connected
+// a full "status" snapshot is sent, afterwards "delta" events with the changed fields only.
+// Nothing is serialized as long as no client is connected or expected to reconnect.
+void sendStatusEvents() {
+  if (!isRecordingEvents()) {
+    if (eventsRecorded) stopRecordingEvents();
+    return;
+  }
+  bool full = statusFullRequested && events.count() > 0;
+  if (isEventStreamCongested()) {
+    // sentStatus is not updated, so the next delta contains all changes in between
+    if (!full) statusEventsCoalesced++;
+    return;
+  }
+  if (full) statusFullRequested = false;
+
+  StaticJsonDocument<1024> jsonDoc;
+  JsonArray tanks = jsonDoc.to<JsonArray>();
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    const tankstatus_t &cur = tankStatus[i];
+    tankstatus_t &old = sentStatus[i];
+
+    JsonObject tank;
+    auto changed = [&]() -> JsonObject {
+      if (tank.isNull()) {
+        tank = tanks.createNestedObject();
+        tank["id"] = i;
+      }
+      return tank;
+    };
+    if (full || cur.level != old.level) changed()["level"] = cur.level;
+    if (full || cur.volume != old.volume) changed()["volume"] = cur.volume;
+    if (full || cur.sensorPressure != old.sensorPressure) changed()["sensorPressure"] = cur.sensorPressure;
+    if (full || fabs(cur.airPressure - old.airPressure) >= STATUS_AIRPRESSURE_DELTA) changed()["airPressure"] = cur.airPressure;
+    if (full || fabs(cur.temperature - old.temperature) >= STATUS_TEMPERATURE_DELTA) changed()["temperature"] = cur.temperature;
+    if (full || cur.error != old.error) changed()["error"] = cur.error;
+    if (full || cur.configured != old.configured) changed()["configured"] = cur.configured;
+    if (full) changed()["pump"] = old.pump;
+
+    if (!tank.isNull()) {
+      // Floats below the threshold keep their old value, so slow drifts are reported eventually
+      float airPressure = tank.containsKey("airPressure") ? cur.airPressure : old.airPressure;
+      float temperature = tank.containsKey("temperature") ? cur.temperature : old.temperature;
+      bool pump = old.pump;
+      old = cur;
+      old.airPressure = airPressure;
+      old.temperature = temperature;
+      old.pump = pump;
+    }
+  }
+  if (tanks.size() == 0) return;
+
+  serializeJson(jsonDoc, statusJson, sizeof(statusJson));
+  emitEvent(full ? "status" : "delta", statusJson);
+}
+
+// Send a "pump" event whenever an air pump starts or stops, call it from loop()
+void sendPumpEvents() {
+  if (isEventStreamCongested()) return;
+  for (uint8_t i=0; i < LEVELMANAGERS; i++) {
+    bool running = LevelManagers[i]->isAirPumpRunning();
+    if (running == sentStatus[i].pump) continue;
+    sentStatus[i].pump = running;
+    if (!isRecordingEvents()) continue;
+
+    char data[32];
+    snprintf(data, sizeof(data), "{\"id\":%u,\"pump\":%s}", i, running ? "true" : "false");
+    emitEvent("pump", data);
+  }
+}
+
+// Progress of a web update
+void sendOtaEvents() {
+  static uint32_t lastMs = 0;
+  if (!otaPipeline.isRunning() || millis() - lastMs < EVENTS_OTA_INTERVAL_MS) return;
+  lastMs = millis();
+  if (!isRecordingEvents() || isEventStreamCongested()) return;
+
+  OtaPipeline::progress_t progress = otaPipeline.getProgress();
+  char data[96];
+  snprintf(data, sizeof(data), "{\"state\":%u,\"written\":%u,\"total\":%u,\"bytesPerSecond\":%u}",
+    progress.state, progress.written, progress.total, progress.bytesPerSecond
+  );
+  emitEvent("ota", data);
+}
+
+#endif // STATUSEVENTS_h
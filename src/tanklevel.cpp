@@ -16,6 +16,7 @@
 #include <HX711.h>
 #include <Preferences.h>
 #include "tanklevel.h"
+#include "metrics.h"
 #include <bits/stdc++.h>
 #include <soc/rtc.h>
 extern "C" {
@@ -48,16 +49,19 @@ void TANKLEVEL::loop() {
       timing.lastSetupRead = runtime();
       int val = runLevelSetup();
       if (!val) LOG_INFO_LN(F("[SENSOR] Unable to read data from sensor!"));
+      publishSnapshot();
       activateAirPump("Setup, keeping perfect pressure while filling up");
     }
   }
   else
   {
-    if (runtime() - timing.lastSensorRead >= timing.sensorIntervalMs && !airPumpEnabled && runtime() - airPumpEndtime >= WAIT_READING_AFTER_PUMP)
+    if ((freshReadingRequested || runtime() - timing.lastSensorRead >= timing.sensorIntervalMs) && !airPumpEnabled && runtime() - airPumpEndtime >= WAIT_READING_AFTER_PUMP)
     {
       timing.lastSensorRead = runtime();
+      freshReadingRequested = false;
       getCalulcatedMedianReading(false);
       calculateLevel();
+      publishSnapshot();
       if (automaticAirPump && levelConfig.setupDone)
       {
         if (firstReadSincePump)
@@ -101,9 +105,11 @@ void TANKLEVEL::deactivateAirPump() {
   }
 }
 
-void TANKLEVEL::activateAirPump(String reason) {
-  LOG_INFO_F("[AIRPUMP] Starting Air Pump on GPIO %d at runtime %" PRIu64 ". Reason: %s\n", airPumpPIN, runtime(), reason.c_str());
+void TANKLEVEL::activateAirPump(const char * reason) {
+  LOG_INFO_F("[AIRPUMP] Starting Air Pump on GPIO %d at runtime %" PRIu64 ". Reason: %s\n", airPumpPIN, runtime(), reason);
   airPumpEnabled = true;
+  airPumpRuns++;
+  airPumpReason = reason;
   airPumpStarttime = runtime();
   airPumpEndtime = 0;
   digitalWrite(airPumpPIN, HIGH);
@@ -121,16 +127,18 @@ uint64_t TANKLEVEL::runtime() {
 }
 
 bool TANKLEVEL::setMaxVolume(uint32_t tankvolume, String unit) {
+  METRICS_SCOPE(metricsNvsWrite);
   if (unit.equals("liters")) tankvolume = tankvolume * 1000;
   else if (unit.equals("milliliters")) tankvolume = tankvolume;
   else if (unit.equals("usgallons")) tankvolume = tankvolume * 1000 * 3.785411784;
-  else LOG_INFO_F("[ERROR] Unknown unit '%s' given\n", unit);
+  else LOG_ERROR_F("[ERROR] Unknown unit '%s' given\n", unit.c_str());
 
   if (preferences.begin(NVS.c_str(), false)) {
     LOG_INFO_F("[CONFIG] Tank volume of %d milliliters saved to NVS.\n", tankvolume);
     preferences.putUInt("volume", tankvolume);
     preferences.end();
     levelConfig.volumeMilliLiters = tankvolume;
+    dataGeneration++;
     return true;
   } else {
     LOG_INFO_LN("setMaxVolume() - Unable to write data to NVS, giving up...");
@@ -139,6 +147,7 @@ bool TANKLEVEL::setMaxVolume(uint32_t tankvolume, String unit) {
 }
 
 bool TANKLEVEL::updateOffsetNVS() {
+  METRICS_SCOPE(metricsNvsWrite);
   if (preferences.begin(NVS.c_str(), false)) {
     preferences.putDouble("offset", levelConfig.offset);
     preferences.end();
@@ -149,7 +158,16 @@ bool TANKLEVEL::updateOffsetNVS() {
   }
 }
 
+// NVS key of a level data point, without building Strings on the heap
+const char * TANKLEVEL::levelKey(char * key, size_t size, uint8_t i) {
+  snprintf(key, size, "val%u", i);
+  return key;
+}
+
 bool TANKLEVEL::writeToNVS() {
+  METRICS_SCOPE(metricsNvsWrite);
+  // levelConfig was changed by the caller, even if writing fails
+  dataGeneration++;
   if (preferences.begin(NVS.c_str(), false)) {
     preferences.clear();
     preferences.putBool("setupDone", true);
@@ -158,8 +176,9 @@ bool TANKLEVEL::writeToNVS() {
     preferences.putUInt("volume", levelConfig.volumeMilliLiters);
     preferences.putUChar("pressurizelevel", levelConfig.pressurizeOnLevel);
 
+    char key[8];
     for (uint8_t i = 0; i <= 100; i++) {
-      preferences.putInt(String("val" + String(i)).c_str(), levelConfig.readings[i]);
+      preferences.putInt(levelKey(key, sizeof(key), i), levelConfig.readings[i]);
       // LOG_INFO("Write new value = ");
       // LOG_INFO_LN(levelConfig.readings[i]);
     }
@@ -173,13 +192,16 @@ bool TANKLEVEL::writeToNVS() {
 }
 
 bool TANKLEVEL::writeSingleEntrytoNVS(uint8_t i, int value) {
+  METRICS_SCOPE(metricsNvsWrite);
+  dataGeneration++;
   if (i == 255 && preferences.begin(NVS.c_str(), false)) {
     preferences.putBool("setupDone", value > 0);
     preferences.end();
     return true;
   } else if (i < 0 or i > 100) return false;
   if (preferences.begin(NVS.c_str(), false)) {
-    preferences.putInt(String("val" + String(i)).c_str(), value);
+    char key[8];
+    preferences.putInt(levelKey(key, sizeof(key), i), value);
     preferences.end();
     return true;
   }
@@ -205,7 +227,7 @@ void TANKLEVEL::begin(String ns) {
   NVS = ns;
 
   if (!preferences.begin(NVS.c_str(), false)) {
-    LOG_INFO_LN("Error opening NVS Namespace, giving up...");
+    LOG_ERROR_LN("Error opening NVS Namespace, giving up...");
   } else {
     levelConfig.setupDone = preferences.getBool("setupDone", false);
     levelConfig.airPressureOnFilling = preferences.getUInt("airpressure", 0);
@@ -216,8 +238,9 @@ void TANKLEVEL::begin(String ns) {
 
     if (levelConfig.setupDone) {
       LOG_INFO_LN("LevelData restored from Storage...");
+      char key[8];
       for (uint8_t i = 0; i <= 100; i++) {
-        levelConfig.readings[i] = preferences.getInt(String("val" + String(i)).c_str(), 0);
+        levelConfig.readings[i] = preferences.getInt(levelKey(key, sizeof(key), i), 0);
       }
     } else {
       LOG_INFO_LN("No stored configuration found on NVS...");
@@ -236,6 +259,7 @@ bool TANKLEVEL::isConfigured() {
 
 double TANKLEVEL::getSensorRawMedianReading(bool cached) {
   if(cached) return lastRawReading;
+  METRICS_SCOPE(metricsSensorRead);
   lastRawReading = hx711.read_median(10);
   hasSensorError = lastRawReading == 0;
   //LOG_INFO_F("Current sensor raw reading %.2f\n", lastRawReading);
@@ -248,22 +272,59 @@ int TANKLEVEL::getCalulcatedMedianReading(bool cached) {
   return lastMedian;
 }
 
+void TANKLEVEL::publishSnapshot() {
+  // Everything that takes time is prepared outside of the critical section
+  snapshot_t next;
+  next.time = runtime();
+  next.level = level;
+  next.volume = getCurrentVolume();
+  next.sensorPressure = lastMedian;
+  next.sensorRaw = lastRawReading;
+  next.airPressure = airPressure;
+  next.error = hasSensorError;
+  next.configured = levelConfig.setupDone;
+
+  portENTER_CRITICAL(&snapshotMux);
+  next.sample = snapshotData.sample + 1;
+  snapshotData = next;
+  portEXIT_CRITICAL(&snapshotMux);
+}
+
+TANKLEVEL::snapshot_t TANKLEVEL::getSnapshot() {
+  portENTER_CRITICAL(&snapshotMux);
+  snapshot_t copy = snapshotData;
+  portEXIT_CRITICAL(&snapshotMux);
+  return copy;
+}
+
 uint8_t TANKLEVEL::calculateLevel() {
+  METRICS_SCOPE(metricsCalculateLevel);
   // Find the highest percentage of the current reading value
   if (levelConfig.setupDone)
   {
     for(uint8_t x=100; x>0; x--) {
       if (lastMedian >= levelConfig.readings[x]) {
           level = x;
+          levelFraction = interpolateLevel(x);
           return level;
       }
     }
-  }
+    levelFraction = interpolateLevel(0);
+  } else levelFraction = 0.0;
   level = 0;
   return level;
 }
 
+float TANKLEVEL::interpolateLevel(uint8_t x) {
+  if (x >= 100) return 1.0;
+  int low = levelConfig.readings[x];
+  int high = levelConfig.readings[x+1];
+  float part = high > low ? (float)(lastMedian - low) / (high - low) : 0.0;
+  return (x + constrain(part, 0.0f, 1.0f)) / 100.0;
+}
+
 bool TANKLEVEL::updateAirPressureNVS(uint32_t newPressure) {
+  METRICS_SCOPE(metricsNvsWrite);
   if (preferences.begin(NVS.c_str(), false)) {
     // prevent unneccessary writes to NVS, only if there is a larger pressure difference
     uint32_t old = preferences.getUInt("airpressure");
@@ -285,6 +346,7 @@ bool TANKLEVEL::setPressurizeOnLevelNVS(uint8_t newLevel, bool writeNVS) {
   levelConfig.pressurizeOnLevel = newLevel;
   if (writeNVS && preferences.begin(NVS.c_str(), false))
   {
+    METRICS_SCOPE(metricsNvsWrite);
     uint8_t old = preferences.getUChar("pressurizelevel", 255);
     if (old+NVS_WRITE_TOLERANCE_LEVEL > newLevel && old-NVS_WRITE_TOLERANCE_LEVEL < newLevel) {
       // only a minor change, we don't update the old value
@@ -446,5 +508,5 @@ void TANKLEVEL::setAirPressure(int32_t hPa, bool runPumpIfPressureDifferenceIsLa
         activateAirPump("Atmospheric air pressure changed");
       }
     }
-  } else if (hPa != 0) LOG_INFO_F("[ERROR] Invalid airpressure value given. Got %d\n", hPa);
+  } else if (hPa != 0) LOG_ERROR_F("[ERROR] Invalid airpressure value given. Got %d\n", hPa);
 }
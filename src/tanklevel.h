@@ -79,6 +79,9 @@ class TANKLEVEL
         // Write current leveldata to non volatile storage
         bool writeToNVS();
 
+        // NVS key of the level data point i, written to key
+        static const char * levelKey(char * key, size_t size, uint8_t i);
+
         bool setPressurizeOnLevelNVS(uint8_t newLevel, bool writeNVS);
 
         // Automatically enable the Air Pump if air pressure greatly increases or decreases
@@ -93,6 +96,12 @@ class TANKLEVEL
         // True as long as the pump is running
         bool airPumpEnabled = false;
 
+        // Number of air pump runs since boot
+        uint32_t airPumpRuns = 0;
+
+        // Reason given for the last air pump run
+        const char * airPumpReason = "";
+
         // Time when the Air Pump was started
         uint64_t airPumpStarttime = 0;
 
@@ -109,13 +118,59 @@ class TANKLEVEL
         // You need to call getCalulcatedMedianReading() before calculateLevel() to update lastMedian
         uint8_t calculateLevel();
 
+        // Position of lastMedian between the setup points of x and x+1 percent
+        float interpolateLevel(uint8_t x);
+
         // The current level set by calculateLevel()
         uint8_t level = 0;
 
+        // The current level between the setup points, 0.0 - 1.0
+        float levelFraction = 0.0;
+
+	public:
+        // Result of the last measurement, safe to read from other tasks
+        struct snapshot_t {
+            uint32_t sample = 0;                   // counts measurements, changes with every new reading
+            uint64_t time = 0;                     // runtime() of the measurement
+            uint8_t level = 0;
+            uint32_t volume = 0;                   // milliliters
+            int sensorPressure = 0;                // calculated median reading
+            double sensorRaw = 0.0;                // raw median reading
+            int airPressure = 0;                   // hPa
+            bool error = false;
+            bool configured = false;
+        };
+
+	private:
+        // Protects snapshotData, only held for the copy so readers on the other core never wait long
+        portMUX_TYPE snapshotMux = portMUX_INITIALIZER_UNLOCKED;
+        snapshot_t snapshotData;
+
+        // Request to measure in the next loop() regardless of the interval
+        volatile bool freshReadingRequested = false;
+
+        // Publish the current values for readers in other tasks
+        void publishSnapshot();
+
+        // Invalidates cached API responses of the level data
+        volatile uint32_t dataGeneration = 0;
+
 	public:
+        // Consistent copy of the last measurement, never touches the sensor
+        snapshot_t getSnapshot();
+
+        // Measure as soon as possible, getSnapshot().sample changes once done
+        void requestFreshReading() { freshReadingRequested = true; }
+
+        // Changes whenever the level data, setup state or volume changes
+        uint32_t getDataGeneration() { return dataGeneration; }
+
         // Get the current level calculcated and updated in loop()
         uint8_t getLevel() { return level; }
 
+        // Get the current level interpolated between the setup points, 0.0 - 1.0
+        float getLevelFraction() { return levelFraction; }
+
         // get Last Median reading value updated in loop()
         int getLastMedian() { return lastMedian; }
 
@@ -128,12 +183,19 @@ class TANKLEVEL
         // Set a new duration for the Air Pump runtime
         void setAirPumpDuration(uint64_t d) { airPumpDurationMS = d; }
 
-        // Start/Activate the Air Pump
-        void activateAirPump(String reason = "");
+        // Start/Activate the Air Pump, the reason must be a string literal
+        void activateAirPump(const char * reason = "");
 
         // Stop/Deactivate the Air Pump
         void deactivateAirPump();
 
+        // True as long as the Air Pump is running
+        bool isAirPumpRunning() { return airPumpEnabled; }
+
+        // Number of air pump runs since boot
+        uint32_t getAirPumpRuns() { return airPumpRuns; }
+        const char * getAirPumpReason() { return airPumpReason; }
+
         // Enable/Disable automatic repressurization
         void setAutomaticAirPump(bool enabled) { automaticAirPump = enabled; }
 
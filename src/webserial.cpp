@@ -14,13 +14,36 @@
 #include <webserial.h>
 
 void WebSerialClass::begin(AsyncWebServer *server, const char* url) {
+  mutex = xSemaphoreCreateMutex();
   webServer = server;
 
   webSocket = new AsyncWebSocket("/api/webserial");
   webSocket->onEvent([&](AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len) -> void {
     if(type == WS_EVT_CONNECT){
-      LOG_INFO_LN(F("[WEBSERIAL] Client connection received"));
+      bool accepted = false;
+      xSemaphoreTake(mutex, portMAX_DELAY);
+      for (uint8_t i=0; i < WEBSERIAL_MAX_CLIENTS && !accepted; i++) {
+        if (clientIds[i]) continue;
+        clientIds[i] = client->id();
+        clientDropped[i] = 0;
+        accepted = true;
+      }
+      if (accepted) replayLocked(client);
+      else metrics.rejectedClients++;
+      xSemaphoreGive(mutex);
+
+      if (accepted) {
+        LOG_INFO_LN(F("[WEBSERIAL] Client connection received"));
+      } else {
+        LOG_INFO_LN(F("[WEBSERIAL] Too many clients, closing connection"));
+        client->close();
+      }
     } else if(type == WS_EVT_DISCONNECT){
+      xSemaphoreTake(mutex, portMAX_DELAY);
+      for (uint8_t i=0; i < WEBSERIAL_MAX_CLIENTS; i++) {
+        if (clientIds[i] == client->id()) clientIds[i] = 0;
+      }
+      xSemaphoreGive(mutex);
       LOG_INFO_LN(F("[WEBSERIAL] Client disconnected"));
     } else if(type == WS_EVT_DATA){
       LOG_INFO_LN(F("[WEBSERIAL] Received Websocket Data"));
@@ -31,105 +54,90 @@ void WebSerialClass::begin(AsyncWebServer *server, const char* url) {
   LOG_INFO_LN(F("[WEBSERIAL] Attached AsyncWebServer along with Websockets"));
 }
 
-void WebSerialClass::print(int c) {
-  if (webServer != nullptr) webSocket->textAll(String(c));
-}
-
-void WebSerialClass::print(uint8_t c) {
-  if (webServer != nullptr) webSocket->textAll(String(c));
-}
-
-void WebSerialClass::print(uint16_t c) {
-  if (webServer != nullptr) webSocket->textAll(String(c));
-}
-
-void WebSerialClass::print(uint32_t c) {
-  if (webServer != nullptr) webSocket->textAll(String(c));
-}
-
-void WebSerialClass::print(double c) {
-  if (webServer != nullptr) webSocket->textAll(String(c));
-}
-
-void WebSerialClass::print(float c) {
-  if (webServer != nullptr) webSocket->textAll(String(c));
-}
-
-void WebSerialClass::print(const char * c) {
-  if (webServer != nullptr) webSocket->textAll(c);
-}
-
-void WebSerialClass::print(char * c) {
-  if (webServer != nullptr) webSocket->textAll(c);
-}
-
-void WebSerialClass::print(String c) {
-  if (webServer != nullptr) webSocket->textAll(c);
-}
-
-void WebSerialClass::println(int c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
-
-void WebSerialClass::println(uint8_t c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
-
-void WebSerialClass::println(uint16_t c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
-
-void WebSerialClass::println(uint32_t c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
-
-void WebSerialClass::println(float c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
-
-void WebSerialClass::println(double c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
-
-void WebSerialClass::println(const char * c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
-
-void WebSerialClass::println(char * c) {
-  if (webServer != nullptr) webSocket->textAll(String(c) + "\n");        
-}
+void WebSerialClass::loop() {
+  if (webServer == nullptr || batchLen == 0 || millis() - lastFlush < WEBSERIAL_FLUSH_MS) return;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  flushLocked();
+  xSemaphoreGive(mutex);
+}
+
+void WebSerialClass::write(const char * data, size_t len) {
+  // Before begin() only the backlog is filled, nobody else accesses it yet
+  if (mutex) xSemaphoreTake(mutex, portMAX_DELAY);
+  for (size_t i = 0; i < len; ) {
+    size_t n = sizeof(backlog) - backlogPos;
+    if (n > len - i) n = len - i;
+    memcpy(backlog + backlogPos, data + i, n);
+    backlogPos += n;
+    i += n;
+    if (backlogPos == sizeof(backlog)) {
+      backlogPos = 0;
+      backlogFull = true;
+    }
+  }
 
-void WebSerialClass::println(String c) {
-  if (webServer != nullptr) webSocket->textAll(c + "\n");        
+  if (!hasClients()) {
+    batchLen = 0;
+    if (mutex) xSemaphoreGive(mutex);
+    return;
+  }
+  while (len > 0) {
+    if (batchLen == sizeof(batch)) flushLocked();
+    size_t n = sizeof(batch) - batchLen;
+    if (n > len) n = len;
+    memcpy(batch + batchLen, data, n);
+    batchLen += n;
+    data += n;
+    len -= n;
+  }
+  xSemaphoreGive(mutex);
 }
 
-
-// Based on LOG_INFO_F() from arduino/esp32 core
-size_t WebSerialClass::printf(const char *format, ...) {
-  char loc_buf[64];
-  char * temp = loc_buf;
-  va_list arg;
-  va_list copy;
-  va_start(arg, format);
-  va_copy(copy, arg);
-  int len = vsnprintf(temp, sizeof(loc_buf), format, copy);
-  va_end(copy);
-  if (len < 0) {
-    va_end(arg);
-    return 0;
-  };
-  if (len >= sizeof(loc_buf)) {
-    temp = (char*) malloc(len+1);
-    if(temp == NULL) {
-      va_end(arg);
-      return 0;
+void WebSerialClass::replayLocked(AsyncWebSocketClient * client) {
+  // Oldest part first, once the backlog wrapped it starts after the first line break
+  const char * older = backlog + backlogPos;
+  size_t olderLen = backlogFull ? sizeof(backlog) - backlogPos : 0;
+  const char * eol = (const char *)memchr(older, '\n', olderLen);
+  if (eol) {
+    olderLen -= eol + 1 - older;
+    older = eol + 1;
+  }
+  if (olderLen + backlogPos == 0) return;
+
+  AsyncWebSocketMessageBuffer * buffer = webSocket->makeBuffer(olderLen + backlogPos);
+  if (!buffer) return;
+  memcpy(buffer->get(), older, olderLen);
+  memcpy(buffer->get() + olderLen, backlog, backlogPos);
+  client->text(buffer);
+}
+
+void WebSerialClass::flushLocked() {
+  if (batchLen == 0) return;
+  for (uint8_t i=0; i < WEBSERIAL_MAX_CLIENTS; i++) {
+    if (!clientIds[i]) continue;
+    AsyncWebSocketClient * client = webSocket->client(clientIds[i]);
+    if (!client) continue;
+
+    // A slow client must not queue up messages until the heap runs out
+    if (client->queueLen() >= WEBSERIAL_MAX_QUEUED) {
+      clientDropped[i]++;
+      metrics.dropped++;
+      continue;
+    }
+    if (clientDropped[i]) {
+      char note[64];
+      int len = snprintf(note, sizeof(note), "[WEBSERIAL] %u messages dropped, connection too slow\n", clientDropped[i]);
+      client->text(note, len);
+      clientDropped[i] = 0;
     }
-    len = vsnprintf(temp, len+1, format, arg);
+    client->text(batch, batchLen);
   }
-  va_end(arg);
-
-  print(String((uint8_t*)temp, len));
+  metrics.batches++;
+  batchLen = 0;
+  lastFlush = millis();
+}
 
-  if(temp != loc_buf) free(temp);
-  return len;
+// Skip the batch if nobody is listening
+bool WebSerialClass::hasClients() {
+  return webServer != nullptr && webSocket->count() > 0;
 }
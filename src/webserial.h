@@ -15,35 +15,52 @@
 
 #include <ESPAsyncWebServer.h>
 
+#define WEBSERIAL_BATCH_SIZE 1024               // log text collected before it is sent as one message
+#define WEBSERIAL_FLUSH_MS 250                  // send the collected log text at least this often
+#define WEBSERIAL_MAX_CLIENTS 4                 // further connections are closed
+#define WEBSERIAL_MAX_QUEUED 4                  // drop batches for clients with more messages waiting
+#define WEBSERIAL_BACKLOG_SIZE 2048             // recent log text replayed to new clients
+
 class WebSerialClass {
     public:
+        // Counters exposed through the API
+        struct metrics_t {
+            uint32_t batches = 0;               // sent batches of log text
+            uint32_t dropped = 0;               // batches not sent to a slow client
+            uint32_t rejectedClients = 0;       // connections closed due to WEBSERIAL_MAX_CLIENTS
+        } metrics;
+
         void begin(AsyncWebServer *server, const char* url = "/api/webserial");
 
-        void print(int c);
-        void print(uint8_t c);
-        void print(uint16_t c);
-        void print(uint32_t c);
-        void print(double c);
-        void print(float c);
-        void print(const char * c);
-        void print(char * c);
-        void print(String c);
-
-        void println(int c);
-        void println(uint8_t c);
-        void println(uint16_t c);
-        void println(uint32_t c);
-        void println(float c);
-        void println(double c);
-        void println(const char * c);
-        void println(char * c);
-        void println(String c);
-
-        size_t printf(const char *format, ...);
+        // Send the collected log text, call it regularly from loop()
+        void loop();
+
+        // Append log text to the batch and the backlog, called by the log ring drain task
+        void write(const char * data, size_t len);
 
     private:
+        bool hasClients();
+
+        // Send the recent log text to a new client as one message, requires the mutex
+        void replayLocked(AsyncWebSocketClient * client);
+
+        // Send the batch to all clients that keep up, requires the mutex
+        void flushLocked();
+
         AsyncWebSocket * webSocket;
         AsyncWebServer * webServer = nullptr;
+        SemaphoreHandle_t mutex = NULL;
+
+        char batch[WEBSERIAL_BATCH_SIZE];
+        size_t batchLen = 0;
+        uint64_t lastFlush = 0;
+
+        char backlog[WEBSERIAL_BACKLOG_SIZE];
+        size_t backlogPos = 0;                  // next byte to write
+        bool backlogFull = false;               // wrapped at least once
+
+        uint32_t clientIds[WEBSERIAL_MAX_CLIENTS] = {0};     // connected clients, 0 is a free slot
+        uint32_t clientDropped[WEBSERIAL_MAX_CLIENTS] = {0}; // batches dropped since the last one sent
 };
 
 #endif // WEBSERIAL_h
@@ -0,0 +1,151 @@
+/**
+ * @file codec-benchmark.cpp
+ * @author Martin Verges <martin@verges.cc>
+ * @brief Host benchmark of the history encoding in src/seriescodec.cpp
+ * @version 0.1
+ * @date 2022-07-09
+ *
+ * @copyright Copyright (c) 2022 by the author alone
+ *            https://gitlab.womolin.de/martin.verges/waterlevel
+ *
+ * License: CC BY-NC-SA 4.0
+ *
+ * Build and run on the host:
+ *   g++ -O2 -std=c++17 -I src tools/codec-benchmark.cpp src/seriescodec.cpp -o codec-benchmark && ./codec-benchmark
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "seriescodec.h"
+
+#define BENCHMARK_RECORDS 100000
+#define BENCHMARK_ROUNDS 20
+
+// Deterministic noise, so the results are comparable between runs
+static uint32_t seed = 42;
+static int noise(int amplitude) {
+  seed = seed * 1664525 + 1013904223;
+  return (int)((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+// Raw samples every 5 seconds, rollups of interval seconds otherwise
+static std::vector<history_record_t> generate(uint32_t interval, int drainPerHour, int pressureNoise) {
+  std::vector<history_record_t> series;
+  uint16_t count = interval == 5 ? 1 : interval / 5;
+  double level = 90.0;
+  uint32_t time = 1660000000;
+  for (int i = 0; i < BENCHMARK_RECORDS; i++) {
+    level -= drainPerHour * interval / 3600.0;
+    if (level < 5) level = 90;
+    int32_t pressure = (int32_t)(level * 40) + 500;
+    history_record_t rec;
+    rec.time = time;
+    rec.count = count;
+    rec.levelAvg = (uint8_t)level;
+    rec.pressureAvg = pressure + noise(pressureNoise);
+    if (count == 1) {
+      rec.levelMin = rec.levelMax = rec.levelAvg;
+      rec.pressureMin = rec.pressureMax = rec.pressureAvg;
+    } else {
+      rec.levelMin = rec.levelAvg - (drainPerHour ? 1 : 0);
+      rec.levelMax = rec.levelAvg;
+      rec.pressureMin = rec.pressureAvg - abs(noise(pressureNoise * 2));
+      rec.pressureMax = rec.pressureAvg + abs(noise(pressureNoise * 2));
+    }
+    series.push_back(rec);
+    // An occasional late sample
+    time += interval + (noise(50) == 0 ? 1 : 0);
+  }
+  return series;
+}
+
+static bool equal(const history_record_t &a, const history_record_t &b) {
+  return a.time == b.time && a.count == b.count && a.levelMin == b.levelMin && a.levelAvg == b.levelAvg && a.levelMax == b.levelMax
+    && a.pressureMin == b.pressureMin && a.pressureAvg == b.pressureAvg && a.pressureMax == b.pressureMax;
+}
+
+static size_t jsonSize(const std::vector<history_record_t> &series) {
+  size_t size = 0;
+  char line[128];
+  for (const history_record_t &rec : series) {
+    size += snprintf(line, sizeof(line), ",[%u,%u,%u,%u,%u,%d,%d,%d]",
+      rec.time, rec.count, rec.levelMin, rec.levelAvg, rec.levelMax, rec.pressureMin, rec.pressureAvg, rec.pressureMax
+    );
+  }
+  return size;
+}
+
+static void benchmark(const char *name, const std::vector<history_record_t> &series) {
+  std::vector<uint8_t> encoded(series.size() * SERIES_MAX_RECORD_SIZE);
+  std::vector<history_record_t> decoded(series.size());
+  size_t length = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+    series_state_t state;
+    length = 0;
+    for (const history_record_t &rec : series) length += seriesEncode(state, rec, encoded.data() + length);
+  }
+  double encodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+    series_state_t state;
+    size_t pos = 0;
+    for (history_record_t &rec : decoded) pos += seriesDecode(state, encoded.data() + pos, length - pos, rec);
+  }
+  double decodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  for (size_t i = 0; i < series.size(); i++) {
+    if (!equal(series[i], decoded[i])) {
+      printf("%-22s round trip FAILED at record %zu\n", name, i);
+      exit(1);
+    }
+  }
+
+  double records = (double)series.size() * BENCHMARK_ROUNDS;
+  printf("%-22s %8.2f %8.2f %8.2f %12.1f %12.1f\n", name,
+    (double)length / series.size(), (double)sizeof(history_record_t), (double)jsonSize(series) / series.size(),
+    records / encodeSeconds / 1e6, records / decodeSeconds / 1e6
+  );
+}
+
+int main() {
+  printf("%-22s %8s %8s %8s %12s %12s\n", "series", "B/rec", "fixed", "json", "enc Mrec/s", "dec Mrec/s");
+  benchmark("raw, idle tank", generate(5, 0, 0));
+  benchmark("raw, noisy sensor", generate(5, 0, 3));
+  benchmark("raw, draining tank", generate(5, 20, 3));
+  benchmark("1m rollups", generate(60, 5, 3));
+  benchmark("15m rollups", generate(900, 5, 3));
+
+  // Edge cases must survive the round trip as well
+  std::vector<history_record_t> edge = {
+    { 0, 0, 0, 0, 0, INT32_MIN, 0, INT32_MAX },
+    { UINT32_MAX, UINT16_MAX, 0, 255, 255, INT32_MIN, INT32_MIN, INT32_MIN },
+    { 1, 1, 255, 0, 0, INT32_MAX, INT32_MAX, INT32_MAX },
+  };
+  uint8_t buffer[SERIES_MAX_RECORD_SIZE * 3];
+  series_state_t encoder, decoder;
+  size_t length = 0, pos = 0;
+  for (const history_record_t &rec : edge) {
+    size_t len = seriesEncode(encoder, rec, buffer + length);
+    if (len > SERIES_MAX_RECORD_SIZE) {
+      printf("edge case exceeds SERIES_MAX_RECORD_SIZE with %zu bytes\n", len);
+      return 1;
+    }
+    length += len;
+  }
+  for (const history_record_t &rec : edge) {
+    history_record_t out;
+    size_t len = seriesDecode(decoder, buffer + pos, length - pos, out);
+    if (!len || !equal(rec, out)) {
+      printf("edge case round trip FAILED\n");
+      return 1;
+    }
+    pos += len;
+  }
+  printf("edge cases ok\n");
+  return 0;
+}
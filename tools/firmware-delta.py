@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+
+# Create a patch from the firmware running on a sensor to a new firmware, to be uploaded
+# to /api/update/delta. The sensor rebuilds the new image from the patch and its running
+# partition, see OtaDelta in src/otaupdate.h for the format.
+#
+#   tools/firmware-delta.py old/firmware.bin .pio/build/esp32dev/firmware.bin -o firmware.patch
+#
+# The SHA-256 of the running firmware is shown by /api/firmware/info, the patch is
+# refused by sensors running a different one.
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b'WLDP'
+VERSION = 1
+HEADER = struct.Struct('<4sB3x32sI32s')     # magic, version, source SHA-256, target size, target SHA-256
+OP_END = 0
+OP_COPY = 1                                 # u32 offset in the running partition, u32 length
+OP_INSERT = 2                               # u32 length and the data
+
+BLOCK = 32                                  # shortest copy worth its 9 bytes
+STEP = 4                                    # the old image is indexed at every 4th byte
+
+def firmwareId(image):
+    # Like esp_partition_get_sha256(): images with an appended hash are identified by it
+    if len(image) > 24 + 32 and image[0] == 0xE9 and image[23] == 1:
+        return hashlib.sha256(image[:-32]).digest()
+    return hashlib.sha256(image).digest()
+
+def matchLength(old, oldPos, new, newPos):
+    length = 0
+    limit = min(len(old) - oldPos, len(new) - newPos)
+    while length + 256 <= limit and old[oldPos+length:oldPos+length+256] == new[newPos+length:newPos+length+256]:
+        length += 256
+    while length < limit and old[oldPos+length] == new[newPos+length]:
+        length += 1
+    return length
+
+def diff(old, new):
+    index = {}
+    for pos in range(0, len(old) - BLOCK + 1, STEP):
+        index.setdefault(old[pos:pos+BLOCK], pos)
+
+    ops = []
+    pending = bytearray()
+    expected = 0                            # continue after the last copy if the data still matches there
+    pos = 0
+    while pos < len(new):
+        key = new[pos:pos+BLOCK]
+        source = expected if key == old[expected:expected+BLOCK] else index.get(key)
+        length = matchLength(old, source, new, pos) if source is not None else 0
+        if length < BLOCK:
+            pending.append(new[pos])
+            pos += 1
+            continue
+        pos += length
+
+        # Grow the copy backwards into the data that would be inserted
+        while pending and source > 0 and old[source-1] == pending[-1]:
+            pending.pop()
+            source -= 1
+            length += 1
+        if pending:
+            ops.append((OP_INSERT, bytes(pending)))
+            pending = bytearray()
+        ops.append((OP_COPY, source, length))
+        expected = source + length
+    if pending:
+        ops.append((OP_INSERT, bytes(pending)))
+    return ops
+
+def encode(old, new, ops):
+    patch = bytearray(HEADER.pack(MAGIC, VERSION, firmwareId(old), len(new), hashlib.sha256(new).digest()))
+    for op in ops:
+        if op[0] == OP_COPY:
+            patch += struct.pack('<BII', OP_COPY, op[1], op[2])
+        else:
+            patch += struct.pack('<BI', OP_INSERT, len(op[1])) + op[1]
+    patch.append(OP_END)
+    return bytes(patch)
+
+def apply(old, patch):
+    magic, version, source, size, target = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a patch")
+    if source != firmwareId(old):
+        raise ValueError("patch is for a different firmware")
+    out = bytearray()
+    pos = HEADER.size
+    while patch[pos] != OP_END:
+        if patch[pos] == OP_COPY:
+            offset, length = struct.unpack_from('<II', patch, pos + 1)
+            out += old[offset:offset+length]
+            pos += 9
+        elif patch[pos] == OP_INSERT:
+            length, = struct.unpack_from('<I', patch, pos + 1)
+            out += patch[pos+5:pos+5+length]
+            pos += 5 + length
+        else:
+            raise ValueError("unknown operation %u at %u" % (patch[pos], pos))
+    if len(out) != size or hashlib.sha256(out).digest() != target:
+        raise ValueError("patch does not produce the target")
+    return bytes(out)
+
+parser = argparse.ArgumentParser(description="Create a delta update for /api/update/delta")
+parser.add_argument('old', help="firmware.bin running on the sensor")
+parser.add_argument('new', help="firmware.bin to install")
+parser.add_argument('-o', '--output', help="patch file to write", metavar='<file>', required=True)
+args = parser.parse_args()
+
+with open(args.old, 'rb') as f:
+    old = f.read()
+with open(args.new, 'rb') as f:
+    new = f.read()
+
+ops = diff(old, new)
+patch = encode(old, new, ops)
+try:
+    apply(old, patch)
+except ValueError as e:
+    sys.exit("[ERROR] Verification of the patch failed: %s" % e)
+
+with open(args.output, 'wb') as f:
+    f.write(patch)
+
+copied = sum(op[2] for op in ops if op[0] == OP_COPY)
+print("Patch of %u bytes (%.1f%% of %u), %u operations, %u bytes copied from the running firmware" % (
+    len(patch), 100.0 * len(patch) / len(new), len(new), len(ops), copied))
+print("Running firmware must have SHA-256 %s" % firmwareId(old).hex())
+print("Upload with: curl -F \"file=@%s\" http://<sensor>/api/update/delta" % args.output)
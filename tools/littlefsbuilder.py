@@ -16,6 +16,8 @@
 # else than an ESP32 microcontroller.
 # ===============================================================
 
+import gzip
+import hashlib
 import os
 import stat
 import sys
@@ -58,3 +60,42 @@ elif platform == "win32":
     print("[WARN] No automatic UI build for this platform", file=sys.stderr)
 
 env.Replace(MKFSTOOL=file)
+
+# Compress the UI and write content hash ETags before the image is built.
+# The firmware serves <file>.gz with Content-Encoding: gzip (see src/gzipstatic.cpp),
+# the uncompressed originals are removed to save space on the LittleFS partition.
+GZIP_EXTENSIONS = (".html", ".js", ".css", ".json", ".svg", ".txt", ".ico", ".map", ".webmanifest", ".xml")
+ETAG_FILE = "etags.txt"
+
+def compress_ui(source, target, env):
+    data_dir = env.subst("$PROJECT_DATA_DIR")
+    etags = {}
+    for root, dirs, files in os.walk(data_dir):
+        for name in sorted(files):
+            file = os.path.join(root, name)
+            url = "/" + os.path.relpath(file, data_dir).replace(os.sep, "/")
+            if url == "/" + ETAG_FILE:
+                continue
+
+            if name.endswith(".gz"):
+                # compressed by an earlier run, the ETag is based on the original content
+                with open(file, "rb") as f:
+                    content = gzip.decompress(f.read())
+                url = url[:-3]
+            else:
+                with open(file, "rb") as f:
+                    content = f.read()
+                if name.endswith(GZIP_EXTENSIONS):
+                    # mtime=0 keeps the output identical for identical input
+                    with open(file + ".gz", "wb") as f:
+                        f.write(gzip.compress(content, 9, mtime=0))
+                    os.remove(file)
+
+            etags[url] = '"%s"' % hashlib.sha256(content).hexdigest()[:16]
+
+    with open(os.path.join(data_dir, ETAG_FILE), "w") as f:
+        for url in sorted(etags):
+            f.write("%s %s\n" % (url, etags[url]))
+    print("Compressed UI in %s, %d ETags written" % (data_dir, len(etags)))
+
+env.AddPreAction("$BUILD_DIR/littlefs.bin", compress_ui)
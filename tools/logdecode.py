@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+
+# Decode the serial output of a firmware built with -D LOG_BINARY=1.
+# The format strings are taken from the LOG_*_F() calls in the sources and hashed
+# like logFormatId() in src/logbinary.h, text output is passed through unchanged.
+#
+#   tools/logdecode.py capture.bin
+#   tools/logdecode.py -p /dev/ttyUSB0
+
+import argparse
+import codecs
+import os
+import re
+import struct
+import sys
+
+MARKER = 0xFF
+HEADER_SIZE = 6
+
+CALL = re.compile(r'LOG_(?:ERROR|WARN|INFO|DEBUG)_F\s*\(\s*((?:"(?:[^"\\]|\\.)*"|PRI[a-zA-Z0-9]+|\s)+),')
+PIECE = re.compile(r'"((?:[^"\\]|\\.)*)"|PRI([diouxX])(8|16|32|64|PTR|MAX)')
+SPEC = re.compile(r'%([-+ #0]*)(\d+)?(?:\.(\d+))?(hh|h|ll|l|j|z|t|L)?([diouxXeEfFgGcsp%])')
+
+def formatId(text):
+    hash = 2166136261
+    for byte in text:
+        hash = ((hash ^ byte) * 16777619) & 0xFFFFFFFF
+    return hash
+
+def literal(args):
+    text = b''
+    for match in PIECE.finditer(args):
+        if match.group(1) is not None:
+            text += codecs.escape_decode(match.group(1).encode())[0]
+        else:
+            # 64 bit types are long long on the ESP32
+            text += (b'll' if match.group(3) == '64' else b'') + match.group(2).encode()
+    return text
+
+def loadFormats(folder):
+    formats = {}
+    for root, dirs, files in os.walk(folder):
+        for name in files:
+            if not name.endswith(('.cpp', '.h')):
+                continue
+            with open(os.path.join(root, name), encoding='utf-8', errors='replace') as source:
+                for match in CALL.finditer(source.read()):
+                    text = literal(match.group(1))
+                    formats[formatId(text)] = text.decode('utf-8', errors='replace')
+    return formats
+
+def decode(fmt, data):
+    pos = 0
+    def take(size):
+        nonlocal pos
+        if pos + size > len(data):
+            raise ValueError
+        chunk = data[pos:pos + size]
+        pos += size
+        return chunk
+
+    def convert(match):
+        flags, width, precision, length, conv = match.groups()
+        if conv == '%':
+            return '%'
+        spec = '%' + flags + (width or '') + ('.' + precision if precision else '')
+        try:
+            if conv == 's':
+                size = take(1)[0]
+                return (spec + 's') % take(size).decode('utf-8', errors='replace')
+            if conv in 'eEfFgG':
+                return (spec + conv) % struct.unpack('<f', take(4))[0]
+            wide = length in ('ll', 'j')
+            raw = take(8 if wide else 4)
+            signed = conv in 'di'
+            value = int.from_bytes(raw, 'little', signed=signed)
+            if conv == 'c':
+                return chr(value & 0xFF)
+            if conv == 'p':
+                return '0x%08x' % value
+            return (spec + ('d' if conv == 'u' else conv)) % value
+        except ValueError:
+            return '<missing>'
+
+    return SPEC.sub(convert, fmt)
+
+def run(stream, formats, out):
+    buffer = b''
+    while True:
+        chunk = stream.read(max(1, stream.in_waiting)) if hasattr(stream, 'in_waiting') else stream.read(4096)
+        if not chunk:
+            break
+        buffer += chunk
+        while buffer:
+            marker = buffer.find(bytes([MARKER]))
+            if marker < 0:
+                out.write(buffer.decode('utf-8', errors='replace'))
+                buffer = b''
+                break
+            if marker > 0:
+                out.write(buffer[:marker].decode('utf-8', errors='replace'))
+                buffer = buffer[marker:]
+            if len(buffer) < HEADER_SIZE or len(buffer) < HEADER_SIZE + buffer[5]:
+                break
+            id = struct.unpack('<I', buffer[1:5])[0]
+            args = buffer[HEADER_SIZE:HEADER_SIZE + buffer[5]]
+            buffer = buffer[HEADER_SIZE + buffer[5]:]
+            if id in formats:
+                out.write(decode(formats[id], args))
+            else:
+                out.write('[LOGDECODE] Unknown format ID 0x%08x with %u bytes of arguments\n' % (id, len(args)))
+        out.flush()
+
+parser = argparse.ArgumentParser(description="Decode binary log records of the waterlevel firmware")
+parser.add_argument('input', nargs='?', help="Captured serial output, standard input if neither a file nor a port is given")
+parser.add_argument('-p', '--port', help="Serial port to read from, requires pyserial", metavar='<port>')
+parser.add_argument('-b', '--baud', help="Baud rate of the serial port", type=int, default=115200)
+parser.add_argument('-s', '--source', help="Source folder with the format strings",
+                    default=os.path.normpath(os.path.dirname(__file__) + '/../src'), metavar='<folder>')
+args = parser.parse_args()
+
+formats = loadFormats(args.source)
+if not formats:
+    sys.exit("[ERROR] No LOG_*_F() format strings found in %s" % args.source)
+
+try:
+    if args.port:
+        import serial
+        run(serial.Serial(args.port, args.baud), formats, sys.stdout)
+    elif args.input:
+        with open(args.input, 'rb') as capture:
+            run(capture, formats, sys.stdout)
+    else:
+        run(sys.stdin.buffer, formats, sys.stdout)
+except KeyboardInterrupt:
+    pass
@@ -4,6 +4,8 @@ import { error } from '@sveltejs/kit';
 export function GET() {
 	let responseBody = {
 		enableBle: true,
+		bleBroadcast: false,
+		bleAdvInterval: 1000,
 		enableDac: false,
 		enableMqtt: true,
 		enableSoftAp: true,
@@ -17,7 +19,9 @@ export function GET() {
 		mqttPass: 'abcd1234',
 		mqttPort: 1883,
 		mqttTopic: 'freshwater',
-		mqttUser: 'freshwater'
+		mqttUser: 'freshwater',
+		burstMode: false,
+		burstEvery: 6
 	};
 	return new Response(JSON.stringify(responseBody), { status: 200 });
 }
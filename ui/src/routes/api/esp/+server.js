@@ -52,8 +52,7 @@ export function GET() {
 			flashChipSize: 4194304,
 			flashChipRealSize: 4194304,
 			flashChipSpeedMHz: 80,
-			flashChipMode: 2,
-			sdkVersion: 4194304
+			flashChipMode: 2
 		},
 		sketch: {
 			size: 1479392,